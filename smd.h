@@ -6,5 +6,6 @@
 #include "minfs.h"
 #include "sock.h"
 #include "thread.h"
+#include "smd_pool.h"
 #include "smd_proc.h"
 // todo: cross platform fiber support
\ No newline at end of file
@@ -0,0 +1,699 @@
+/*
+ * Work-stealing thread pool. Each worker owns a Chase-Lev deque it pushes and pops at
+ * the bottom while idle workers steal from the top; tasks queued from other threads go
+ * through a shared injection queue. Task groups give fork-join: a thread waiting on a
+ * group runs queued tasks until the group's own tasks are done. smd_parallel_for, _reduce
+ * and _scan split index ranges over a default pool started on first use.
+ */
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef SMD_API
+#define SMD_API
+#endif
+
+#include "thread.h"
+
+typedef void (*smd_task_fn)(void* ctx);
+
+typedef struct smd_pool_t smd_pool_t;
+
+// Tracks a set of tasks so a thread can wait for all of them. Lives wherever the caller
+// likes (typically the stack of the function that forks); the fields are internal.
+typedef struct smd_task_group_t {
+  smd_pool_t* pool;
+  long volatile pending;
+  long volatile waking; // finishing tasks that may still touch the group
+  long volatile sleeping;
+  thread_signal_t done;
+} smd_task_group_t;
+
+// Starts 'workers' worker threads, or one per core (thread_cpu_count) when 'workers' <= 0
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int smd_pool_create(smd_pool_t** pool, int workers);
+
+// Lets the workers run every task still queued, then stops and joins them. No other
+// thread may queue tasks once this has been called.
+SMD_API void smd_pool_destroy(smd_pool_t* pool);
+
+SMD_API int smd_pool_worker_count(smd_pool_t* pool);
+
+// Returns the index of the calling thread among the pool's workers, -1 for any other thread
+SMD_API int smd_pool_worker_index(smd_pool_t* pool);
+
+// Queues fn(ctx) without a group. From a worker the task goes on that worker's own deque,
+// from any other thread through the injection queue. If the task can't be queued (out
+// of memory, injection queue full) it runs on the calling thread instead.
+SMD_API void smd_pool_spawn(smd_pool_t* pool, smd_task_fn fn, void* ctx);
+
+SMD_API void smd_task_group_init(smd_task_group_t* group, smd_pool_t* pool);
+
+// Releases the group. Its tasks must be finished, see smd_task_group_wait
+SMD_API void smd_task_group_term(smd_task_group_t* group);
+
+// Like smd_pool_spawn, and counts the task in 'group'. Tasks of a group may spawn more
+// tasks into the same group.
+SMD_API void smd_task_group_spawn(smd_task_group_t* group, smd_task_fn fn, void* ctx);
+
+// Returns once every task spawned into 'group' has finished, running queued tasks (its
+// own or anyone else's) on the calling thread in the meantime, so recursive fork-join
+// doesn't tie up workers. Only one thread may wait on a group at a time; the group can
+// be spawned into again afterwards.
+SMD_API void smd_task_group_wait(smd_task_group_t* group);
+
+// The pool the smd_parallel_* calls run on, started on first use with one worker per
+// core. Thread safe.
+//
+// Returns NULL if the pool couldn't be started, the parallel calls then run serially
+SMD_API smd_pool_t* smd_pool_default();
+
+// Starts the default pool with 'workers' workers (as smd_pool_create) ahead of the first
+// parallel call, for programs that don't want one worker per core
+//
+// Returns 0 on success, -1 if it couldn't be started or is already running
+SMD_API int smd_pool_default_create(int workers);
+
+// Stops the default pool, if it was started. No parallel call may be running; a later
+// call starts a new one.
+SMD_API void smd_pool_default_destroy();
+
+// Called with consecutive sub-ranges [begin, end) of the loop
+typedef void (*smd_range_fn)(size_t begin, size_t end, void* ctx);
+
+// Folds [begin, end) into 'partial', which starts out as the identity value
+typedef void (*smd_reduce_fn)(size_t begin, size_t end, void* partial, void* ctx);
+
+// result = result (+) partial, for an associative (+). Partials are combined in range
+// order, so (+) doesn't have to be commutative.
+typedef void (*smd_combine_fn)(void* result, const void* partial, void* ctx);
+
+// 'carry' comes in holding the combined value of everything before 'begin' and must be
+// left holding it through 'end' - 1. The first pass ('final' = 0) only needs the values,
+// the second ('final' = 1) writes the prefixes out as well. A range that isn't split runs
+// the final pass alone.
+typedef void (*smd_scan_fn)(size_t begin, size_t end, void* carry, int final, void* ctx);
+
+// Runs fn over [begin, end) split into sub-ranges of at least 'grain' items, on the
+// default pool and the calling thread, and returns when all of them are done. A 'grain'
+// of 0 picks a size that gives each worker several ranges to balance load with.
+SMD_API void smd_parallel_for(size_t begin, size_t end, size_t grain, smd_range_fn fn, void* ctx);
+
+// Reduces [begin, end) into 'result' (of 'value_size' bytes): every sub-range is folded
+// into its own copy of 'identity', then those are combined in order.
+SMD_API void smd_parallel_reduce(size_t begin, size_t end, size_t grain, size_t value_size, const void* identity,
+                                 smd_reduce_fn reduce, smd_combine_fn combine, void* result, void* ctx);
+
+// Inclusive prefix scan over [begin, end) in two passes: the sub-range totals are found in
+// parallel, scanned serially, then each sub-range writes its prefixes starting from its
+// carry. 'total' (of 'value_size' bytes) receives the combined value of the whole range.
+SMD_API void smd_parallel_scan(size_t begin, size_t end, size_t grain, size_t value_size, const void* identity,
+                               smd_scan_fn scan, smd_combine_fn combine, void* total, void* ctx);
+
+#ifdef SMD_POOL_IMPL
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define SMD_POOL_THREAD_LOCAL __declspec(thread)
+// volatile accesses have acquire/release semantics with MSVC's default /volatile:ms
+#define SMD_POOL_LOAD_RELAXED(ptr) (*(ptr))
+#define SMD_POOL_LOAD_ACQUIRE(ptr) (*(ptr))
+#define SMD_POOL_STORE_RELAXED(ptr, value) (*(ptr) = (value))
+#define SMD_POOL_STORE_RELEASE(ptr, value) (*(ptr) = (value))
+#define SMD_POOL_FENCE() MemoryBarrier()
+#define SMD_POOL_CAS64(ptr, expected, desired) \
+  (InterlockedCompareExchange64((ptr), (desired), (expected)) == (expected))
+#define SMD_POOL_CAS(ptr, expected, desired) \
+  (InterlockedCompareExchange((ptr), (desired), (expected)) == (expected))
+#define SMD_POOL_ADD(ptr, value) InterlockedExchangeAdd((ptr), (value))
+#define SMD_POOL_CAS_PTR(ptr, expected, desired) \
+  (InterlockedCompareExchangePointer((PVOID volatile*)(ptr), (desired), (expected)) == (expected))
+#define SMD_POOL_PAUSE() YieldProcessor()
+#else
+#define SMD_POOL_THREAD_LOCAL __thread
+#define SMD_POOL_LOAD_RELAXED(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define SMD_POOL_LOAD_ACQUIRE(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define SMD_POOL_STORE_RELAXED(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELAXED)
+#define SMD_POOL_STORE_RELEASE(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#define SMD_POOL_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define SMD_POOL_CAS64(ptr, expected, desired) __sync_bool_compare_and_swap((ptr), (expected), (desired))
+#define SMD_POOL_CAS(ptr, expected, desired) __sync_bool_compare_and_swap((ptr), (expected), (desired))
+#define SMD_POOL_ADD(ptr, value) __sync_fetch_and_add((ptr), (value))
+#define SMD_POOL_CAS_PTR(ptr, expected, desired) __sync_bool_compare_and_swap((ptr), (expected), (desired))
+#if defined(__i386__) || defined(__x86_64__)
+#define SMD_POOL_PAUSE() __builtin_ia32_pause()
+#else
+#define SMD_POOL_PAUSE() ((void)0)
+#endif
+#endif
+
+#define SMD_POOL_CACHE_LINE 64
+#define SMD_POOL_DEQUE_SIZE 256    // initial per-worker deque capacity, doubles when full
+#define SMD_POOL_INJECT_SIZE 4096  // injection queue capacity, a power of two
+#define SMD_POOL_SPIN_COUNT 64     // rounds of looking for work before a thread sleeps
+#define SMD_POOL_TASK_CACHE 256    // freed tasks each worker keeps for reuse
+#define SMD_PARALLEL_SPLIT 8       // sub-ranges per worker when the grain is picked automatically
+#define SMD_PARALLEL_MAX_SPLIT 64  // most sub-ranges per worker, a small grain is raised to stay under it
+
+typedef struct smd_task_t {
+  smd_task_fn fn;
+  void* ctx;
+  smd_task_group_t* group;
+  struct smd_task_t* next; // task cache link
+} smd_task_t;
+
+typedef struct smd_deque_array_t {
+  long long mask;
+  struct smd_deque_array_t* retired; // older, smaller arrays thieves may still be reading
+  smd_task_t* volatile tasks[1];
+} smd_deque_array_t;
+
+typedef struct smd_pool_worker_t {
+  // stolen from by everyone
+  long long volatile top;
+  char pad_top[SMD_POOL_CACHE_LINE];
+  // only written by the owner
+  long long volatile bottom;
+  smd_deque_array_t* volatile array;
+  smd_pool_t* pool;
+  thread_ptr_t thread;
+  int index;
+  unsigned int seed; // victim selection
+  char pad_bottom[SMD_POOL_CACHE_LINE];
+} smd_pool_worker_t;
+
+struct smd_pool_t {
+  smd_pool_worker_t* workers;
+  int worker_count;
+  thread_mpmc_queue_t inject;
+  thread_mpmc_queue_cell_t* inject_cells;
+  char pad[SMD_POOL_CACHE_LINE];
+  long volatile idle; // workers asleep (or about to be) on 'wake'
+  long volatile stop;
+  thread_signal_t wake;
+};
+
+static SMD_POOL_THREAD_LOCAL smd_pool_worker_t* smdPoolWorker = NULL;
+static SMD_POOL_THREAD_LOCAL smd_task_t* smdTaskCache = NULL;
+static SMD_POOL_THREAD_LOCAL int smdTaskCacheCount = 0;
+
+static smd_task_t* smd_task_alloc() {
+  smd_task_t* task = smdTaskCache;
+  if (task) {
+    smdTaskCache = task->next;
+    --smdTaskCacheCount;
+    return task;
+  }
+  return (smd_task_t*)malloc(sizeof(smd_task_t));
+}
+
+// Only workers keep freed tasks, they drop the cache when they exit
+static void smd_task_free(smd_task_t* task) {
+  if (!smdPoolWorker || smdTaskCacheCount >= SMD_POOL_TASK_CACHE) {
+    free(task);
+    return;
+  }
+  task->next = smdTaskCache;
+  smdTaskCache = task;
+  ++smdTaskCacheCount;
+}
+
+static smd_deque_array_t* smd_deque_array_create(long long size) {
+  smd_deque_array_t* array = (smd_deque_array_t*)malloc(sizeof(smd_deque_array_t) + (size_t)(size - 1) * sizeof(smd_task_t*));
+  if (!array) return NULL;
+  array->mask = size - 1;
+  array->retired = NULL;
+  return array;
+}
+
+// Owner only. Copies the live range into an array twice the size; the old one is kept
+// until the pool is destroyed since a thief may still be reading from it.
+static smd_deque_array_t* smd_deque_grow(smd_pool_worker_t* worker, smd_deque_array_t* array, long long top, long long bottom) {
+  smd_deque_array_t* bigger = smd_deque_array_create((array->mask + 1) * 2);
+  if (!bigger) return NULL;
+  for (long long i = top; i < bottom; ++i)
+    SMD_POOL_STORE_RELAXED(&bigger->tasks[i & bigger->mask], SMD_POOL_LOAD_RELAXED(&array->tasks[i & array->mask]));
+  bigger->retired = array;
+  SMD_POOL_STORE_RELEASE(&worker->array, bigger);
+  return bigger;
+}
+
+// Owner only
+//
+// Returns 0 on success, -1 if the deque couldn't grow
+static int smd_deque_push(smd_pool_worker_t* worker, smd_task_t* task) {
+  long long bottom = SMD_POOL_LOAD_RELAXED(&worker->bottom);
+  long long top = SMD_POOL_LOAD_ACQUIRE(&worker->top);
+  smd_deque_array_t* array = SMD_POOL_LOAD_RELAXED(&worker->array);
+  if (bottom - top > array->mask) {
+    array = smd_deque_grow(worker, array, top, bottom);
+    if (!array) return -1;
+  }
+  SMD_POOL_STORE_RELAXED(&array->tasks[bottom & array->mask], task);
+  SMD_POOL_STORE_RELEASE(&worker->bottom, bottom + 1);
+  return 0;
+}
+
+// Owner only, takes the most recently pushed task
+static smd_task_t* smd_deque_take(smd_pool_worker_t* worker) {
+  long long bottom = SMD_POOL_LOAD_RELAXED(&worker->bottom) - 1;
+  smd_deque_array_t* array = SMD_POOL_LOAD_RELAXED(&worker->array);
+  SMD_POOL_STORE_RELAXED(&worker->bottom, bottom);
+  SMD_POOL_FENCE();
+  long long top = SMD_POOL_LOAD_RELAXED(&worker->top);
+  if (top > bottom) {
+    SMD_POOL_STORE_RELAXED(&worker->bottom, bottom + 1);
+    return NULL;
+  }
+  smd_task_t* task = SMD_POOL_LOAD_RELAXED(&array->tasks[bottom & array->mask]);
+  if (top == bottom) {
+    // last one, race the thieves for it
+    if (!SMD_POOL_CAS64(&worker->top, top, top + 1)) task = NULL;
+    SMD_POOL_STORE_RELAXED(&worker->bottom, bottom + 1);
+  }
+  return task;
+}
+
+// Any thread, takes the oldest task. NULL when empty or when another thief won the race.
+static smd_task_t* smd_deque_steal(smd_pool_worker_t* worker) {
+  long long top = SMD_POOL_LOAD_ACQUIRE(&worker->top);
+  SMD_POOL_FENCE();
+  long long bottom = SMD_POOL_LOAD_ACQUIRE(&worker->bottom);
+  if (top >= bottom) return NULL;
+  smd_deque_array_t* array = SMD_POOL_LOAD_ACQUIRE(&worker->array);
+  smd_task_t* task = SMD_POOL_LOAD_RELAXED(&array->tasks[top & array->mask]);
+  if (!SMD_POOL_CAS64(&worker->top, top, top + 1)) return NULL;
+  return task;
+}
+
+static int smd_pool_has_work(smd_pool_t* pool) {
+  if (thread_mpmc_queue_count(&pool->inject) > 0) return 1;
+  for (int i = 0; i < pool->worker_count; ++i) {
+    smd_pool_worker_t* worker = pool->workers + i;
+    if (SMD_POOL_LOAD_ACQUIRE(&worker->bottom) - SMD_POOL_LOAD_ACQUIRE(&worker->top) > 0) return 1;
+  }
+  return 0;
+}
+
+// Wakes one sleeping worker, if any. Called after queueing a task.
+static void smd_pool_notify(smd_pool_t* pool) {
+  SMD_POOL_FENCE();
+  if (SMD_POOL_LOAD_RELAXED(&pool->idle) > 0) thread_signal_raise(&pool->wake);
+}
+
+// A raised signal releases one sleeper, so a worker that found work somewhere other than
+// its own deque passes the wakeup on while there's more for the others.
+static void smd_pool_notify_more(smd_pool_t* pool) {
+  SMD_POOL_FENCE();
+  if (SMD_POOL_LOAD_RELAXED(&pool->idle) > 0 && smd_pool_has_work(pool)) thread_signal_raise(&pool->wake);
+}
+
+// 'worker' is the calling thread's worker, NULL if it isn't one of the pool's
+static smd_task_t* smd_pool_find_task(smd_pool_t* pool, smd_pool_worker_t* worker) {
+  smd_task_t* task = NULL;
+  if (worker && (task = smd_deque_take(worker)) != NULL) return task;
+  if (thread_mpmc_queue_try_consume(&pool->inject, (void**)&task)) {
+    smd_pool_notify_more(pool);
+    return task;
+  }
+  // one pass over the others from a random start
+  unsigned int start = 0;
+  if (worker) {
+    worker->seed ^= worker->seed << 13;
+    worker->seed ^= worker->seed >> 17;
+    worker->seed ^= worker->seed << 5;
+    start = worker->seed;
+  }
+  for (int i = 0; i < pool->worker_count; ++i) {
+    smd_pool_worker_t* victim = pool->workers + (start + (unsigned int)i) % (unsigned int)pool->worker_count;
+    if (victim == worker) continue;
+    if ((task = smd_deque_steal(victim)) != NULL) {
+      smd_pool_notify_more(pool);
+      return task;
+    }
+  }
+  return NULL;
+}
+
+// A finishing task is counted in 'waking' until it's done touching the group, so the
+// waiter can't return (and term the group) under it while it raises 'done'
+static void smd_task_group_finish(smd_task_group_t* group) {
+  SMD_POOL_ADD(&group->waking, 1);
+  if (SMD_POOL_ADD(&group->pending, -1) == 1 && SMD_POOL_LOAD_ACQUIRE(&group->sleeping))
+    thread_signal_raise(&group->done);
+  SMD_POOL_ADD(&group->waking, -1);
+}
+
+// Returns once no finishing task is still touching the group
+static void smd_task_group_settle(smd_task_group_t* group) {
+  while (SMD_POOL_LOAD_ACQUIRE(&group->waking) > 0) thread_yield();
+}
+
+static void smd_pool_run(smd_task_t* task) {
+  smd_task_group_t* group = task->group;
+  task->fn(task->ctx);
+  smd_task_free(task);
+  if (group) smd_task_group_finish(group);
+}
+
+static void smd_pool_queue(smd_pool_t* pool, smd_task_group_t* group, smd_task_fn fn, void* ctx) {
+  smd_task_t* task = smd_task_alloc();
+  if (!task) {
+    fn(ctx);
+    return;
+  }
+  task->fn = fn;
+  task->ctx = ctx;
+  task->group = group;
+  if (group) SMD_POOL_ADD(&group->pending, 1);
+
+  smd_pool_worker_t* worker = smdPoolWorker;
+  int queued = worker && worker->pool == pool ? smd_deque_push(worker, task) == 0
+                                              : thread_mpmc_queue_try_produce(&pool->inject, task);
+  if (!queued) {
+    smd_pool_run(task);
+    return;
+  }
+  smd_pool_notify(pool);
+}
+
+static int smd_pool_worker_proc(void* user_data) {
+  smd_pool_worker_t* worker = (smd_pool_worker_t*)user_data;
+  smd_pool_t* pool = worker->pool;
+  smdPoolWorker = worker;
+  for (;;) {
+    smd_task_t* task = NULL;
+    for (int spin = 0; spin < SMD_POOL_SPIN_COUNT && !task; ++spin) {
+      task = smd_pool_find_task(pool, worker);
+      if (!task) SMD_POOL_PAUSE();
+    }
+    if (task) {
+      smd_pool_run(task);
+      continue;
+    }
+    if (SMD_POOL_LOAD_ACQUIRE(&pool->stop)) break;
+
+    // announce ourselves before the last look, so a spawner either sees us or we see its task
+    SMD_POOL_ADD(&pool->idle, 1);
+    if (!smd_pool_has_work(pool) && !SMD_POOL_LOAD_ACQUIRE(&pool->stop))
+      thread_signal_wait(&pool->wake, THREAD_SIGNAL_WAIT_INFINITE);
+    SMD_POOL_ADD(&pool->idle, -1);
+  }
+  // pass the stop on to the next sleeper
+  smd_pool_notify(pool);
+  while (smdTaskCache) free(smd_task_alloc());
+  smdPoolWorker = NULL;
+  return 0;
+}
+
+SMD_API int smd_pool_create(smd_pool_t** pool, int workers) {
+  *pool = NULL;
+  if (workers <= 0) workers = thread_cpu_count();
+  smd_pool_t* p = (smd_pool_t*)calloc(1, sizeof(smd_pool_t));
+  if (!p) return -1;
+  p->workers = (smd_pool_worker_t*)calloc((size_t)workers, sizeof(smd_pool_worker_t));
+  p->inject_cells = (thread_mpmc_queue_cell_t*)malloc(SMD_POOL_INJECT_SIZE * sizeof(thread_mpmc_queue_cell_t));
+  if (!p->workers || !p->inject_cells) {
+    free(p->workers);
+    free(p->inject_cells);
+    free(p);
+    return -1;
+  }
+  thread_mpmc_queue_init(&p->inject, SMD_POOL_INJECT_SIZE, p->inject_cells);
+  thread_signal_init(&p->wake);
+  for (int i = 0; i < workers; ++i) {
+    smd_pool_worker_t* worker = p->workers + i;
+    worker->pool = p;
+    worker->index = i;
+    worker->seed = 0x9E3779B9u * (unsigned int)(i + 1);
+    worker->array = smd_deque_array_create(SMD_POOL_DEQUE_SIZE);
+    if (!worker->array) break;
+    p->worker_count = i + 1;
+  }
+  if (p->worker_count < workers) {
+    smd_pool_destroy(p);
+    return -1;
+  }
+  for (int i = 0; i < p->worker_count; ++i) {
+    smd_pool_worker_t* worker = p->workers + i;
+    worker->thread = smd_thread_create(smd_pool_worker_proc, worker, "smd_pool", THREAD_STACK_SIZE_DEFAULT);
+    if (!worker->thread) {
+      // tear down the ones that did start, destroy skips the workers without a thread
+      smd_pool_destroy(p);
+      return -1;
+    }
+  }
+  *pool = p;
+  return 0;
+}
+
+SMD_API void smd_pool_destroy(smd_pool_t* pool) {
+  if (!pool) return;
+  SMD_POOL_STORE_RELEASE(&pool->stop, 1);
+  smd_pool_notify(pool);
+  for (int i = 0; i < pool->worker_count; ++i) {
+    smd_pool_worker_t* worker = pool->workers + i;
+    if (worker->thread) {
+      thread_join(worker->thread);
+      thread_destroy(worker->thread);
+    }
+    for (smd_deque_array_t* array = worker->array; array;) {
+      smd_deque_array_t* retired = array->retired;
+      free(array);
+      array = retired;
+    }
+  }
+  thread_signal_term(&pool->wake);
+  thread_mpmc_queue_term(&pool->inject);
+  free(pool->inject_cells);
+  free(pool->workers);
+  free(pool);
+}
+
+SMD_API int smd_pool_worker_count(smd_pool_t* pool) {
+  return pool->worker_count;
+}
+
+SMD_API int smd_pool_worker_index(smd_pool_t* pool) {
+  smd_pool_worker_t* worker = smdPoolWorker;
+  return worker && worker->pool == pool ? worker->index : -1;
+}
+
+SMD_API void smd_pool_spawn(smd_pool_t* pool, smd_task_fn fn, void* ctx) {
+  smd_pool_queue(pool, NULL, fn, ctx);
+}
+
+SMD_API void smd_task_group_init(smd_task_group_t* group, smd_pool_t* pool) {
+  group->pool = pool;
+  group->pending = 0;
+  group->waking = 0;
+  group->sleeping = 0;
+  thread_signal_init(&group->done);
+}
+
+SMD_API void smd_task_group_term(smd_task_group_t* group) {
+  smd_task_group_settle(group);
+  thread_signal_term(&group->done);
+}
+
+SMD_API void smd_task_group_spawn(smd_task_group_t* group, smd_task_fn fn, void* ctx) {
+  smd_pool_queue(group->pool, group, fn, ctx);
+}
+
+SMD_API void smd_task_group_wait(smd_task_group_t* group) {
+  smd_pool_t* pool = group->pool;
+  smd_pool_worker_t* worker = smdPoolWorker;
+  if (worker && worker->pool != pool) worker = NULL;
+  for (;;) {
+    if (SMD_POOL_LOAD_ACQUIRE(&group->pending) == 0) {
+      smd_task_group_settle(group);
+      // a task may have spawned into the group right before it finished
+      if (SMD_POOL_LOAD_ACQUIRE(&group->pending) == 0) return;
+      continue;
+    }
+    smd_task_t* task = NULL;
+    for (int spin = 0; spin < SMD_POOL_SPIN_COUNT && !task && SMD_POOL_LOAD_ACQUIRE(&group->pending) > 0; ++spin) {
+      task = smd_pool_find_task(pool, worker);
+      if (!task) SMD_POOL_PAUSE();
+    }
+    if (task) {
+      smd_pool_run(task);
+      continue;
+    }
+    // nothing left to help with, the group's remaining tasks are running elsewhere
+    SMD_POOL_ADD(&group->sleeping, 1);
+    if (SMD_POOL_LOAD_ACQUIRE(&group->pending) > 0) thread_signal_wait(&group->done, THREAD_SIGNAL_WAIT_INFINITE);
+    SMD_POOL_ADD(&group->sleeping, -1);
+  }
+}
+
+static smd_pool_t* volatile smdDefaultPool = NULL;
+
+SMD_API smd_pool_t* smd_pool_default() {
+  smd_pool_t* pool = SMD_POOL_LOAD_ACQUIRE(&smdDefaultPool);
+  if (pool) return pool;
+  if (smd_pool_create(&pool, 0) != 0) return NULL;
+  if (!SMD_POOL_CAS_PTR(&smdDefaultPool, NULL, pool)) {
+    // another thread got there first
+    smd_pool_destroy(pool);
+    pool = SMD_POOL_LOAD_ACQUIRE(&smdDefaultPool);
+  }
+  return pool;
+}
+
+SMD_API int smd_pool_default_create(int workers) {
+  smd_pool_t* pool;
+  if (smd_pool_create(&pool, workers) != 0) return -1;
+  if (!SMD_POOL_CAS_PTR(&smdDefaultPool, NULL, pool)) {
+    smd_pool_destroy(pool);
+    return -1;
+  }
+  return 0;
+}
+
+SMD_API void smd_pool_default_destroy() {
+  smd_pool_t* pool = SMD_POOL_LOAD_ACQUIRE(&smdDefaultPool);
+  if (pool && SMD_POOL_CAS_PTR(&smdDefaultPool, pool, NULL)) smd_pool_destroy(pool);
+}
+
+// One parallel call. Its sub-ranges are handed out through 'next', so helpers that start
+// late or run on a busy worker just end up taking fewer of them.
+typedef struct smd_parallel_job_t {
+  size_t begin;
+  size_t end;
+  size_t chunk;
+  size_t count;
+  long volatile next;
+  smd_range_fn range;
+  smd_reduce_fn reduce;
+  smd_scan_fn scan;
+  int final;
+  size_t value_size;
+  unsigned char* values; // one partial (reduce) or carry (scan) per sub-range
+  void* ctx;
+} smd_parallel_job_t;
+
+// Splits [begin, end) into job->count sub-ranges of job->chunk items
+static smd_pool_t* smd_parallel_plan(smd_parallel_job_t* job, size_t begin, size_t end, size_t grain) {
+  memset(job, 0, sizeof(*job));
+  job->begin = begin;
+  job->end = end;
+  smd_pool_t* pool = smd_pool_default();
+  size_t workers = pool ? (size_t)smd_pool_worker_count(pool) : 1;
+  size_t n = end - begin;
+  if (grain == 0) grain = n / (workers * SMD_PARALLEL_SPLIT);
+  if (grain == 0) grain = 1;
+  size_t most = workers * SMD_PARALLEL_MAX_SPLIT;
+  if ((n + grain - 1) / grain > most) grain = (n + most - 1) / most;
+  job->chunk = grain;
+  job->count = (n + grain - 1) / grain;
+  return job->count > 1 && workers > 1 ? pool : NULL;
+}
+
+static void smd_parallel_chunks(void* ctx) {
+  smd_parallel_job_t* job = (smd_parallel_job_t*)ctx;
+  for (;;) {
+    size_t index = (size_t)SMD_POOL_ADD(&job->next, 1);
+    if (index >= job->count) return;
+    size_t begin = job->begin + index * job->chunk;
+    size_t end = job->end - begin > job->chunk ? begin + job->chunk : job->end;
+    void* value = job->values ? job->values + index * job->value_size : NULL;
+    if (job->range)
+      job->range(begin, end, job->ctx);
+    else if (job->reduce)
+      job->reduce(begin, end, value, job->ctx);
+    else
+      job->scan(begin, end, value, job->final, job->ctx);
+  }
+}
+
+static void smd_parallel_run(smd_pool_t* pool, smd_parallel_job_t* job) {
+  SMD_POOL_STORE_RELEASE(&job->next, 0);
+  size_t helpers = (size_t)smd_pool_worker_count(pool);
+  if (helpers > job->count - 1) helpers = job->count - 1;
+  smd_task_group_t group;
+  smd_task_group_init(&group, pool);
+  for (size_t i = 0; i < helpers; ++i) smd_task_group_spawn(&group, smd_parallel_chunks, job);
+  smd_parallel_chunks(job);
+  smd_task_group_wait(&group);
+  smd_task_group_term(&group);
+}
+
+SMD_API void smd_parallel_for(size_t begin, size_t end, size_t grain, smd_range_fn fn, void* ctx) {
+  if (begin >= end) return;
+  smd_parallel_job_t job;
+  smd_pool_t* pool = smd_parallel_plan(&job, begin, end, grain);
+  if (!pool) {
+    fn(begin, end, ctx);
+    return;
+  }
+  job.range = fn;
+  job.ctx = ctx;
+  smd_parallel_run(pool, &job);
+}
+
+SMD_API void smd_parallel_reduce(size_t begin, size_t end, size_t grain, size_t value_size, const void* identity,
+                                 smd_reduce_fn reduce, smd_combine_fn combine, void* result, void* ctx) {
+  memcpy(result, identity, value_size);
+  if (begin >= end) return;
+  smd_parallel_job_t job;
+  smd_pool_t* pool = smd_parallel_plan(&job, begin, end, grain);
+  job.values = pool ? (unsigned char*)malloc(job.count * value_size) : NULL;
+  if (!job.values) {
+    reduce(begin, end, result, ctx);
+    return;
+  }
+  for (size_t i = 0; i < job.count; ++i) memcpy(job.values + i * value_size, identity, value_size);
+  job.reduce = reduce;
+  job.value_size = value_size;
+  job.ctx = ctx;
+  smd_parallel_run(pool, &job);
+  for (size_t i = 0; i < job.count; ++i) combine(result, job.values + i * value_size, ctx);
+  free(job.values);
+}
+
+SMD_API void smd_parallel_scan(size_t begin, size_t end, size_t grain, size_t value_size, const void* identity,
+                               smd_scan_fn scan, smd_combine_fn combine, void* total, void* ctx) {
+  memcpy(total, identity, value_size);
+  if (begin >= end) return;
+  smd_parallel_job_t job;
+  smd_pool_t* pool = smd_parallel_plan(&job, begin, end, grain);
+  // one extra slot to swap through
+  job.values = pool ? (unsigned char*)malloc((job.count + 1) * value_size) : NULL;
+  if (!job.values) {
+    scan(begin, end, total, 1, ctx);
+    return;
+  }
+  for (size_t i = 0; i < job.count; ++i) memcpy(job.values + i * value_size, identity, value_size);
+  job.scan = scan;
+  job.value_size = value_size;
+  job.ctx = ctx;
+  smd_parallel_run(pool, &job);
+
+  // turn each sub-range total into the carry going into it
+  unsigned char* swap = job.values + job.count * value_size;
+  for (size_t i = 0; i < job.count; ++i) {
+    unsigned char* value = job.values + i * value_size;
+    memcpy(swap, value, value_size);
+    memcpy(value, total, value_size);
+    combine(total, swap, ctx);
+  }
+
+  job.final = 1;
+  smd_parallel_run(pool, &job);
+  free(job.values);
+}
+
+#endif // SMD_POOL_IMPL
+
+#ifdef __cplusplus
+} // extern "C"
+#endif // __cplusplus
@@ -0,0 +1,158 @@
+/*
+ * Stress tests for smd_pool.h: task groups that are spawned into while their tasks are
+ * finishing, and smd_parallel_for/_reduce/_scan, whose helpers are spawned exactly that
+ * way. Runs on explicit multi-worker pools so the parallel paths are taken even on a
+ * single-core machine. Exits non-zero on the first failure; a hang is a failure too.
+ *
+ * Not part of the library build, compile it by hand:
+ *   cc -O2 -D_GNU_SOURCE -o smd_pool_test smd_pool_test.c -lpthread
+ */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SMD_POOL_IMPL
+#include "smd_pool.h"
+
+#define SMD_THREAD_IMPL
+#include "thread.h"
+
+#define TEST_WORKERS 4
+#define TEST_ROUNDS 10000
+#define TEST_ITEMS 257
+
+static thread_atomic_int_t finished;
+static thread_atomic_int_t respawns;
+
+static void test_short_task(void* ctx) {
+  (void)ctx;
+  thread_yield();
+  thread_atomic_int_inc(&finished);
+}
+
+// Respawns into its own group, so the group's count is bumped by a task of the group
+static void test_respawn_task(void* ctx) {
+  smd_task_group_t* group = (smd_task_group_t*)ctx;
+  if (thread_atomic_int_inc(&respawns) % 2 == 0) smd_task_group_spawn(group, test_short_task, NULL);
+  thread_atomic_int_inc(&finished);
+}
+
+static int test_fail(const char* what, int round, int got, int want) {
+  printf("FAIL %s: round %d, %d of %d tasks finished\n", what, round, got, want);
+  return 1;
+}
+
+// The waiter keeps spawning while the tasks it spawned earlier finish, so spawns land
+// right as the group's count drops to zero
+static int test_spawn_while_finishing(smd_pool_t* pool) {
+  for (int round = 0; round < TEST_ROUNDS; ++round) {
+    smd_task_group_t group;
+    smd_task_group_init(&group, pool);
+    thread_atomic_int_store(&finished, 0);
+    int spawned = 1 + round % 7;
+    for (int i = 0; i < spawned; ++i) {
+      smd_task_group_spawn(&group, test_short_task, NULL);
+      for (int spin = 0; spin < round % 13; ++spin) thread_yield();
+    }
+    smd_task_group_wait(&group);
+    int got = thread_atomic_int_load(&finished);
+    smd_task_group_term(&group);
+    if (got != spawned) return test_fail("spawn while finishing", round, got, spawned);
+  }
+  return 0;
+}
+
+static int test_spawn_from_tasks(smd_pool_t* pool) {
+  for (int round = 0; round < TEST_ROUNDS; ++round) {
+    smd_task_group_t group;
+    smd_task_group_init(&group, pool);
+    thread_atomic_int_store(&finished, 0);
+    thread_atomic_int_store(&respawns, 0);
+    int spawned = 2 + round % 5;
+    for (int i = 0; i < spawned; ++i) smd_task_group_spawn(&group, test_respawn_task, &group);
+    smd_task_group_wait(&group);
+    int got = thread_atomic_int_load(&finished);
+    smd_task_group_term(&group);
+    int want = spawned + (spawned + 1) / 2;
+    if (got != want) return test_fail("spawn from tasks", round, got, want);
+  }
+  return 0;
+}
+
+static thread_atomic_int_t visits[TEST_ITEMS];
+static long values[TEST_ITEMS];
+static long prefixes[TEST_ITEMS];
+
+static void test_for_range(size_t begin, size_t end, void* ctx) {
+  (void)ctx;
+  for (size_t i = begin; i < end; ++i) thread_atomic_int_inc(&visits[i]);
+}
+
+static void test_reduce_range(size_t begin, size_t end, void* partial, void* ctx) {
+  (void)ctx;
+  for (size_t i = begin; i < end; ++i) *(long*)partial += values[i];
+}
+
+static void test_combine(void* result, const void* partial, void* ctx) {
+  (void)ctx;
+  *(long*)result += *(const long*)partial;
+}
+
+static void test_scan_range(size_t begin, size_t end, void* carry, int final, void* ctx) {
+  (void)ctx;
+  long sum = *(long*)carry;
+  for (size_t i = begin; i < end; ++i) {
+    sum += values[i];
+    if (final) prefixes[i] = sum;
+  }
+  *(long*)carry = sum;
+}
+
+// Grains of one or a few items, so every call spawns helpers that finish while the caller
+// is still spawning the others
+static int test_parallel(void) {
+  for (int i = 0; i < TEST_ITEMS; ++i) values[i] = i * 3 - 100;
+  const long identity = 0;
+  for (int round = 0; round < TEST_ROUNDS; ++round) {
+    size_t count = 1 + (size_t)round % TEST_ITEMS;
+    size_t grain = 1 + (size_t)round % 3;
+    for (size_t i = 0; i < count; ++i) thread_atomic_int_store(&visits[i], 0);
+    smd_parallel_for(0, count, grain, test_for_range, NULL);
+    for (size_t i = 0; i < count; ++i)
+      if (thread_atomic_int_load(&visits[i]) != 1)
+        return test_fail("parallel_for", round, thread_atomic_int_load(&visits[i]), 1);
+
+    long want = 0;
+    for (size_t i = 0; i < count; ++i) want += values[i];
+    long sum = -1;
+    smd_parallel_reduce(0, count, grain, sizeof(long), &identity, test_reduce_range, test_combine, &sum, NULL);
+    if (sum != want) return test_fail("parallel_reduce", round, (int)sum, (int)want);
+
+    long total = -1;
+    smd_parallel_scan(0, count, grain, sizeof(long), &identity, test_scan_range, test_combine, &total, NULL);
+    if (total != want) return test_fail("parallel_scan total", round, (int)total, (int)want);
+    long prefix = 0;
+    for (size_t i = 0; i < count; ++i) {
+      prefix += values[i];
+      if (prefixes[i] != prefix) return test_fail("parallel_scan", round, (int)prefixes[i], (int)prefix);
+    }
+  }
+  return 0;
+}
+
+int main() {
+  smd_pool_t* pool;
+  if (smd_pool_create(&pool, TEST_WORKERS) != 0 || smd_pool_default_create(TEST_WORKERS) != 0) {
+    printf("FAIL smd_pool_create\n");
+    return 1;
+  }
+  int failed = test_spawn_while_finishing(pool) || test_spawn_from_tasks(pool) || test_parallel();
+  smd_pool_destroy(pool);
+  smd_pool_default_destroy();
+  if (!failed) printf("ok\n");
+  return failed;
+}
@@ -1,4 +1,9 @@
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// sock.h wants recvmmsg/sendmmsg, which glibc only declares for GNU builds
+#define _GNU_SOURCE
+#endif
+
 #include "smdconfig.h"
 
 #ifdef SMD_UNITY_BUILD
@@ -24,6 +29,9 @@
 #define SMD_SOCK_IMPL
 #include "sock.h"
 
+#define SMD_POOL_IMPL
+#include "smd_pool.h"
+
 #define SMD_THREAD_IMPL
 #include "thread.h"
 
@@ -15,20 +15,103 @@ extern "C" {
 #endif
 
 typedef size_t sock_handle_t;
-// Represents an internet address usable by sockets
+typedef struct sock_poller_t sock_poller_t;
+// Address families for sock_address_t. IPv4 is zero so zeroed addresses stay IPv4.
+enum {
+  SOCK_FAMILY_IPV4 = 0,
+  SOCK_FAMILY_IPV6 = 1,
+  SOCK_FAMILY_UNIX = 2,
+};
+
+#define SOCK_UNIX_PATH_MAX 108
+
+// Represents an address usable by sockets
 typedef struct sock_address_t {
   union {
-    unsigned int host;
+    unsigned int host; // IPv4, network byte order
     unsigned char hostbytes[4];
+    unsigned char host6[16]; // IPv6, network byte order
+    char path[SOCK_UNIX_PATH_MAX]; // unix domain socket path
   };
   unsigned short port;
+  unsigned short family; // SOCK_FAMILY_*
+  unsigned int scope_id; // IPv6 link-local scope
 } sock_address_t;
 
+// Sets up the socket table for 'max_sockets' sockets. Call once before any other thread
+// uses the library; after that opening and closing sockets is thread safe.
 SMD_API int sock_initialize(size_t max_sockets);
 
 SMD_API void sock_shutdown();
 
+// Picks which shard of the socket table the calling thread allocates from. Threads are
+// spread round-robin by default; a server can give each worker its own index instead.
+SMD_API void sock_set_thread_hint(int hint);
+
+// Fills 'address' with the first address 'host' resolves to (see sock_resolve).
+// A NULL 'host' gives the IPv4 wildcard address.
+//
+// Returns 0 on success, -1 otherwise
 SMD_API int sock_get_address(sock_address_t *address, const char *host, unsigned short port);
+
+// Flags for sock_resolve
+enum {
+  SOCK_RESOLVE_ANY  = 0,
+  SOCK_RESOLVE_IPV4 = 1,
+  SOCK_RESOLVE_IPV6 = 2,
+};
+
+// Resolves 'host' (a name or a numeric IPv4/IPv6 address) with getaddrinfo. Results are
+// cached in-process for the resolver TTL so reconnect loops don't wait on DNS. Thread safe.
+//
+// Returns the number of addresses written to 'addresses', -1 if the host can't be resolved
+SMD_API int sock_resolve(const char* host, unsigned short port, int flags, sock_address_t* addresses, int max);
+
+// Sets how long resolved names stay cached, 0 disables the cache
+SMD_API void sock_set_resolve_ttl(int ttl_ms);
+
+// Sets how long names that failed to resolve stay cached, 0 retries every time
+SMD_API void sock_set_resolve_negative_ttl(int ttl_ms);
+
+// Drops every cached name
+SMD_API void sock_clear_resolve_cache();
+
+// Formats an address as "1.2.3.4:80", "[::1]:80" or a unix socket path
+//
+// Returns 'buf', or NULL if it is too small
+SMD_API const char* sock_address_to_str(const sock_address_t* address, char* buf, int buf_len);
+
+// Pool of resolver threads so name lookups don't stall an event loop
+typedef struct sock_resolver_t sock_resolver_t;
+
+// Receives a lookup result: 'count' addresses, or -1 if the host couldn't be resolved
+typedef void (*sock_resolve_fn)(void* user_data, int count, const sock_address_t* addresses);
+
+// Starts 'workers' resolver threads, each accepting up to 'queue_size' outstanding lookups.
+// Submitting, dispatching and destroying must all happen on the same thread.
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_resolver_create(sock_resolver_t** resolver, int workers, int queue_size);
+
+// Stops the resolver threads. Callbacks for lookups still in flight are dropped.
+SMD_API void sock_resolver_destroy(sock_resolver_t* resolver);
+
+// Resolves 'host' like sock_resolve, without blocking. Names that are numeric or already
+// cached are answered straight away; otherwise 'callback' runs from sock_resolver_dispatch.
+//
+// Returns 0 if queued, 1 if the callback already ran, -1 if every worker queue is full
+SMD_API int sock_resolve_async(sock_resolver_t* resolver, const char* host, unsigned short port, int flags,
+  sock_resolve_fn callback, void* user_data);
+
+// Runs callbacks for finished lookups on the calling thread
+//
+// Returns the number of callbacks run
+SMD_API int sock_resolver_dispatch(sock_resolver_t* resolver);
+
+// Socket that becomes readable when lookups finish. Add it to a poller for SOCK_POLL_READ
+// and call sock_resolver_dispatch when it fires; don't read from it directly.
+SMD_API sock_handle_t sock_resolver_handle(sock_resolver_t* resolver);
+
 SMD_API const char *sock_host_to_str(unsigned int host);
 SMD_API int sock_get_host_name(char* name, int name_len);
 
@@ -45,26 +128,236 @@ SMD_API int sock_open(sock_handle_t* socket, int non_blocking);
 // Returns -1 on failure (call 'zed_net_get_error' for more info)
 SMD_API int sock_listen(sock_handle_t* socket, unsigned int port, int non_blocking, int listen);
 
+// Flags for sock_listen_ex, applied before the socket is bound
+enum {
+  SOCK_LISTEN_REUSEADDR = 1,
+  SOCK_LISTEN_REUSEPORT = 2, // lets several listeners share the port, the kernel spreads connections
+  SOCK_LISTEN_FASTOPEN  = 4, // accept TCP Fast Open data with the SYN
+};
+
+// Like sock_listen, always listening, with a 'backlog' (0 for the system maximum) and
+// SOCK_LISTEN_* flags
+//
+// Returns 0 on success, -1 otherwise (including flags the platform doesn't support)
+SMD_API int sock_listen_ex(sock_handle_t* socket, unsigned int port, int non_blocking, int backlog, int flags);
+
+// Socket options for sock_set_option / sock_get_option
+enum {
+  SOCK_OPT_NODELAY,    // 1 disables Nagle's algorithm
+  SOCK_OPT_CORK,       // 1 holds back partial frames until uncorked (linux TCP_CORK, BSD TCP_NOPUSH)
+  SOCK_OPT_REUSEADDR,
+  SOCK_OPT_REUSEPORT,  // only useful before bind, see SOCK_LISTEN_REUSEPORT
+  SOCK_OPT_SNDBUF,     // kernel send buffer in bytes
+  SOCK_OPT_RCVBUF,     // kernel receive buffer in bytes
+  SOCK_OPT_BUSY_POLL,  // microseconds to busy poll the device on blocking reads (linux)
+  SOCK_OPT_FASTOPEN,   // pending TCP Fast Open request queue length on a listener
+  SOCK_OPT_QUICKACK,   // 1 acks immediately; linux clears it again after some traffic
+  SOCK_OPT_KEEPALIVE,
+};
+
+// Sets an integer socket option
+//
+// Returns 0 on success, -1 otherwise (including options the platform doesn't support)
+SMD_API int sock_set_option(sock_handle_t socket, int option, int value);
+
+// Reads an integer socket option into 'value'
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_get_option(sock_handle_t socket, int option, int* value);
+
+// Flags for sock_enable_stats
+enum {
+  SOCK_STATS_COUNTERS   = 1, // bytes, calls and would-block counts
+  SOCK_STATS_TIMESTAMPS = 2, // kernel software TX timestamps feeding the latency histograms (linux)
+};
+
+// Latencies measured from the send call, see sock_stats_t
+enum {
+  SOCK_LATENCY_SEND_TO_WIRE, // until the kernel handed the bytes to the device
+  SOCK_LATENCY_SEND_TO_ACK,  // until the peer acknowledged the last byte (TCP only)
+  SOCK_LATENCY_COUNT,
+};
+
+// Summary of one latency histogram, in nanoseconds. Percentiles are the upper bound of
+// their bucket, within about 6% of the recorded value.
+typedef struct sock_latency_t {
+  uint64_t count;
+  uint64_t min_ns;
+  uint64_t max_ns;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  uint64_t p999_ns;
+} sock_latency_t;
+
+// Snapshot of a socket's counters since sock_enable_stats
+typedef struct sock_stats_t {
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  uint64_t send_calls;    // system calls, including ones that would block
+  uint64_t receive_calls;
+  uint64_t send_would_block;
+  uint64_t receive_would_block;
+  uint64_t timestamps_dropped; // sends whose timestamps could no longer be matched
+  sock_latency_t latency[SOCK_LATENCY_COUNT];
+} sock_stats_t;
+
+// Starts collecting SOCK_STATS_* for 'socket', clearing anything collected so far.
+// 0 stops collecting and frees the state. Stats are updated by whichever thread is using
+// the socket and aren't synchronized, so read them from that thread.
+//
+// With SOCK_STATS_TIMESTAMPS the kernel queues a timestamp per send on the socket's error
+// queue. sock_poller_wait drains it when it fires; otherwise call sock_stats_poll.
+//
+// Returns 0 on success, -1 otherwise (timestamps on platforms other than linux)
+SMD_API int sock_enable_stats(sock_handle_t socket, int flags);
+
+// Collects the timestamps the kernel has queued
+//
+// Returns the number processed, -1 if stats aren't enabled
+SMD_API int sock_stats_poll(sock_handle_t socket);
+
+// Fills 'stats' after collecting queued timestamps
+//
+// Returns 0 on success, -1 if stats aren't enabled
+SMD_API int sock_get_stats(sock_handle_t socket, sock_stats_t* stats);
+
+// Latency in nanoseconds at 'percentile' (0-100) of SOCK_LATENCY_* histogram 'which',
+// 0 when nothing was recorded
+SMD_API uint64_t sock_stats_percentile(sock_handle_t socket, int which, double percentile);
+
 // Closes a previously opened socket 
 SMD_API void sock_close(sock_handle_t socket);
 
 // Connect to a remote endpoint
 // Returns 0 on success.
-//  if the socket is non-blocking, then this can return 1 if the socket isn't ready
-//  returns -1 otherwise. (call 'zed_net_get_error' for more info)
+//  if the socket is non-blocking, then this returns 1 while the connection is in progress
+//  (see sock_connect_result)
+//  returns -1 otherwise, and closes the socket, also when 'remote_addr' is of a family the
+//  socket can't reach. (call 'zed_net_get_error' for more info)
 SMD_API int sock_connect(sock_handle_t socket, sock_address_t remote_addr);
 
+// Checks a connect that returned 1. The socket becomes writable once it is decided.
+//
+// Returns 0 once connected, 1 while still in progress, -1 if the connect failed
+SMD_API int sock_connect_result(sock_handle_t socket);
+
+// Races non-blocking connects to several addresses of one host (RFC 8305 "happy eyeballs"):
+// attempts alternate between IPv6 and IPv4, a new one starts every 'stagger_ms' or as soon
+// as the previous one fails, and each gives up after 'attempt_timeout_ms'. The first to
+// connect wins and the rest are closed.
+typedef struct sock_connector_t sock_connector_t;
+
+// Creates a connector for 'count' addresses (at most 16 are used), 0 picks the defaults
+// for the timings (250ms stagger, 5s per attempt)
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_connector_create(sock_connector_t** connector, const sock_address_t* addresses, int count,
+  int stagger_ms, int attempt_timeout_ms);
+
+// Closes every attempt still open (not the one handed out as the winner)
+SMD_API void sock_connector_destroy(sock_connector_t* connector);
+
+// Advances the race, waiting up to 'wait_ms' for progress (0 never blocks). Sockets are
+// non-blocking and not registered with a poller while the race runs.
+//
+// Returns 0 with the connected socket in 'socket', 1 while still racing, -1 if every
+// attempt failed
+SMD_API int sock_connector_step(sock_connector_t* connector, sock_handle_t* socket, int wait_ms);
+
+// Milliseconds until the connector needs to start or expire an attempt, -1 if it is done
+SMD_API int sock_connector_timeout(sock_connector_t* connector);
+
+// Blocking wrapper around sock_connector_t, giving up after 'timeout_ms' (-1 for no limit).
+// The connected socket is switched back to blocking.
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_connect_race(sock_handle_t* socket, const sock_address_t* addresses, int count, int timeout_ms);
+
 // Accept connection
-// New remote_socket inherits non-blocking from listening_socket
+// New remote_socket inherits non-blocking from listening_socket, and is not inherited by child processes
 // Returns 0 on success.
-//  if the socket is non-blocking, then this can return 1 if the socket isn't ready
 //  if the socket is non_blocking and there was no connection to accept, returns 2
 //  returns -1 otherwise. (call 'zed_net_get_error' for more info)
 SMD_API int sock_accept(sock_handle_t skt, sock_handle_t *remote_socket, sock_address_t *remote_addr);
 
+// Accepts up to 'max' pending connections in one call, like repeated sock_accept.
+// 'remote_addrs' may be NULL. Meant for non-blocking listeners; a blocking listener
+// waits for the first connection only.
+//
+// Returns the number of connections accepted (0 if none were pending), -1 on error
+SMD_API int sock_accept_many(sock_handle_t skt, sock_handle_t* remote_sockets, sock_address_t* remote_addrs, int max);
+
+// Socket types for local (unix domain) sockets
+enum {
+  SOCK_UNIX_STREAM    = 0,
+  SOCK_UNIX_SEQPACKET = 1, // connection oriented, keeps message boundaries
+};
+
+// Fills 'address' with a unix domain socket path
+//
+// Returns 0 on success, -1 if the path doesn't fit
+SMD_API int sock_unix_address(sock_address_t* address, const char* path);
+
+// Opens a unix domain socket of SOCK_UNIX_* 'type', to be used with sock_connect
+//
+// Returns 0 on success, -1 otherwise (always on Windows)
+SMD_API int sock_open_unix(sock_handle_t* socket, int type, int non_blocking);
+
+// Binds a unix domain socket to 'path' and listens on it, accept with sock_accept.
+// A socket file already at 'path' (say, left by a crashed process) is replaced; the file is
+// not removed on sock_close.
+//
+// Returns 0 on success, -1 otherwise (always on Windows)
+SMD_API int sock_listen_unix(sock_handle_t* socket, const char* path, int type, int non_blocking, int backlog);
+
+// Creates two connected unix domain sockets of SOCK_UNIX_* 'type'
+//
+// Returns 0 on success, -1 otherwise (always on Windows)
+SMD_API int sock_socketpair(sock_handle_t sockets[2], int type, int non_blocking);
+
+#define SOCK_MAX_FDS 16
+
+// Sends 'size' bytes (at least one) along with 'count' open file descriptors over a unix
+// domain socket (SCM_RIGHTS). The receiver gets its own copies; the sender's stay open.
+// The descriptors go with the first byte. A non-blocking stream socket may take only part
+// of the data, send the rest with sock_send; a SOCK_UNIX_SEQPACKET message goes out whole
+// or not at all. Nothing is sent while an outbound ring (sock_set_send_buffer) still holds
+// earlier bytes, flush it first.
+//
+// Returns the number of bytes sent (fewer than 'size' only as above), 0 if a non-blocking
+// socket isn't ready, -1 otherwise
+SMD_API int sock_send_fds(sock_handle_t socket, const void* data, int size, const int* fds, int count);
+
+// Receives data and up to 'max' file descriptors sent with sock_send_fds. The descriptors
+// are close-on-exec and owned by the caller; 'count' is set to how many arrived. Any past
+// 'max' are closed. If the sender passed more than SOCK_MAX_FDS the kernel drops the rest;
+// the ones that did arrive are closed too and the call fails, since the message is no
+// longer what was sent.
+//
+// Returns the number of bytes received, 0 when the peer closed the connection, -2 if a
+// non-blocking socket has nothing pending, -1 otherwise
+SMD_API int sock_receive_fds(sock_handle_t socket, void* data, int size, int* fds, int max, int* count);
+
+// The operating system handle behind 'socket' (an fd, or a SOCKET on Windows), -1 if invalid
+SMD_API intptr_t sock_native_handle(sock_handle_t socket);
+
+// Takes ownership of an already open native socket, such as one received with
+// sock_receive_fds or inherited from the parent process, and sets its blocking mode
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_adopt_native(sock_handle_t* socket, intptr_t handle, int non_blocking);
+
+// Sockets are created close-on-exec. Making one inheritable lets processes started with
+// process_create use it, after passing them sock_native_handle.
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_set_inheritable(sock_handle_t socket, int inheritable);
+
 // Sends a specific amount of data to 'destination'
 //
-// Returns 0 on success, -1 otherwise (call 'zed_net_get_error' for more info)
+// Returns 0 on success.
+//  if the socket is non-blocking, then this can return 1 if the socket isn't ready
+//  returns -1 otherwise. (call 'zed_net_get_error' for more info)
 SMD_API int sock_send(sock_handle_t socket, const void *data, int size);
 
 // Receives a specific amount of data from 'sender'
@@ -72,15 +365,382 @@ SMD_API int sock_send(sock_handle_t socket, const void *data, int size);
 // Returns the number of bytes received, -1 otherwise (call 'zed_net_get_error' for more info)
 SMD_API int sock_receive(sock_handle_t socket, void *data, int size);
 
+// One buffer of a scatter/gather transfer
+typedef struct sock_iovec_t {
+  void* data;
+  size_t size;
+} sock_iovec_t;
+
+// Sends 'count' buffers with a single writev-style call, without staging them in one buffer.
+// Blocking sockets send everything; non-blocking sockets send what the kernel accepts now.
+//
+// Returns the number of bytes sent (possibly fewer than requested, 0 if a non-blocking
+// socket isn't ready), -1 otherwise. Resume a partial send with sock_iovec_advance.
+SMD_API int sock_sendv(sock_handle_t socket, const sock_iovec_t* iov, int count);
+
+// Receives into 'count' buffers, filling each in turn, with a single readv-style call
+//
+// Returns the number of bytes received, 0 if a non-blocking socket has no data yet,
+// -1 on error or when the peer closed the connection
+SMD_API int sock_receivev(sock_handle_t socket, sock_iovec_t* iov, int count);
+
+// Called when a socket's queued outbound bytes rise to its high watermark ('above' = 1)
+// and again when they drain down to its low watermark ('above' = 0)
+typedef void (*sock_watermark_fn)(sock_handle_t socket, int above, void* user_data);
+
+// Gives a socket an outbound ring buffer of 'capacity' bytes. While it is set, sock_send
+// queues whatever the kernel doesn't take instead of failing on a partial write, and
+// returns 1 when the data doesn't fit so producers can wait for the low watermark.
+// Queued bytes go out on sock_flush, which sock_poller_wait calls by itself when a
+// registered socket becomes writable. A 'capacity' of 0 removes the buffer, which has to
+// be drained first.
+//
+// Returns 0 on success, -1 otherwise (e.g. when shrinking below the queued bytes, or
+// removing the buffer while anything is still queued)
+SMD_API int sock_set_send_buffer(sock_handle_t socket, size_t capacity, size_t high_watermark,
+                                 size_t low_watermark, sock_watermark_fn callback, void* user_data);
+
+// Writes as much of the outbound ring buffer (and any queued sock_sendfile range) as the
+// socket accepts
+//
+// Returns the number of bytes still queued, -1 otherwise
+SMD_API int sock_flush(sock_handle_t socket);
+
+// Returns the number of bytes waiting in the outbound ring buffer, including the rest of
+// a queued sock_sendfile range
+SMD_API size_t sock_send_pending(sock_handle_t socket);
+
+// Coalesces small writes: sock_send and sock_send_frames append to the socket's send
+// buffer (one of 256KB is created if it has none) instead of making a system call each,
+// and what was gathered goes out as a single writev when the socket's poller next waits,
+// on sock_flush, or as soon as 'limit' bytes are held. A write of at least 'limit' bytes
+// with nothing held goes straight out. Sockets not registered with a poller must be
+// flushed by hand. A 'limit' of 0 turns coalescing off and flushes. The poller keeps the
+// sockets it has to flush in an unlocked list, so a coalescing (or corked) socket that is
+// registered with one must only be sent on from the thread that calls sock_poller_wait.
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_set_coalesce(sock_handle_t socket, size_t limit);
+
+// Corks a socket: writes are held in the send buffer (created as for sock_set_coalesce)
+// until sock_uncork or an explicit sock_flush, whatever the poller or the coalescing
+// limit would do. Uncorking flushes.
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_cork(sock_handle_t socket);
+
+// Returns the number of bytes still queued after flushing, like sock_flush, -1 otherwise
+SMD_API int sock_uncork(sock_handle_t socket);
+
+// Sends 'length' bytes of the open file 'fd' starting at 'offset' without copying them
+// through userspace (sendfile on linux, a bounded read/send loop elsewhere). Blocking
+// sockets send the whole range. Non-blocking sockets send what fits, so call again with
+// the offset advanced by the result. With a send buffer (sock_set_send_buffer) the unsent
+// rest is queued behind the buffered bytes and goes out from sock_flush; 'fd' must stay
+// open until sock_send_pending drops to zero, and only one range can be queued at a time.
+//
+// Returns the number of bytes sent now, 0 if the socket isn't ready, -1 otherwise
+SMD_API int64_t sock_sendfile(sock_handle_t socket, int fd, int64_t offset, int64_t length);
+
+// Skips 'bytes' already transferred: drops finished buffers from the front of '*iov'
+// and trims the first unfinished one in place.
+//
+// Returns the number of buffers left
+SMD_API int sock_iovec_advance(sock_iovec_t** iov, int count, size_t bytes);
+
+// Length prefixes for message framing
+enum {
+  SOCK_FRAME_VARINT = 0, // unsigned LEB128, 1 to 5 bytes
+  SOCK_FRAME_U32BE  = 1, // 4 bytes, big endian
+};
+
+#define SOCK_FRAME_PREFIX_MAX 5
+
+// A complete message inside a framer's receive buffer
+typedef struct sock_message_t {
+  const void* data;
+  size_t size;
+} sock_message_t;
+
+// Reassembles length-prefixed messages from a stream socket in one reusable buffer
+typedef struct sock_framer_t sock_framer_t;
+
+// Creates a framer for 'prefix' (SOCK_FRAME_*) that rejects messages over 'max_message' bytes
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_framer_create(sock_framer_t** framer, int prefix, size_t max_message);
+
+SMD_API void sock_framer_destroy(sock_framer_t* framer);
+
+// Reads whatever the socket has ready into the framer. Views from sock_framer_next
+// are invalidated by this call.
+//
+// Returns the number of bytes read, 0 if none were ready, -2 without reading when the
+// buffer is full of complete messages (take them with sock_framer_next first), -1 on
+// error or peer close
+SMD_API int sock_framer_receive(sock_framer_t* framer, sock_handle_t socket);
+
+// Takes the next complete message out of the framer as a view into its buffer,
+// valid until the next sock_framer_receive
+//
+// Returns 1 if 'message' was filled, 0 if no complete message is buffered,
+// -1 if the stream is malformed or a message is larger than 'max_message'
+SMD_API int sock_framer_next(sock_framer_t* framer, sock_message_t* message);
+
+// Encodes the prefix for a 'size' byte message into 'out'
+//
+// Returns the prefix length, -1 if 'size' can't be encoded
+SMD_API int sock_frame_prefix(int prefix, size_t size, unsigned char* out);
+
+// Sends 'count' messages as frames, batching prefixes and payloads into vectored writes.
+// With a send buffer the call is all or nothing. Without one, a non-blocking socket may
+// stop taking bytes part way: frames are never left half written, so the rest of the one
+// it stopped in is queued in a send buffer made for it (256KB, or that frame's remainder
+// if larger), which goes out as for sock_set_send_buffer and is dropped once drained.
+// The frames after it aren't sent; call again with them once the socket is writable.
+//
+// Returns the number of messages sent or queued (less than 'count' when the socket, or
+// its send buffer, ran out of room), -1 otherwise
+SMD_API int sock_send_frames(sock_handle_t socket, int prefix, const sock_message_t* messages, int count);
+
+// Opens a UDP socket bound to 'port' (use 0 to select a random open port)
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_open_udp(sock_handle_t* socket, unsigned int port, int non_blocking);
+
+// One datagram of a batched UDP transfer
+typedef struct sock_datagram_t {
+  void* data;
+  int size;         // bytes to send, or the capacity of 'data' when receiving
+  int length;       // set on receive to the number of bytes received
+  // Send: when non-zero the kernel splits 'data' into datagrams of this size (UDP GSO).
+  // Receive: the size of the datagrams coalesced into 'data' when GRO is on, 0 otherwise.
+  int segment_size;
+  sock_address_t address; // destination when sending, source when receiving
+} sock_datagram_t;
+
+// Receives up to 'count' datagrams with a single recvmmsg call where available
+//
+// Returns the number of datagrams received, 0 if a non-blocking socket has none pending,
+// -1 otherwise
+SMD_API int sock_recv_batch(sock_handle_t socket, sock_datagram_t* datagrams, int count);
+
+// Sends up to 'count' datagrams with a single sendmmsg call where available
+//
+// Returns the number of datagrams sent (possibly fewer than 'count', 0 if a non-blocking
+// socket isn't ready), -1 otherwise
+SMD_API int sock_send_batch(sock_handle_t socket, const sock_datagram_t* datagrams, int count);
+
+// Turns UDP generic receive offload on or off, letting the kernel hand back several
+// datagrams from the same sender in one buffer (see sock_datagram_t::segment_size)
+//
+// Returns 0 on success, -1 if unsupported
+SMD_API int sock_set_udp_gro(sock_handle_t socket, int enable);
+
+// Readiness flags used by the poller
+enum {
+  SOCK_POLL_READ  = 0x01,
+  SOCK_POLL_WRITE = 0x02,
+  SOCK_POLL_ERROR = 0x04, // reported only, always watched
+  SOCK_POLL_HUP   = 0x08, // reported only, always watched
+  SOCK_POLL_EDGE  = 0x10, // edge-triggered, only meaningful when registering
+};
+
+typedef struct sock_event_t {
+  sock_handle_t socket;
+  unsigned int events;
+  void* user_data;
+} sock_event_t;
+
+// Creates a readiness multiplexer (epoll on linux, poll() elsewhere).
+// 'max_events' bounds how many events a single sock_poller_wait can return.
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_poller_create(sock_poller_t** poller, int max_events);
+
+// Destroys a poller. Registered sockets are not closed.
+SMD_API void sock_poller_destroy(sock_poller_t* poller);
+
+// Registers a socket for SOCK_POLL_* 'events'. A socket can belong to one poller at a time.
+// SOCK_POLL_EDGE falls back to level-triggered where the backend lacks it.
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_poller_add(sock_poller_t* poller, sock_handle_t socket, unsigned int events, void* user_data);
+
+// Changes the events and user data of a registered socket
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_poller_modify(sock_poller_t* poller, sock_handle_t socket, unsigned int events, void* user_data);
+
+// Unregisters a socket. Closing a socket unregisters it automatically.
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_poller_remove(sock_poller_t* poller, sock_handle_t socket);
+
+// Waits up to 'timeout_ms' (-1 for infinite) for registered sockets to become ready
+//
+// Returns the number of events written to 'events' (0 on timeout or when a signal
+// interrupted the wait), -1 otherwise
+SMD_API int sock_poller_wait(sock_poller_t* poller, sock_event_t* events, int max_events, int timeout_ms);
+
+typedef struct sock_ring_t sock_ring_t;
+
+// Operations that can be batched on a sock_ring_t
+enum {
+  SOCK_RING_SEND,
+  SOCK_RING_RECV,
+  SOCK_RING_ACCEPT,
+  SOCK_RING_CONNECT,
+  SOCK_RING_OPEN,
+  SOCK_RING_READ,
+  SOCK_RING_STAT,
+};
+
+typedef struct sock_file_stat_t {
+  uint64_t size;
+  uint64_t mtime; // seconds since the epoch
+  uint32_t mode;
+} sock_file_stat_t;
+
+typedef struct sock_completion_t {
+  void* user_data;
+  int op;      // SOCK_RING_*
+  int result;  // bytes for send/recv/read, a file descriptor for open, 0 otherwise. -1 on failure
+  int error;   // errno of a failed operation
+  sock_handle_t socket; // the accepted socket for SOCK_RING_ACCEPT
+} sock_completion_t;
+
+// Creates a batched submission/completion ring with room for 'entries' queued operations.
+// Uses io_uring when the kernel supports it; otherwise (or for individual opcodes the
+// kernel lacks) queued operations run on the blocking path inside sock_ring_submit,
+// in the order they were queued and on the calling thread.
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_ring_create(sock_ring_t** ring, unsigned int entries);
+
+// Destroys a ring. Operations still in flight are abandoned.
+SMD_API void sock_ring_destroy(sock_ring_t* ring);
+
+// Returns 1 if the ring is backed by io_uring, 0 if it uses the blocking fallback
+SMD_API int sock_ring_is_native(sock_ring_t* ring);
+
+// Queue operations. Buffers, paths and out pointers must stay valid until the
+// operation completes. Nothing is issued until sock_ring_submit.
+//
+// Returns 0 on success, -1 if the ring has too many operations in flight
+SMD_API int sock_ring_send(sock_ring_t* ring, sock_handle_t socket, const void* data, int size, void* user_data);
+SMD_API int sock_ring_recv(sock_ring_t* ring, sock_handle_t socket, void* data, int size, void* user_data);
+SMD_API int sock_ring_accept(sock_ring_t* ring, sock_handle_t socket, sock_address_t* remote_addr, void* user_data);
+SMD_API int sock_ring_connect(sock_ring_t* ring, sock_handle_t socket, sock_address_t remote_addr, void* user_data);
+SMD_API int sock_ring_open(sock_ring_t* ring, const char* path, int flags, void* user_data);
+SMD_API int sock_ring_read(sock_ring_t* ring, int fd, void* data, int size, uint64_t offset, void* user_data);
+SMD_API int sock_ring_stat(sock_ring_t* ring, const char* path, sock_file_stat_t* stat, void* user_data);
+
+// Submits every queued operation and waits for at least 'wait_nr' completions,
+// using a single io_uring_enter on the native backend
+//
+// Returns the number of operations submitted, -1 otherwise
+SMD_API int sock_ring_submit(sock_ring_t* ring, int wait_nr);
+
+// Copies up to 'max' finished operations into 'completions' without blocking
+//
+// Returns the number of completions written
+SMD_API int sock_ring_reap(sock_ring_t* ring, sock_completion_t* completions, int max);
+
+// Multi-threaded TCP server: one SO_REUSEPORT listener and poller per worker thread, so
+// the kernel spreads incoming connections across workers instead of one accept loop
+typedef struct sock_server_t sock_server_t;
+
+// Called on a worker for each accepted connection. Return 0 to keep it, which adds it to
+// that worker's poller for SOCK_POLL_READ with '*conn_user_data' as its user data, or -1
+// to have it closed.
+typedef int (*sock_server_accept_fn)(sock_server_t* server, int worker, sock_handle_t socket,
+  const sock_address_t* address, void** conn_user_data, void* user_data);
+
+// Called on a worker for each poller event of its connections
+typedef void (*sock_server_event_fn)(sock_server_t* server, int worker, const sock_event_t* event, void* user_data);
+
+typedef struct sock_server_config_t {
+  unsigned int port;
+  int workers;      // 0 for one per cpu
+  int backlog;      // per listener, 0 for the system maximum
+  int listen_flags; // extra SOCK_LISTEN_* flags, REUSEPORT is always set
+  int pin_workers;  // non-zero pins worker i to cpu i % cpu count
+  int max_events;   // per poller wait, 0 for 256
+  int accept_batch; // connections accepted per listener wakeup, 0 for 64
+  sock_server_accept_fn on_accept;
+  sock_server_event_fn on_event;
+  void* user_data;
+} sock_server_config_t;
+
+// Opens the listeners and starts the workers
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_server_start(sock_server_t** server, const sock_server_config_t* config);
+
+// Stops and joins the workers and closes the listeners. Connections still on the
+// worker pollers are closed too.
+SMD_API void sock_server_stop(sock_server_t* server);
+
+// Number of workers the server runs
+SMD_API int sock_server_worker_count(sock_server_t* server);
+
+// Poller of 'worker', for adding or modifying sockets from that worker's callbacks
+SMD_API sock_poller_t* sock_server_poller(sock_server_t* server, int worker);
+
+// Keeps idle outbound connections per remote address so callers can reuse them instead
+// of paying for a new handshake. Thread safe.
+typedef struct sock_pool_t sock_pool_t;
+
+typedef struct sock_pool_config_t {
+  int max_idle_per_address; // 0 for 8
+  int max_idle;             // across all addresses, least recently used go first; 0 for 256
+  int idle_timeout_ms;      // idle connections older than this are closed; 0 for 60s
+  int backoff_ms;           // first wait after a failed connect, doubling per failure; 0 for 100ms
+  int max_backoff_ms;       // 0 for 30s
+} sock_pool_config_t;
+
+// Creates a pool, 'config' may be NULL for the defaults
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_pool_create(sock_pool_t** pool, const sock_pool_config_t* config);
+
+// Closes every idle connection. Checked out connections stay open and belong to the caller.
+SMD_API void sock_pool_destroy(sock_pool_t* pool);
+
+// Hands out the most recently used live idle connection to 'address', or connects a new
+// blocking one. Fails straight away while the address is backing off after connect failures.
+//
+// Returns 0 on success, -1 otherwise
+SMD_API int sock_pool_checkout(sock_pool_t* pool, sock_address_t address, sock_handle_t* socket);
+
+// Like sock_pool_checkout but never connects
+//
+// Returns 0 if an idle connection was handed out, 1 if there was none, -1 otherwise
+SMD_API int sock_pool_try_checkout(sock_pool_t* pool, sock_address_t address, sock_handle_t* socket);
+
+// Gives a checked out connection back. Pass 'reusable' = 0 after an error or an
+// unfinished exchange to close it instead.
+SMD_API void sock_pool_checkin(sock_pool_t* pool, sock_handle_t socket, int reusable);
+
+// Closes idle connections that timed out or were closed by the peer
+//
+// Returns the number closed
+SMD_API int sock_pool_prune(sock_pool_t* pool);
+
 #ifdef SMD_SOCK_IMPL
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <time.h>
 
 #ifdef _WIN32
 #include <WinSock2.h>
+#include <WS2tcpip.h>
 #pragma comment(lib, "wsock32.lib")
+#pragma comment(lib, "ws2_32.lib")
 #else
 #include <sys/select.h>
 #include <sys/socket.h>
@@ -89,52 +749,263 @@ SMD_API int sock_receive(sock_handle_t socket, void *data, int size);
 #include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include <netinet/udp.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#ifdef _GNU_SOURCE
+// recvmmsg/sendmmsg and accept4 are only declared for GNU builds
+#define SOCK_HAS_MMSG 1
+#define SOCK_HAS_ACCEPT4 1
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SOCK_HAS_IO_URING 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#endif
+#endif
+#endif
 
 const int INVALID_SOCKET = -1; // or -1
 const int SOCKET_ERROR = -1;
 #endif
 
+#ifdef _WIN32
+#include <io.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#define poll WSAPoll
+#endif
+
+#include "thread.h"
+
+// A handle packs the slot index into the low bits and the slot's generation above
+// it, so a handle kept past sock_close stops resolving once its slot is reused.
+#define SOCK_INDEX_BITS (sizeof(sock_handle_t) > 4 ? 32 : 20)
+#define SOCK_INDEX_MASK ((((sock_handle_t)1) << SOCK_INDEX_BITS) - 1)
+#define SOCK_GENERATION_MASK ((uint32_t)(sizeof(sock_handle_t) > 4 ? 0xFFFFFFFFu : 0xFFFu))
+
 typedef struct sock_t{
   int handle; // -1 when free
   int ready;
   int blocking;
+  int family; // AF_* of 'handle'; AF_INET6 sockets are dual-stack
+  uint32_t generation;
+  uint32_t next_free; // free list link, 0 terminates
+  // poller registration
+  sock_poller_t* poller;
+  unsigned int poll_events;  // what the user asked for
+  unsigned int poll_active;  // what the backend watches, adds WRITE while output is queued
+  int poll_index; // slot in the poll() fallback arrays
+  void* user_data;
+  struct sock_outq_t* outq; // optional outbound ring, see sock_set_send_buffer
+  struct sock_stats_state_t* stats; // see sock_enable_stats
 } sock_t;
 
+typedef struct sock_outq_t {
+  char* data;
+  size_t capacity;
+  size_t head;
+  size_t len;
+  size_t high;
+  size_t low;
+  int above;
+  sock_watermark_fn callback;
+  void* user_data;
+  // a queued sock_sendfile range, sent after the first 'file_prefix' ring bytes
+  int file_fd;
+  int64_t file_offset;
+  int64_t file_left;
+  size_t file_prefix;
+  // write coalescing, see sock_set_coalesce
+  size_t coalesce; // flush once this many bytes are held, 0 when off
+  int corked;
+  size_t released; // while corked, the leading queued bytes that may still go out
+  int held;        // the queued bytes haven't been offered to the kernel yet
+  int dirty;       // listed on the poller for a flush before it next waits
+  int temporary;   // made by sock_send_frames for a half written frame, dropped once drained
+} sock_outq_t;
+
+struct sock_poller_t {
+  int max_events;
+#ifdef __linux__
+  int epfd;
+  struct epoll_event* events;
+#else
+  struct pollfd* fds;
+  sock_handle_t* handles;
+  int count;
+  int capacity;
+#endif
+  // sockets holding coalesced writes, flushed when the poller next waits
+  sock_handle_t* dirty;
+  int dirty_count;
+  int dirty_capacity;
+};
+
+#if defined(_MSC_VER)
+#define SOCK_THREAD_LOCAL __declspec(thread)
+#else
+#define SOCK_THREAD_LOCAL __thread
+#endif
+
+// Free slots are spread over per-thread shards so open/close on different threads
+// don't fight over one list head
+#define SOCK_MAX_SHARDS 64
+
+typedef struct sock_shard_t {
+  // Free slot list head: the slot index in the low 32 bits, a tag bumped on every
+  // pop in the high 32 bits so a concurrent pop/push/pop can't ABA the CAS.
+  volatile uint64_t free;
+  char padding[64 - sizeof(uint64_t)]; // one cache line each
+} sock_shard_t;
+
 static sock_t* sockets;
 static uint32_t totalSockets;
+static sock_shard_t sockShards[SOCK_MAX_SHARDS];
+static uint32_t shardCount; // power of two
+static thread_atomic_int_t nextShard;
+static SOCK_THREAD_LOCAL uint32_t threadShard; // shard + 1, 0 until first used
+
+static uint64_t sock_cas64(volatile uint64_t* dst, uint64_t expected, uint64_t desired) {
+#ifdef _WIN32
+  return (uint64_t)InterlockedCompareExchange64((volatile LONG64*)dst, (LONG64)desired, (LONG64)expected);
+#else
+  return __sync_val_compare_and_swap(dst, expected, desired);
+#endif
+}
+
+static sock_handle_t sock_make_handle(uint32_t index) {
+  return ((sock_handle_t)sockets[index].generation << SOCK_INDEX_BITS) | index;
+}
+
+// Resolves a handle to its slot, NULL if the handle is invalid or stale
+static sock_t* sock_lookup(sock_handle_t hdl) {
+  uint32_t index = (uint32_t)(hdl & SOCK_INDEX_MASK);
+  if (index == 0 || index >= totalSockets)
+    return NULL;
+  sock_t* sock = sockets + index;
+  if (sock->generation != (uint32_t)(hdl >> SOCK_INDEX_BITS))
+    return NULL;
+  return sock;
+}
+
+void sock_set_thread_hint(int hint) {
+  threadShard = (uint32_t)hint % SOCK_MAX_SHARDS + 1;
+}
+
+static sock_shard_t* sock_thread_shard() {
+  if (!threadShard)
+    threadShard = (uint32_t)thread_atomic_int_inc(&nextShard) % SOCK_MAX_SHARDS + 1;
+  return sockShards + ((threadShard - 1) & (shardCount - 1));
+}
+
+static uint32_t sock_shard_pop(sock_shard_t* shard) {
+  uint64_t head = shard->free;
+  for (;;) {
+    uint32_t index = (uint32_t)head;
+    if (index == 0)
+      return 0;
+    uint64_t next = (((head >> 32) + 1) << 32) | sockets[index].next_free;
+    uint64_t seen = sock_cas64(&shard->free, head, next);
+    if (seen == head)
+      return index;
+    head = seen;
+  }
+}
 
+// Pops a free slot in O(1) from the thread's shard, stealing from the others once it
+// runs dry. Returns 0 when the table is full.
 static sock_handle_t alloc_socket() {
-  for (uint32_t i = 1; i < totalSockets; ++i) {
-    if (sockets[i].handle == -1) {
-      return i;
-    }
+  if (!shardCount)
+    return 0;
+  sock_shard_t* own = sock_thread_shard();
+  uint32_t index = sock_shard_pop(own);
+  for (uint32_t i = 1; !index && i < shardCount; ++i) {
+    index = sock_shard_pop(sockShards + (((uint32_t)(own - sockShards) + i) & (shardCount - 1)));
   }
-  return 0;
+  return index ? sock_make_handle(index) : 0;
 }
 
 static void free_socket(sock_handle_t hdl) {
-  sockets[hdl].handle = -1;
-  sockets[hdl].ready = 0;
-  sockets[hdl].blocking = 0;
+  uint32_t index = (uint32_t)(hdl & SOCK_INDEX_MASK);
+  sock_t* sock = sockets + index;
+  sock->handle = -1;
+  sock->ready = 0;
+  sock->blocking = 0;
+  sock->poller = NULL;
+  sock->poll_events = 0;
+  sock->poll_active = 0;
+  sock->user_data = NULL;
+  if (sock->outq) {
+    free(sock->outq->data);
+    free(sock->outq);
+    sock->outq = NULL;
+  }
+  free(sock->stats);
+  sock->stats = NULL;
+  // retire every outstanding handle to this slot; generation 0 is never handed out
+  sock->generation = (sock->generation + 1) & SOCK_GENERATION_MASK;
+  if (sock->generation == 0)
+    sock->generation = 1;
+
+  // back to the closing thread's shard, where it's likely to be opened again
+  sock_shard_t* shard = sock_thread_shard();
+  uint64_t head = shard->free;
+  for (;;) {
+    sock->next_free = (uint32_t)head;
+    uint64_t seen = sock_cas64(&shard->free, head, (head & 0xFFFFFFFF00000000ull) | index);
+    if (seen == head)
+      return;
+    head = seen;
+  }
+}
+
+// Returns non-zero if the last socket call failed only because it would block
+static int sock_would_block_error() {
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
 }
 
 // Returns 1 if it would block, <0 if there's an error.
 static int would_block(sock_t *socket) {
-  struct timeval timer;
-  fd_set writefd;
+  struct pollfd pfd;
   int retval;
 
-  if (!socket->blocking && !socket->ready) {
-    FD_SET(socket->handle, &writefd);
-    timer.tv_sec = 0;
-    timer.tv_usec = 0;
-    retval = select(0, NULL, &writefd, NULL, &timer);
+  // Sockets driven by a poller learn readiness from sock_poller_wait and
+  // report EWOULDBLOCK from the call itself, so don't probe them here.
+  if (!socket->blocking && !socket->ready && !socket->poller) {
+    pfd.fd = socket->handle;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    retval = poll(&pfd, 1, 0);
     if (retval == 0)
       return 1;
     else if (retval == SOCKET_ERROR) {
-      return -1;//zed_net__error("Got socket error from select()");
+      return -1;//zed_net__error("Got socket error from poll()");
     }
     socket->ready = 1;
   }
@@ -142,274 +1013,4144 @@ static int would_block(sock_t *socket) {
   return 0;
 }
 
-int sock_initialize(size_t max_sockets) {
-  sockets = malloc(sizeof(sock_t)*(max_sockets +1));
-  totalSockets = max_sockets + 1;
-  for (uint32_t i = 0; i < totalSockets; ++i) {
-    sockets[i].handle = -1;
-  }
-#ifdef _WIN32
-  WSADATA wsa_data;
-  if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
-  {
-    return -1;
-  }
+static int sock_poller_sync(sock_t* sock, sock_handle_t skt);
 
-  return 0;
+#define SOCK_RESOLVE_CACHE_SIZE 128
+#define SOCK_RESOLVE_MAX_ADDRESSES 8
+#define SOCK_RESOLVE_HOST_MAX 256
+
+typedef struct sock_resolve_entry_t {
+  uint64_t expires; // sock_now_ms deadline, 0 when unused
+  int flags;
+  int count; // 0 for a name that failed to resolve
+  char host[SOCK_RESOLVE_HOST_MAX];
+  sock_address_t addresses[SOCK_RESOLVE_MAX_ADDRESSES]; // port is filled in per lookup
+} sock_resolve_entry_t;
+
+// Direct-mapped name cache, allocated by sock_initialize
+static sock_resolve_entry_t* resolveCache;
+static thread_mutex_t resolveLock;
+static int resolveTtl = 30000;
+static int resolveNegativeTtl = 5000;
+
+static uint64_t sock_now_ms() {
+#ifdef _WIN32
+  return (uint64_t)GetTickCount64();
 #else
-  return 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000 + (uint64_t)ts.tv_nsec/1000000;
 #endif
 }
 
-void sock_shutdown() {
-  // TODO: actually shutdown sockets;
-  free(sockets);
+// Log-linear histogram: values below 16 get a bucket each, every power of two above
+// that is split into 16 buckets, up to 2^36ns (about a minute)
+#define SOCK_HISTOGRAM_SUB 16
+#define SOCK_HISTOGRAM_TOP_BIT 35
+#define SOCK_HISTOGRAM_BUCKETS (SOCK_HISTOGRAM_SUB + (SOCK_HISTOGRAM_TOP_BIT - 3) * SOCK_HISTOGRAM_SUB)
+// Sends awaiting their timestamps
+#define SOCK_STATS_PENDING 256
+
+typedef struct sock_histogram_t {
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  uint32_t buckets[SOCK_HISTOGRAM_BUCKETS];
+} sock_histogram_t;
+
+typedef struct sock_stats_state_t {
+  sock_stats_t counters; // latency summaries are filled in by sock_get_stats
+  int timestamps;
+  int stream;
+  uint32_t next_key; // kernel timestamp id of the next send, see SOF_TIMESTAMPING_OPT_ID
+  // ring of sends waiting for timestamps, oldest first
+  uint32_t keys[SOCK_STATS_PENDING];
+  uint64_t sent_ns[SOCK_STATS_PENDING];
+  int pending_head;
+  int pending_len;
+  sock_histogram_t latency[SOCK_LATENCY_COUNT];
+} sock_stats_state_t;
+
+// Largest value that lands in bucket 'index'
+static uint64_t sock_histogram_value(int index) {
+  if (index < SOCK_HISTOGRAM_SUB)
+    return (uint64_t)index;
+  int shift = (index - SOCK_HISTOGRAM_SUB) / SOCK_HISTOGRAM_SUB;
+  uint64_t sub = (uint64_t)((index - SOCK_HISTOGRAM_SUB) % SOCK_HISTOGRAM_SUB);
+  return ((SOCK_HISTOGRAM_SUB + sub + 1) << shift) - 1;
 }
 
-void sock_close(sock_handle_t skt) {
-  if (!skt) {
-    return;
+static uint64_t sock_histogram_percentile(const sock_histogram_t* h, double percentile) {
+  if (!h->count)
+    return 0;
+  if (percentile <= 0)
+    return h->min;
+  uint64_t rank = (uint64_t)(percentile / 100.0 * (double)h->count + 0.999999);
+  if (rank > h->count)
+    rank = h->count;
+  uint64_t seen = 0;
+  for (int i = 0; i < SOCK_HISTOGRAM_BUCKETS; ++i) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint64_t value = sock_histogram_value(i);
+      return value < h->min ? h->min : value > h->max ? h->max : value;
+    }
   }
-  sock_t* sock = sockets + skt;
+  return h->max;
+}
 
-  if (sock->handle) {
+static uint64_t sock_realtime_ns() {
 #ifdef _WIN32
-    closesocket(sock->handle);
+  return 0; // no timestamping to compare against
 #else
-    close(sock->handle);
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec*1000000000 + (uint64_t)ts.tv_nsec;
 #endif
-  }
-  free_socket(skt);
 }
 
-int sock_open(sock_handle_t* skt, int non_blocking) {
-  *skt = alloc_socket();
-  sock_t* sock = sockets + (*skt);
+// Time to stamp the next send with, taken before the call since loopback and fast
+// devices timestamp the packet before send returns
+static uint64_t sock_stats_start(sock_t* sock) {
+  return sock->stats && sock->stats->timestamps ? sock_realtime_ns() : 0;
+}
+
+// Counts a send system call started at 'start' that returned 'bytes' (negative on
+// failure). Leaves errno be.
+static void sock_stats_send(sock_t* sock, uint64_t start, int64_t bytes) {
+  sock_stats_state_t* st = sock->stats;
+  ++st->counters.send_calls;
+  if (bytes < 0) {
+    if (sock_would_block_error())
+      ++st->counters.send_would_block;
+    return;
+  }
+  st->counters.bytes_sent += (uint64_t)bytes;
+  if (!st->timestamps || (st->stream && !bytes))
+    return;
+
+  // the kernel names TCP sends by their last byte, datagrams by their number
+  uint32_t key = st->stream ? st->next_key + (uint32_t)bytes - 1 : st->next_key;
+  st->next_key = st->stream ? st->next_key + (uint32_t)bytes : st->next_key + 1;
+  if (st->pending_len == SOCK_STATS_PENDING) {
+    st->pending_head = (st->pending_head + 1) % SOCK_STATS_PENDING;
+    --st->pending_len;
+    ++st->counters.timestamps_dropped;
+  }
+  int slot = (st->pending_head + st->pending_len++) % SOCK_STATS_PENDING;
+  st->keys[slot] = key;
+  st->sent_ns[slot] = start;
+}
+
+static void sock_stats_receive(sock_t* sock, int64_t bytes) {
+  sock_stats_state_t* st = sock->stats;
+  ++st->counters.receive_calls;
+  if (bytes > 0)
+    st->counters.bytes_received += (uint64_t)bytes;
+  else if (bytes < 0 && sock_would_block_error())
+    ++st->counters.receive_would_block;
+}
+
+#ifdef __linux__
+static int sock_histogram_index(uint64_t value) {
+  if (value < SOCK_HISTOGRAM_SUB)
+    return (int)value;
+#if defined(__GNUC__)
+  int bit = 63 - __builtin_clzll(value);
+#else
+  int bit = 4;
+  while (bit < 63 && (value >> (bit + 1)))
+    ++bit;
+#endif
+  if (bit > SOCK_HISTOGRAM_TOP_BIT)
+    return SOCK_HISTOGRAM_BUCKETS - 1;
+  return SOCK_HISTOGRAM_SUB + (bit - 4) * SOCK_HISTOGRAM_SUB + (int)((value >> (bit - 4)) & (SOCK_HISTOGRAM_SUB - 1));
+}
+
+static void sock_histogram_record(sock_histogram_t* h, uint64_t value) {
+  if (!h->count || value < h->min)
+    h->min = value;
+  if (value > h->max)
+    h->max = value;
+  ++h->count;
+  ++h->buckets[sock_histogram_index(value)];
+}
+
+// Matches a kernel timestamp to its send. An ack covers every earlier send too, so those
+// stop waiting. Datagrams never get acked: their send is done once it hit the wire, and
+// as those timestamps come in order, the earlier sends still waiting won't get theirs.
+static void sock_stats_timestamp(sock_stats_state_t* st, uint32_t key, int ack, uint64_t when_ns) {
+  for (int i = 0; i < st->pending_len; ++i) {
+    int slot = (st->pending_head + i) % SOCK_STATS_PENDING;
+    int32_t delta = (int32_t)(st->keys[slot] - key);
+    if (delta > 0)
+      return;
+    if (delta < 0)
+      continue;
+    if (when_ns > st->sent_ns[slot])
+      sock_histogram_record(&st->latency[ack ? SOCK_LATENCY_SEND_TO_ACK : SOCK_LATENCY_SEND_TO_WIRE],
+        when_ns - st->sent_ns[slot]);
+    if (ack || !st->stream) {
+      if (!ack)
+        st->counters.timestamps_dropped += (uint64_t)i;
+      st->pending_head = (slot + 1) % SOCK_STATS_PENDING;
+      st->pending_len -= i + 1;
+    }
+    return;
+  }
+}
+#endif
+
+// Reads the timestamps queued on the socket's error queue
+static int sock_stats_drain(sock_t* sock) {
+  int count = 0;
+#ifdef __linux__
+  sock_stats_state_t* st = sock->stats;
+  if (!st->timestamps)
+    return 0;
+  for (;;) {
+    char control[512];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock->handle, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+      break;
+
+    uint64_t when_ns = 0;
+    const struct sock_extended_err* err = NULL;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+        struct timespec ts;
+        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts)); // ts[0] is the software timestamp
+        when_ns = (uint64_t)ts.tv_sec*1000000000 + (uint64_t)ts.tv_nsec;
+      }
+      else if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+               (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+        err = (const struct sock_extended_err*)CMSG_DATA(cmsg);
+      }
+    }
+    if (!err || err->ee_origin != SO_EE_ORIGIN_TIMESTAMPING || !when_ns)
+      continue;
+    if (err->ee_info == SCM_TSTAMP_SND || err->ee_info == SCM_TSTAMP_ACK)
+      sock_stats_timestamp(st, err->ee_data, err->ee_info == SCM_TSTAMP_ACK, when_ns);
+    ++count;
+  }
+#else
+  (void)sock;
+#endif
+  return count;
+}
+
+// socket() that keeps the handle out of child processes
+static int sock_native_socket(int family, int type, int protocol) {
+#ifdef SOCK_CLOEXEC
+  return (int)socket(family, type | SOCK_CLOEXEC, protocol);
+#else
+  int handle = (int)socket(family, type, protocol);
+#ifndef _WIN32
+  if (handle != INVALID_SOCKET)
+    fcntl(handle, F_SETFD, FD_CLOEXEC);
+#endif
+  return handle;
+#endif
+}
+
+// Creates the kernel socket for a slot. Prefers a dual-stack IPv6 socket, which talks to
+// IPv4 peers through mapped addresses, and falls back to IPv4 on hosts without IPv6.
+static int sock_create_handle(sock_t* sock, int type) {
+  int protocol = type == SOCK_DGRAM ? IPPROTO_UDP : IPPROTO_TCP;
+  int off = 0;
+  sock->handle = sock_native_socket(AF_INET6, type, protocol);
+  if (sock->handle != INVALID_SOCKET) {
+    if (setsockopt(sock->handle, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&off, sizeof(off)) == 0) {
+      sock->family = AF_INET6;
+      return 0;
+    }
+#ifdef _WIN32
+    closesocket(sock->handle);
+#else
+    close(sock->handle);
+#endif
+  }
+  sock->handle = sock_native_socket(AF_INET, type, protocol);
+  sock->family = AF_INET;
+  return sock->handle != INVALID_SOCKET ? 0 : -1;
+}
+
+// Converts 'address' for use on a socket of 'family' (0 for the address' own family)
+//
+// Returns the native address length, 0 if the socket can't reach that address
+static socklen_t sock_address_to_native(const sock_address_t* address, int family, struct sockaddr_storage* out) {
+  memset(out, 0, sizeof(*out));
+  switch (address->family) {
+  case SOCK_FAMILY_IPV4:
+    if (family == AF_INET6) {
+      // IPv4-mapped ::ffff:a.b.c.d
+      struct sockaddr_in6* in6 = (struct sockaddr_in6*)out;
+      in6->sin6_family = AF_INET6;
+      in6->sin6_port = htons(address->port);
+      in6->sin6_addr.s6_addr[10] = 0xff;
+      in6->sin6_addr.s6_addr[11] = 0xff;
+      memcpy(in6->sin6_addr.s6_addr + 12, &address->host, 4);
+      return sizeof(struct sockaddr_in6);
+    }
+    if (family && family != AF_INET)
+      return 0;
+    struct sockaddr_in* in = (struct sockaddr_in*)out;
+    in->sin_family = AF_INET;
+    in->sin_addr.s_addr = address->host;
+    in->sin_port = htons(address->port);
+    return sizeof(struct sockaddr_in);
+  case SOCK_FAMILY_IPV6:
+    if (family && family != AF_INET6)
+      return 0;
+    struct sockaddr_in6* in6 = (struct sockaddr_in6*)out;
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(address->port);
+    in6->sin6_scope_id = address->scope_id;
+    memcpy(in6->sin6_addr.s6_addr, address->host6, 16);
+    return sizeof(struct sockaddr_in6);
+#ifndef _WIN32
+  case SOCK_FAMILY_UNIX:
+    if (family && family != AF_UNIX)
+      return 0;
+    struct sockaddr_un* un = (struct sockaddr_un*)out;
+    un->sun_family = AF_UNIX;
+    size_t len = strlen(address->path);
+    if (len >= sizeof(un->sun_path))
+      return 0;
+    memcpy(un->sun_path, address->path, len);
+    un->sun_path[len] = 0;
+    return sizeof(struct sockaddr_un);
+#endif
+  }
+  return 0;
+}
+
+// Converts a native address, turning IPv4-mapped IPv6 addresses back into IPv4
+static void sock_address_from_native(sock_address_t* address, const struct sockaddr* native) {
+  memset(address, 0, sizeof(*address));
+  if (native->sa_family == AF_INET) {
+    const struct sockaddr_in* in = (const struct sockaddr_in*)native;
+    address->family = SOCK_FAMILY_IPV4;
+    address->host = in->sin_addr.s_addr;
+    address->port = ntohs(in->sin_port);
+  }
+  else if (native->sa_family == AF_INET6) {
+    const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)native;
+    static const unsigned char mapped[12] = { 0,0,0,0,0,0,0,0,0,0,0xff,0xff };
+    if (memcmp(in6->sin6_addr.s6_addr, mapped, sizeof(mapped)) == 0) {
+      address->family = SOCK_FAMILY_IPV4;
+      memcpy(&address->host, in6->sin6_addr.s6_addr + 12, 4);
+    }
+    else {
+      address->family = SOCK_FAMILY_IPV6;
+      memcpy(address->host6, in6->sin6_addr.s6_addr, 16);
+      address->scope_id = in6->sin6_scope_id;
+    }
+    address->port = ntohs(in6->sin6_port);
+  }
+#ifndef _WIN32
+  else if (native->sa_family == AF_UNIX) {
+    const struct sockaddr_un* un = (const struct sockaddr_un*)native;
+    address->family = SOCK_FAMILY_UNIX;
+    // the kernel doesn't terminate a path that fills sun_path
+    const char* end = (const char*)memchr(un->sun_path, 0, sizeof(un->sun_path));
+    size_t len = end ? (size_t)(end - un->sun_path) : sizeof(un->sun_path);
+    if (len > SOCK_UNIX_PATH_MAX - 1)
+      len = SOCK_UNIX_PATH_MAX - 1;
+    memcpy(address->path, un->sun_path, len);
+    address->path[len] = 0;
+  }
+#endif
+}
+
+// Splits the first 'limit' queued bytes into at most two contiguous runs
+static int sock_outq_segments(sock_outq_t* q, sock_iovec_t* iov, size_t limit) {
+  if (limit > q->len)
+    limit = q->len;
+  if (!limit)
+    return 0;
+  size_t first = q->capacity - q->head;
+  if (first >= limit) {
+    iov[0].data = q->data + q->head;
+    iov[0].size = limit;
+    return 1;
+  }
+  iov[0].data = q->data + q->head;
+  iov[0].size = first;
+  iov[1].data = q->data;
+  iov[1].size = limit - first;
+  return 2;
+}
+
+static void sock_outq_push(sock_outq_t* q, const char* data, size_t size) {
+  size_t tail = (q->head + q->len) % q->capacity;
+  size_t first = q->capacity - tail;
+  if (first > size)
+    first = size;
+  memcpy(q->data + tail, data, first);
+  memcpy(q->data, data + first, size - first);
+  q->len += size;
+}
+
+static void sock_outq_consume(sock_outq_t* q, size_t size) {
+  q->head = (q->head + size) % q->capacity;
+  q->len -= size;
+  if (!q->len)
+    q->head = 0;
+}
+
+// Queues buffers behind what is already in the ring, which must have room for them
+static void sock_outq_queue(sock_t* sock, sock_handle_t skt, const sock_iovec_t* iov, int count) {
+  sock_outq_t* q = sock->outq;
+  for (int i = 0; i < count; ++i) {
+    sock_outq_push(q, (const char*)iov[i].data, iov[i].size);
+  }
+  if (!q->above && q->len >= q->high) {
+    q->above = 1;
+    if (q->callback) q->callback(skt, 1, q->user_data);
+  }
+  sock_poller_sync(sock, skt);
+}
+
+// Queues writes without offering them to the kernel, for coalescing and corking. The
+// poller's dirty list isn't locked, see sock_set_coalesce.
+static void sock_outq_hold(sock_t* sock, sock_handle_t skt, const sock_iovec_t* iov, int count) {
+  sock_outq_t* q = sock->outq;
+  // behind a backlog that is already waiting for WRITE there is nothing to hold back
+  if (!q->len && !q->file_left)
+    q->held = 1;
+  for (int i = 0; i < count; ++i) {
+    sock_outq_push(q, (const char*)iov[i].data, iov[i].size);
+  }
+  if (!q->above && q->len >= q->high) {
+    q->above = 1;
+    if (q->callback) q->callback(skt, 1, q->user_data);
+  }
+  if (q->corked || !q->held)
+    return;
+  if (q->coalesce && q->len >= q->coalesce) {
+    sock_flush(skt);
+    return;
+  }
+
+  sock_poller_t* poller = sock->poller;
+  if (q->dirty || !poller)
+    return;
+  if (poller->dirty_count == poller->dirty_capacity) {
+    int capacity = poller->dirty_capacity ? poller->dirty_capacity*2 : 64;
+    sock_handle_t* dirty = (sock_handle_t*)realloc(poller->dirty, sizeof(sock_handle_t)*capacity);
+    if (!dirty) {
+      sock_flush(skt);
+      return;
+    }
+    poller->dirty = dirty;
+    poller->dirty_capacity = capacity;
+  }
+  poller->dirty[poller->dirty_count++] = skt;
+  q->dirty = 1;
+}
+
+// sock_send for sockets with an outbound ring
+static int sock_outq_send(sock_t* sock, sock_handle_t skt, const void* data, int size) {
+  sock_outq_t* q = sock->outq;
+  if ((size_t)size > q->capacity - q->len)
+    return (size_t)size > q->capacity ? -1 : 1;
+
+  if (q->corked || (q->coalesce && (q->len || (size_t)size < q->coalesce)) ) {
+    sock_iovec_t iov;
+    iov.data = (void*)data;
+    iov.size = (size_t)size;
+    sock_outq_hold(sock, skt, &iov, 1);
+    return 0;
+  }
+
+  int sent = 0;
+  if (!q->len && !q->file_left) {
+    // nothing queued ahead of us, so the kernel can have it directly
+    sock_iovec_t iov;
+    iov.data = (void*)data;
+    iov.size = (size_t)size;
+    sent = sock_sendv(skt, &iov, 1);
+    if (sent < 0)
+      return -1;
+  }
+  if (sent < size) {
+    sock_iovec_t rest;
+    rest.data = (char*)data + sent;
+    rest.size = (size_t)(size - sent);
+    sock_outq_queue(sock, skt, &rest, 1);
+  }
+  return 0;
+}
+
+int sock_initialize(size_t max_sockets) {
+  if (max_sockets >= SOCK_INDEX_MASK)
+    return -1;
+  sockets = calloc(max_sockets + 1, sizeof(sock_t));
+  if (!sockets)
+    return -1;
+  totalSockets = (uint32_t)max_sockets + 1;
+
+  // a shard per core, each starting with a contiguous run of slots
+  int cpus = thread_cpu_count();
+  shardCount = 1;
+  while ((int)shardCount < cpus && shardCount < SOCK_MAX_SHARDS)
+    shardCount *= 2;
+  uint32_t per_shard = (uint32_t)(max_sockets + shardCount - 1) / shardCount;
+  memset(sockShards, 0, sizeof(sockShards));
+  // slot 0 is reserved so that a zero handle is always invalid
+  sockets[0].handle = -1;
+  sockets[0].generation = 1;
+  for (uint32_t i = 1; i < totalSockets; ++i) {
+    uint32_t shard = (i - 1) / per_shard;
+    sockets[i].handle = -1;
+    sockets[i].generation = 1;
+    sockets[i].next_free = i + 1 < totalSockets && (i % per_shard) ? i + 1 : 0;
+    if ((i - 1) % per_shard == 0)
+      sockShards[shard].free = i;
+  }
+
+  thread_mutex_init(&resolveLock);
+  resolveCache = calloc(SOCK_RESOLVE_CACHE_SIZE, sizeof(sock_resolve_entry_t));
+#ifdef _WIN32
+  WSADATA wsa_data;
+  if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+  {
+    return -1;
+  }
+
+  return 0;
+#else
+  return 0;
+#endif
+}
+
+void sock_shutdown() {
+  // TODO: actually shutdown sockets;
+  free(sockets);
+  sockets = NULL;
+  totalSockets = 0;
+  shardCount = 0;
+  memset(sockShards, 0, sizeof(sockShards));
+  if (resolveCache) {
+    free(resolveCache);
+    resolveCache = NULL;
+    thread_mutex_term(&resolveLock);
+  }
+}
+
+void sock_close(sock_handle_t skt) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock) {
+    return;
+  }
+
+  if (sock->poller) {
+    sock_poller_remove(sock->poller, skt);
+  }
+  if (sock->handle != -1) {
+#ifdef _WIN32
+    closesocket(sock->handle);
+#else
+    close(sock->handle);
+#endif
+  }
+  free_socket(skt);
+}
+
+// Switches the kernel handle between blocking and non-blocking and records it
+static int sock_set_non_blocking(sock_t* sock, int non_blocking) {
+#ifdef _WIN32
+  u_long nblock = non_blocking ? 1 : 0;
+  if (ioctlsocket(sock->handle, FIONBIO, &nblock) != 0)
+    return -1;
+#else
+  int fl = fcntl(sock->handle, F_GETFL);
+  if (fl < 0 || fcntl(sock->handle, F_SETFL, non_blocking ? fl | O_NONBLOCK : fl & ~O_NONBLOCK) != 0)
+    return -1;
+#endif
+  sock->blocking = !non_blocking;
+  sock->ready = 0;
+  return 0;
+}
+
+int sock_open(sock_handle_t* skt, int non_blocking) {
+  *skt = alloc_socket();
+  sock_t* sock = sock_lookup(*skt);
+  if (!sock)
+    //return zed_net__error("Too many sockets");
+    return -1;
+
+  // Create the socket
+  if (sock_create_handle(sock, SOCK_STREAM) != 0) {
+    sock_close(*skt);
+    //return zed_net__error("Failed to create socket");
+    return -1;
+  }
+
+  if (sock_set_non_blocking(sock, non_blocking) != 0) {
+    sock_close(*skt);
+    //return zed_net__error("Failed to set socket to non-blocking");
+    return -1;
+  }
+
+  return 0;
+}
+
+// Maps a SOCK_OPT_* to its setsockopt level and name
+//
+// Returns 0 on success, -1 if the platform has no such option
+static int sock_option_native(int option, int* level, int* name) {
+  switch (option) {
+  case SOCK_OPT_NODELAY: *level = IPPROTO_TCP; *name = TCP_NODELAY; return 0;
+#if defined(TCP_CORK)
+  case SOCK_OPT_CORK: *level = IPPROTO_TCP; *name = TCP_CORK; return 0;
+#elif defined(TCP_NOPUSH)
+  case SOCK_OPT_CORK: *level = IPPROTO_TCP; *name = TCP_NOPUSH; return 0;
+#endif
+  case SOCK_OPT_REUSEADDR: *level = SOL_SOCKET; *name = SO_REUSEADDR; return 0;
+#ifdef SO_REUSEPORT
+  case SOCK_OPT_REUSEPORT: *level = SOL_SOCKET; *name = SO_REUSEPORT; return 0;
+#endif
+  case SOCK_OPT_SNDBUF: *level = SOL_SOCKET; *name = SO_SNDBUF; return 0;
+  case SOCK_OPT_RCVBUF: *level = SOL_SOCKET; *name = SO_RCVBUF; return 0;
+#ifdef SO_BUSY_POLL
+  case SOCK_OPT_BUSY_POLL: *level = SOL_SOCKET; *name = SO_BUSY_POLL; return 0;
+#endif
+#ifdef TCP_FASTOPEN
+  case SOCK_OPT_FASTOPEN: *level = IPPROTO_TCP; *name = TCP_FASTOPEN; return 0;
+#endif
+#ifdef TCP_QUICKACK
+  case SOCK_OPT_QUICKACK: *level = IPPROTO_TCP; *name = TCP_QUICKACK; return 0;
+#endif
+  case SOCK_OPT_KEEPALIVE: *level = SOL_SOCKET; *name = SO_KEEPALIVE; return 0;
+  }
+  return -1;
+}
+
+static int sock_set_native_option(sock_t* sock, int option, int value) {
+  int level, name;
+  if (sock_option_native(option, &level, &name) != 0)
+    return -1;
+  return setsockopt(sock->handle, level, name, (const char*)&value, sizeof(value)) == 0 ? 0 : -1;
+}
+
+int sock_set_option(sock_handle_t skt, int option, int value) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock || sock->handle == -1)
+    return -1;
+  return sock_set_native_option(sock, option, value);
+}
+
+int sock_get_option(sock_handle_t skt, int option, int* value) {
+  sock_t* sock = sock_lookup(skt);
+  int level, name;
+  if (!sock || sock->handle == -1 || !value || sock_option_native(option, &level, &name) != 0)
+    return -1;
+  socklen_t len = sizeof(*value);
+  *value = 0;
+  return getsockopt(sock->handle, level, name, (char*)value, &len) == 0 ? 0 : -1;
+}
+
+int sock_enable_stats(sock_handle_t skt, int flags) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock || sock->handle == -1)
+    return -1;
+
+#ifdef __linux__
+  int stream = 1;
+  int type = 0;
+  socklen_t len = sizeof(type);
+  if (getsockopt(sock->handle, SOL_SOCKET, SO_TYPE, &type, &len) == 0)
+    stream = type == SOCK_STREAM;
+  // every timestamp names its send by id, which is what lets them be matched up
+  int ts = 0;
+  if (flags & SOCK_STATS_TIMESTAMPS) {
+    ts = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+      SOF_TIMESTAMPING_OPT_TSONLY;
+    if (stream)
+      ts |= SOF_TIMESTAMPING_TX_ACK;
+  }
+  int was_on = sock->stats && sock->stats->timestamps;
+  // the kernel only restarts its ids when OPT_ID goes from clear to set, and the counters
+  // below start over from 0
+  int off = 0;
+  if (ts && was_on && setsockopt(sock->handle, SOL_SOCKET, SO_TIMESTAMPING, &off, sizeof(off)) != 0)
+    return -1;
+  if ((ts || was_on) && setsockopt(sock->handle, SOL_SOCKET, SO_TIMESTAMPING, &ts, sizeof(ts)) != 0)
+    return -1;
+#else
+  if (flags & SOCK_STATS_TIMESTAMPS)
+    return -1;
+#endif
+
+  if (!flags) {
+    free(sock->stats);
+    sock->stats = NULL;
+    return 0;
+  }
+  if (!sock->stats) {
+    sock->stats = (sock_stats_state_t*)malloc(sizeof(sock_stats_state_t));
+    if (!sock->stats)
+      return -1;
+  }
+  memset(sock->stats, 0, sizeof(sock_stats_state_t));
+#ifdef __linux__
+  sock->stats->timestamps = ts != 0;
+  sock->stats->stream = stream;
+#endif
+  return 0;
+}
+
+int sock_stats_poll(sock_handle_t skt) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock || !sock->stats)
+    return -1;
+  return sock_stats_drain(sock);
+}
+
+int sock_get_stats(sock_handle_t skt, sock_stats_t* stats) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock || !sock->stats || !stats)
+    return -1;
+  sock_stats_drain(sock);
+
+  sock_stats_state_t* st = sock->stats;
+  *stats = st->counters;
+  for (int i = 0; i < SOCK_LATENCY_COUNT; ++i) {
+    const sock_histogram_t* h = &st->latency[i];
+    sock_latency_t* l = &stats->latency[i];
+    l->count = h->count;
+    l->min_ns = h->min;
+    l->max_ns = h->max;
+    l->p50_ns = sock_histogram_percentile(h, 50);
+    l->p99_ns = sock_histogram_percentile(h, 99);
+    l->p999_ns = sock_histogram_percentile(h, 99.9);
+  }
+  return 0;
+}
+
+uint64_t sock_stats_percentile(sock_handle_t skt, int which, double percentile) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock || !sock->stats || which < 0 || which >= SOCK_LATENCY_COUNT)
+    return 0;
+  sock_stats_drain(sock);
+  return sock_histogram_percentile(&sock->stats->latency[which], percentile);
+}
+
+// Creates a socket of 'type' bound to 'port' on all interfaces
+static int sock_open_bound(sock_handle_t* skt, int type, unsigned int port, int non_blocking, int flags) {
+  *skt = alloc_socket();
+  sock_t* sock = sock_lookup(*skt);
+  if (!sock)
+    //return zed_net__error("Too many sockets");
+    return -1;
 
   // Create the socket
-  sock->handle = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (sock->handle <= 0) {
+  if (sock_create_handle(sock, type) != 0) {
     sock_close(*skt);
     //return zed_net__error("Failed to create socket");
     return -1;
   }
 
-  sock->blocking = !non_blocking;
+  if (((flags & SOCK_LISTEN_REUSEADDR) && sock_set_native_option(sock, SOCK_OPT_REUSEADDR, 1) != 0) ||
+      ((flags & SOCK_LISTEN_REUSEPORT) && sock_set_native_option(sock, SOCK_OPT_REUSEPORT, 1) != 0)) {
+    sock_close(*skt);
+    //return zed_net__error("Failed to set socket option");
+    return -1;
+  }
+
+  // Bind the socket to the port, on every IPv4 and IPv6 interface where dual-stack
+  struct sockaddr_storage address;
+  memset(&address, 0, sizeof(address));
+  socklen_t addrlen;
+  if (sock->family == AF_INET6) {
+    struct sockaddr_in6* in6 = (struct sockaddr_in6*)&address;
+    in6->sin6_family = AF_INET6;
+    in6->sin6_addr = in6addr_any;
+    in6->sin6_port = htons(port);
+    addrlen = sizeof(struct sockaddr_in6);
+  }
+  else {
+    struct sockaddr_in* in = (struct sockaddr_in*)&address;
+    in->sin_family = AF_INET;
+    in->sin_addr.s_addr = INADDR_ANY;
+    in->sin_port = htons(port);
+    addrlen = sizeof(struct sockaddr_in);
+  }
+
+  if (bind(sock->handle, (const struct sockaddr *) &address, addrlen) != 0) {
+    sock_close(*skt);
+    //return zed_net__error("Failed to bind socket");
+    return -1;
+  }
+
+  // Set the socket to non-blocking if neccessary
+  if (sock_set_non_blocking(sock, non_blocking) != 0) {
+    sock_close(*skt);
+    //return zed_net__error("Failed to set socket to non-blocking");
+    return -1;
+  }
+
+  return 0;
+}
+
+int sock_listen(sock_handle_t* skt, unsigned int port, int non_blocking, int listening) {
+  if (!listening)
+    return sock_open_bound(skt, SOCK_STREAM, port, non_blocking, 0);
+  return sock_listen_ex(skt, port, non_blocking, 0, 0);
+}
+
+// Pending TCP Fast Open requests a SOCK_LISTEN_FASTOPEN listener will hold
+#define SOCK_FASTOPEN_QUEUE 256
+
+int sock_listen_ex(sock_handle_t* skt, unsigned int port, int non_blocking, int backlog, int flags) {
+  if (sock_open_bound(skt, SOCK_STREAM, port, non_blocking, flags) != 0)
+    return -1;
+  sock_t* sock = sock_lookup(*skt);
+
+  if ((flags & SOCK_LISTEN_FASTOPEN) && sock_set_native_option(sock, SOCK_OPT_FASTOPEN, SOCK_FASTOPEN_QUEUE) != 0) {
+    sock_close(*skt);
+    //return zed_net__error("Failed to enable fast open");
+    return -1;
+  }
+
+#ifndef SOMAXCONN
+#define SOMAXCONN 128
+#endif
+  // the kernel clamps larger values to its own limit (net.core.somaxconn on linux)
+  if (listen(sock->handle, backlog > 0 ? backlog : SOMAXCONN) != 0) {
+    sock_close(*skt);
+    //return zed_net__error("Failed make socket listen");
+    return -1;
+  }
+
+  return 0;
+}
+
+int sock_open_udp(sock_handle_t* skt, unsigned int port, int non_blocking) {
+  return sock_open_bound(skt, SOCK_DGRAM, port, non_blocking, 0);
+}
+
+int sock_connect(sock_handle_t skt, sock_address_t remote_addr) {
+  struct sockaddr_storage address;
+  int retval;
+
+  sock_t* sock = sock_lookup(skt);
+  if (!sock)
+    //return zed_net__error("Socket is NULL");
+    return -1;
+
+  socklen_t addrlen = sock_address_to_native(&remote_addr, sock->family, &address);
+  if (!addrlen) {
+    sock_close(skt);
+    //return zed_net__error("Address family not supported by socket");
+    return -1;
+  }
+
+  retval = connect(sock->handle, (const struct sockaddr *) &address, addrlen);
+  if (retval == SOCKET_ERROR) {
+#ifdef _WIN32
+    if (!sock->blocking && WSAGetLastError() == WSAEWOULDBLOCK)
+      return 1;
+#else
+    if (!sock->blocking && (errno == EINPROGRESS || errno == EINTR))
+      return 1;
+#endif
+    sock_close(skt);
+    //return zed_net__error("Failed to connect socket");
+    return -1;
+  }
+
+  return 0;
+}
+
+int sock_connect_result(sock_handle_t skt) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock || sock->handle == -1)
+    return -1;
+
+  struct pollfd pfd;
+  pfd.fd = sock->handle;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+  int n = poll(&pfd, 1, 0);
+  if (n < 0)
+    return -1;
+  if (n == 0)
+    return 1;
+
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(sock->handle, SOL_SOCKET, SO_ERROR, (char*)&error, &len) != 0 || error)
+    return -1;
+  sock->ready = 1;
+  return 0;
+}
+
+#define SOCK_CONNECT_ATTEMPTS 16
+
+struct sock_connector_t {
+  sock_address_t addresses[SOCK_CONNECT_ATTEMPTS]; // in attempt order
+  sock_handle_t sockets[SOCK_CONNECT_ATTEMPTS];    // 0 when not running
+  uint64_t deadlines[SOCK_CONNECT_ATTEMPTS];
+  int count;
+  int started;          // attempts begun so far
+  uint64_t next_start;  // when the next attempt may begin regardless of the others
+  int stagger_ms;
+  int attempt_timeout_ms;
+};
+
+int sock_connector_create(sock_connector_t** connector, const sock_address_t* addresses, int count,
+  int stagger_ms, int attempt_timeout_ms) {
+  if (!connector || !addresses || count <= 0)
+    return -1;
+  sock_connector_t* c = (sock_connector_t*)calloc(1, sizeof(sock_connector_t));
+  if (!c)
+    return -1;
+  if (count > SOCK_CONNECT_ATTEMPTS)
+    count = SOCK_CONNECT_ATTEMPTS;
+  c->stagger_ms = stagger_ms > 0 ? stagger_ms : 250;
+  c->attempt_timeout_ms = attempt_timeout_ms > 0 ? attempt_timeout_ms : 5000;
+
+  // interleave families, starting with whichever the resolver preferred
+  int taken[SOCK_CONNECT_ATTEMPTS] = { 0 };
+  int family = addresses[0].family;
+  for (int n = 0; n < count; ++n) {
+    int pick = -1;
+    for (int i = 0; i < count && pick < 0; ++i) {
+      if (!taken[i] && addresses[i].family == family)
+        pick = i;
+    }
+    for (int i = 0; i < count && pick < 0; ++i) {
+      if (!taken[i])
+        pick = i;
+    }
+    taken[pick] = 1;
+    c->addresses[n] = addresses[pick];
+    family = addresses[pick].family == SOCK_FAMILY_IPV6 ? SOCK_FAMILY_IPV4 : SOCK_FAMILY_IPV6;
+  }
+  c->count = count;
+  *connector = c;
+  return 0;
+}
+
+void sock_connector_destroy(sock_connector_t* connector) {
+  if (!connector)
+    return;
+  for (int i = 0; i < connector->started; ++i) {
+    if (connector->sockets[i])
+      sock_close(connector->sockets[i]);
+  }
+  free(connector);
+}
+
+// Begins the next attempt, returns 1 if one was started
+static int sock_connector_start(sock_connector_t* c, uint64_t now) {
+  while (c->started < c->count) {
+    int i = c->started++;
+    sock_handle_t skt;
+    if (sock_open(&skt, 1) != 0)
+      continue;
+    int ret = sock_connect(skt, c->addresses[i]);
+    if (ret < 0)
+      continue; // refused outright or the wrong family for the socket, sock_connect closed it
+    c->sockets[i] = skt;
+    c->deadlines[i] = now + (uint64_t)c->attempt_timeout_ms;
+    c->next_start = now + (uint64_t)c->stagger_ms;
+    return 1;
+  }
+  return 0;
+}
+
+int sock_connector_timeout(sock_connector_t* connector) {
+  if (!connector)
+    return -1;
+  uint64_t now = sock_now_ms();
+  uint64_t next = 0;
+  if (connector->started < connector->count)
+    next = connector->next_start;
+  for (int i = 0; i < connector->started; ++i) {
+    if (connector->sockets[i] && (!next || connector->deadlines[i] < next))
+      next = connector->deadlines[i];
+  }
+  if (!next)
+    return -1;
+  return next > now ? (int)(next - now) : 0;
+}
+
+int sock_connector_step(sock_connector_t* connector, sock_handle_t* socket, int wait_ms) {
+  if (!connector || !socket)
+    return -1;
+  sock_connector_t* c = connector;
+
+  uint64_t now = sock_now_ms();
+  int running = 0;
+  for (int i = 0; i < c->started; ++i) {
+    running += c->sockets[i] != 0;
+  }
+  if (c->started < c->count && (!running || now >= c->next_start))
+    running += sock_connector_start(c, now);
+  if (!running)
+    return -1;
+
+  // wait for any attempt to finish, but no longer than the next start or deadline
+  int timeout = sock_connector_timeout(c);
+  if (wait_ms >= 0 && (timeout < 0 || wait_ms < timeout))
+    timeout = wait_ms;
+  struct pollfd pfds[SOCK_CONNECT_ATTEMPTS];
+  int n = 0;
+  for (int i = 0; i < c->started; ++i) {
+    if (c->sockets[i]) {
+      pfds[n].fd = sock_lookup(c->sockets[i])->handle;
+      pfds[n].events = POLLOUT;
+      pfds[n].revents = 0;
+      ++n;
+    }
+  }
+  if (poll(pfds, n, timeout) < 0)
+    return 1; // interrupted, try again
+
+  now = sock_now_ms();
+  for (int i = 0; i < c->started; ++i) {
+    if (!c->sockets[i])
+      continue;
+    int ret = sock_connect_result(c->sockets[i]);
+    if (ret == 0) {
+      *socket = c->sockets[i];
+      c->sockets[i] = 0;
+      for (int j = 0; j < c->started; ++j) {
+        if (c->sockets[j]) {
+          sock_close(c->sockets[j]);
+          c->sockets[j] = 0;
+        }
+      }
+      c->started = c->count;
+      return 0;
+    }
+    if (ret < 0 || now >= c->deadlines[i]) {
+      sock_close(c->sockets[i]);
+      c->sockets[i] = 0;
+      // a failure lets the next address go right away
+      c->next_start = now;
+    }
+  }
+  for (int i = 0; i < c->started; ++i) {
+    if (c->sockets[i])
+      return 1;
+  }
+  return c->started < c->count ? 1 : -1;
+}
+
+int sock_connect_race(sock_handle_t* socket, const sock_address_t* addresses, int count, int timeout_ms) {
+  sock_connector_t* c;
+  if (!socket || sock_connector_create(&c, addresses, count, 0, 0) != 0)
+    return -1;
+
+  uint64_t deadline = sock_now_ms() + (uint64_t)timeout_ms;
+  int ret;
+  for (;;) {
+    int wait = -1;
+    if (timeout_ms >= 0) {
+      uint64_t now = sock_now_ms();
+      if (now >= deadline) {
+        ret = -1;
+        break;
+      }
+      wait = (int)(deadline - now);
+    }
+    ret = sock_connector_step(c, socket, wait);
+    if (ret != 1)
+      break;
+  }
+  sock_connector_destroy(c);
+  if (ret == 0 && sock_set_non_blocking(sock_lookup(*socket), 0) != 0) {
+    sock_close(*socket);
+    return -1;
+  }
+  return ret;
+}
+
+// Accepts one connection, setting the listener's blocking mode and close-on-exec on the
+// new handle (atomically where accept4 exists)
+static int sock_accept_native(sock_t* listener, struct sockaddr_storage* address) {
+  socklen_t addrlen = sizeof(*address);
+#ifdef SOCK_HAS_ACCEPT4
+  return accept4(listener->handle, (struct sockaddr*)address, &addrlen,
+    SOCK_CLOEXEC | (listener->blocking ? 0 : SOCK_NONBLOCK));
+#else
+  int handle = (int)accept(listener->handle, (struct sockaddr*)address, &addrlen);
+#ifndef _WIN32
+  // Windows sockets inherit the listener's mode by themselves
+  if (handle != INVALID_SOCKET) {
+    fcntl(handle, F_SETFD, FD_CLOEXEC);
+    if (!listener->blocking)
+      fcntl(handle, F_SETFL, fcntl(handle, F_GETFL) | O_NONBLOCK);
+  }
+#endif
+  return handle;
+#endif
+}
+
+// Gives an accepted handle a slot, closing it if the table is full
+static int sock_adopt_accepted(sock_t* listener, int handle, sock_handle_t* remote_socket) {
+  *remote_socket = alloc_socket();
+  sock_t* rsock = sock_lookup(*remote_socket);
+  if (!rsock) {
+#ifdef _WIN32
+    closesocket(handle);
+#else
+    close(handle);
+#endif
+    //return zed_net__error("Too many sockets");
+    return -1;
+  }
+  rsock->family = listener->family;
+  rsock->blocking = listener->blocking;
+  rsock->ready = 0;
+  rsock->handle = handle;
+  return 0;
+}
+
+int sock_accept(sock_handle_t skt, sock_handle_t *remote_socket, sock_address_t *remote_addr) {
+  struct sockaddr_storage address;
+  sock_t* listening_socket = sock_lookup(skt);
+
+  if (!listening_socket)
+    //return zed_net__error("Listening socket is NULL");
+    return -1;
+  if (!remote_socket)
+    //return zed_net__error("Remote socket is NULL");
+    return -1;
+  if (!remote_addr)
+    //return zed_net__error("Address pointer is NULL");
+    return -1;
+
+  // no readiness probe, a non-blocking accept says EWOULDBLOCK by itself
+  int handle = sock_accept_native(listening_socket, &address);
+  if (handle == INVALID_SOCKET)
+    return 2;
+
+  if (sock_adopt_accepted(listening_socket, handle, remote_socket) != 0)
+    return -1;
+  sock_address_from_native(remote_addr, (const struct sockaddr*)&address);
+  return 0;
+}
+
+int sock_accept_many(sock_handle_t skt, sock_handle_t* remote_sockets, sock_address_t* remote_addrs, int max) {
+  sock_t* listening_socket = sock_lookup(skt);
+  if (!listening_socket || !remote_sockets || max <= 0)
+    return -1;
+
+  int count = 0;
+  while (count < max) {
+    struct sockaddr_storage address;
+    int handle = sock_accept_native(listening_socket, &address);
+    if (handle == INVALID_SOCKET) {
+      if (count || sock_would_block_error())
+        break;
+#ifndef _WIN32
+      // the connection was reset before we got to it, try the next one
+      if (errno == ECONNABORTED || errno == EINTR)
+        continue;
+#endif
+      return -1;
+    }
+    if (sock_adopt_accepted(listening_socket, handle, remote_sockets + count) != 0)
+      return count ? count : -1;
+    if (remote_addrs)
+      sock_address_from_native(remote_addrs + count, (const struct sockaddr*)&address);
+    ++count;
+    if (listening_socket->blocking)
+      break;
+  }
+  return count;
+}
+
+int sock_unix_address(sock_address_t* address, const char* path) {
+  if (!address || !path || strlen(path) >= SOCK_UNIX_PATH_MAX)
+    return -1;
+  memset(address, 0, sizeof(*address));
+  address->family = SOCK_FAMILY_UNIX;
+  strcpy(address->path, path);
+  return 0;
+}
+
+#ifndef _WIN32
+static int sock_unix_type(int type) {
+  return type == SOCK_UNIX_SEQPACKET ? SOCK_SEQPACKET : SOCK_STREAM;
+}
+
+int sock_open_unix(sock_handle_t* skt, int type, int non_blocking) {
+  *skt = alloc_socket();
+  sock_t* sock = sock_lookup(*skt);
+  if (!sock)
+    //return zed_net__error("Too many sockets");
+    return -1;
+
+  sock->handle = sock_native_socket(AF_UNIX, sock_unix_type(type), 0);
+  sock->family = AF_UNIX;
+  if (sock->handle == INVALID_SOCKET || sock_set_non_blocking(sock, non_blocking) != 0) {
+    sock_close(*skt);
+    return -1;
+  }
+  return 0;
+}
+
+int sock_listen_unix(sock_handle_t* skt, const char* path, int type, int non_blocking, int backlog) {
+  sock_address_t address;
+  if (sock_unix_address(&address, path) != 0 || sock_open_unix(skt, type, non_blocking) != 0)
+    return -1;
+  sock_t* sock = sock_lookup(*skt);
+
+  struct sockaddr_storage native;
+  socklen_t addrlen = sock_address_to_native(&address, AF_UNIX, &native);
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+  if (bind(sock->handle, (const struct sockaddr*)&native, addrlen) != 0 ||
+      listen(sock->handle, backlog > 0 ? backlog : SOMAXCONN) != 0) {
+    sock_close(*skt);
+    //return zed_net__error("Failed to bind socket");
+    return -1;
+  }
+  return 0;
+}
+
+int sock_socketpair(sock_handle_t skts[2], int type, int non_blocking) {
+  int fds[2];
+  int native_type = sock_unix_type(type);
+#ifdef SOCK_CLOEXEC
+  native_type |= SOCK_CLOEXEC;
+#endif
+  if (socketpair(AF_UNIX, native_type, 0, fds) != 0)
+    return -1;
+#ifndef SOCK_CLOEXEC
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+  // sock_adopt_native leaves the fd to us when it fails
+  if (sock_adopt_native(&skts[0], fds[0], non_blocking) != 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (sock_adopt_native(&skts[1], fds[1], non_blocking) != 0) {
+    sock_close(skts[0]);
+    close(fds[1]);
+    return -1;
+  }
+  return 0;
+}
+
+int sock_send_fds(sock_handle_t skt, const void* data, int size, const int* fds, int count) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock || sock->family != AF_UNIX || !data || size <= 0 || count < 0 || count > SOCK_MAX_FDS)
+    return -1;
+  // going straight to the kernel would put these bytes ahead of the queued ones
+  if (sock->outq && (sock->outq->len || sock->outq->file_left))
+    return 0;
+
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * SOCK_MAX_FDS)];
+  } control;
+  struct iovec iov;
+  iov.iov_base = (void*)data;
+  iov.iov_len = (size_t)size;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (count) {
+    memset(&control, 0, sizeof(control));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+  }
+
+  ssize_t sent;
+  do {
+    sent = sendmsg(sock->handle, &msg, 0);
+  } while (sent < 0 && errno == EINTR);
+  if (sent < 0)
+    return sock_would_block_error() ? 0 : -1;
+
+  // the descriptors rode along with the first byte. Only a stream socket can come back
+  // short, a second send on anything else would split the message.
+  int type = 0;
+  socklen_t type_len = sizeof(type);
+  if (sent < size && getsockopt(sock->handle, SOL_SOCKET, SO_TYPE, &type, &type_len) == 0 && type == SOCK_STREAM) {
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+    while (sent < size) {
+      iov.iov_base = (char*)data + sent;
+      iov.iov_len = (size_t)(size - sent);
+      ssize_t more = sendmsg(sock->handle, &msg, 0);
+      if (more < 0 && errno == EINTR)
+        continue;
+      if (more < 0 && sock_would_block_error())
+        break;
+      if (more < 0)
+        return -1;
+      sent += more;
+    }
+  }
+  return (int)sent;
+}
+
+int sock_receive_fds(sock_handle_t skt, void* data, int size, int* fds, int max, int* count) {
+  sock_t* sock = sock_lookup(skt);
+  if (count)
+    *count = 0;
+  if (!sock || sock->family != AF_UNIX || !data || size <= 0 || max < 0)
+    return -1;
+
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * SOCK_MAX_FDS)];
+  } control;
+  struct iovec iov;
+  iov.iov_base = data;
+  iov.iov_len = (size_t)size;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  int flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+  flags |= MSG_CMSG_CLOEXEC;
+#endif
+  ssize_t received;
+  do {
+    received = recvmsg(sock->handle, &msg, flags);
+  } while (received < 0 && errno == EINTR);
+  if (received < 0)
+    return sock_would_block_error() ? -2 : -1;
+
+  int got = 0;
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    int n = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    const unsigned char* p = CMSG_DATA(cmsg);
+    for (int i = 0; i < n; ++i) {
+      int fd;
+      memcpy(&fd, p + i * sizeof(int), sizeof(int));
+#ifndef MSG_CMSG_CLOEXEC
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+      // don't leak what the caller has no room for
+      if (got < max && fds)
+        fds[got++] = fd;
+      else
+        close(fd);
+    }
+  }
+  if (msg.msg_flags & MSG_CTRUNC) {
+    // the kernel dropped descriptors it had no room for
+    while (got)
+      close(fds[--got]);
+    return -1;
+  }
+  if (count)
+    *count = got;
+  return (int)received;
+}
+#else
+int sock_open_unix(sock_handle_t* skt, int type, int non_blocking) {
+  return -1;
+}
+
+int sock_listen_unix(sock_handle_t* skt, const char* path, int type, int non_blocking, int backlog) {
+  return -1;
+}
+
+int sock_socketpair(sock_handle_t skts[2], int type, int non_blocking) {
+  return -1;
+}
+
+int sock_send_fds(sock_handle_t skt, const void* data, int size, const int* fds, int count) {
+  return -1;
+}
+
+int sock_receive_fds(sock_handle_t skt, void* data, int size, int* fds, int max, int* count) {
+  if (count)
+    *count = 0;
+  return -1;
+}
+#endif
+
+intptr_t sock_native_handle(sock_handle_t skt) {
+  sock_t* sock = sock_lookup(skt);
+  return sock ? (intptr_t)sock->handle : -1;
+}
+
+int sock_adopt_native(sock_handle_t* skt, intptr_t handle, int non_blocking) {
+  if (!skt || handle < 0)
+    return -1;
+  struct sockaddr_storage address;
+  socklen_t addrlen = sizeof(address);
+  if (getsockname((int)handle, (struct sockaddr*)&address, &addrlen) != 0)
+    return -1;
+
+  *skt = alloc_socket();
+  sock_t* sock = sock_lookup(*skt);
+  if (!sock)
+    //return zed_net__error("Too many sockets");
+    return -1;
+  sock->handle = (int)handle;
+  sock->family = address.ss_family;
+  if (sock_set_non_blocking(sock, non_blocking) != 0) {
+    // leave the handle to the caller
+    sock->handle = -1;
+    sock_close(*skt);
+    return -1;
+  }
+  return 0;
+}
+
+int sock_set_inheritable(sock_handle_t skt, int inheritable) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock)
+    return -1;
+#ifdef _WIN32
+  return SetHandleInformation((HANDLE)(intptr_t)sock->handle, HANDLE_FLAG_INHERIT,
+    inheritable ? HANDLE_FLAG_INHERIT : 0) ? 0 : -1;
+#else
+  int fl = fcntl(sock->handle, F_GETFD);
+  if (fl < 0)
+    return -1;
+  return fcntl(sock->handle, F_SETFD, inheritable ? fl & ~FD_CLOEXEC : fl | FD_CLOEXEC) == 0 ? 0 : -1;
+#endif
+}
+
+int sock_send(sock_handle_t skt, const void *data, int size) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock) return -1;
+  if (sock->outq) return sock_outq_send(sock, skt, data, size);
+
+  int retval;
+
+  retval = would_block(sock);
+  if (retval == 1)
+    return 1;
+  else if (retval) {
+    sock_close(skt);
+    return -1;
+  }
+
+  uint64_t start = sock_stats_start(sock);
+  int sent_bytes = send(sock->handle, (const char *)data, size, 0);
+  if (sock->stats)
+    sock_stats_send(sock, start, sent_bytes);
+  if (sent_bytes < 0 && sock_would_block_error()) {
+    return 1;
+  }
+  // a blocking send can still come back short when the kernel is low on buffer space
+  while (sock->blocking && sent_bytes >= 0 && sent_bytes < size) {
+    start = sock_stats_start(sock);
+    int more = send(sock->handle, (const char *)data + sent_bytes, size - sent_bytes, 0);
+    if (sock->stats)
+      sock_stats_send(sock, start, more);
+    if (more < 0)
+      break;
+    sent_bytes += more;
+  }
+  if (sent_bytes != size) {
+    //return zed_net__error("Failed to send data");
+    return -1;
+  }
+
+  return 0;
+}
+
+int sock_receive(sock_handle_t skt, void *data, int size) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock) return -1;
+
+  int retval;
+
+  retval = would_block(sock);
+  if (retval == 1)
+    return 1;
+  else if (retval) {
+    sock_close(skt);
+    return -1;
+  }
+
+#ifdef _WIN32
+  typedef int socklen_t;
+#endif
+
+  int received_bytes = recv(sock->handle, (char *)data, size, 0);
+  if (sock->stats)
+    sock_stats_receive(sock, received_bytes);
+  if (received_bytes <= 0) {
+    return 0;
+  }
+  return received_bytes;
+}
+
+int sock_set_send_buffer(sock_handle_t skt, size_t capacity, size_t high_watermark,
+                         size_t low_watermark, sock_watermark_fn callback, void* user_data) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock)
+    return -1;
+
+  sock_outq_t* q = sock->outq;
+  if (q && (q->len || q->file_left) && !capacity)
+    return -1;
+  if (!capacity) {
+    if (q) {
+      free(q->data);
+      free(q);
+      sock->outq = NULL;
+      sock_poller_sync(sock, skt);
+    }
+    return 0;
+  }
+  if (q && q->len > capacity)
+    return -1;
+  if (low_watermark > high_watermark || high_watermark > capacity)
+    return -1;
+
+  char* data = malloc(capacity);
+  if (!data)
+    return -1;
+  if (!q) {
+    q = calloc(1, sizeof(sock_outq_t));
+    if (!q) {
+      free(data);
+      return -1;
+    }
+    q->file_fd = -1;
+    sock->outq = q;
+  }
+  // keep anything already queued, straightened out at the front of the new ring
+  size_t len = 0;
+  if (q->data) {
+    sock_iovec_t iov[2];
+    int n = sock_outq_segments(q, iov, q->len);
+    for (int i = 0; i < n; ++i) {
+      memcpy(data + len, iov[i].data, iov[i].size);
+      len += iov[i].size;
+    }
+    free(q->data);
+  }
+  q->data = data;
+  q->capacity = capacity;
+  q->head = 0;
+  q->len = len;
+  q->high = high_watermark;
+  q->low = low_watermark;
+  q->callback = callback;
+  q->user_data = user_data;
+  q->temporary = 0;
+  return 0;
+}
+
+static int64_t sock_sendfile_chunk(sock_t* sock, int fd, int64_t offset, int64_t length);
+
+// sock_flush, and with 'release' = 0 the poller's flush on writability, which leaves the
+// bytes written since a cork alone
+static int sock_outq_flush(sock_handle_t skt, int release) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock)
+    return -1;
+  sock_outq_t* q = sock->outq;
+  if (!q || (!q->len && !q->file_left))
+    return 0;
+  if (release)
+    q->released = q->len;
+  if (release || !q->corked)
+    q->held = 0;
+
+  for (;;) {
+    // ring bytes queued ahead of the file range, or all of them
+    size_t limit = q->file_left ? q->file_prefix : q->len;
+    if (q->corked && limit > q->released)
+      limit = q->released;
+    if (limit) {
+      sock_iovec_t iov[2];
+      int n = sock_outq_segments(q, iov, limit);
+      int sent = sock_sendv(skt, iov, n);
+      if (sent < 0)
+        return -1;
+      sock_outq_consume(q, (size_t)sent);
+      q->released = q->released > (size_t)sent ? q->released - (size_t)sent : 0;
+      if (q->file_left)
+        q->file_prefix -= (size_t)sent;
+      if ((size_t)sent < limit)
+        break;
+    }
+    // the range only goes once the bytes ahead of it have
+    if (!q->file_left || q->file_prefix)
+      break;
+
+    int64_t sent = sock_sendfile_chunk(sock, q->file_fd, q->file_offset, q->file_left);
+    if (sent < 0)
+      return -1;
+    q->file_offset += sent;
+    q->file_left -= sent;
+    if (q->file_left)
+      break;
+    q->file_fd = -1;
+  }
+
+  if (q->above && q->len <= q->low) {
+    q->above = 0;
+    if (q->callback) q->callback(skt, 0, q->user_data);
+  }
+  int64_t left = (int64_t)q->len + q->file_left;
+  if (!left && q->temporary && !q->corked && !q->coalesce) {
+    // the frame it was made for is out, later sends go straight to the kernel again
+    free(q->data);
+    free(q);
+    sock->outq = NULL;
+  }
+  // drained, or what's left now waits for WRITE
+  sock_poller_sync(sock, skt);
+  return left > INT_MAX ? INT_MAX : (int)left;
+}
+
+int sock_flush(sock_handle_t skt) {
+  return sock_outq_flush(skt, 1);
+}
+
+size_t sock_send_pending(sock_handle_t skt) {
+  sock_t* sock = sock_lookup(skt);
+  return sock && sock->outq ? sock->outq->len + (size_t)sock->outq->file_left : 0;
+}
+
+// Send buffer made for coalescing or corking a socket that has none
+#define SOCK_COALESCE_BUFFER (256*1024)
+
+static sock_outq_t* sock_coalesce_queue(sock_handle_t skt) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock)
+    return NULL;
+  if (!sock->outq &&
+      sock_set_send_buffer(skt, SOCK_COALESCE_BUFFER, SOCK_COALESCE_BUFFER, 0, NULL, NULL) != 0)
+    return NULL;
+  return sock->outq;
+}
+
+int sock_set_coalesce(sock_handle_t skt, size_t limit) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock)
+    return -1;
+  if (!limit) {
+    if (sock->outq) {
+      sock->outq->coalesce = 0;
+      if (!sock->outq->corked && sock_flush(skt) < 0)
+        return -1;
+    }
+    return 0;
+  }
+  sock_outq_t* q = sock_coalesce_queue(skt);
+  if (!q)
+    return -1;
+  q->coalesce = limit;
+  return 0;
+}
+
+int sock_cork(sock_handle_t skt) {
+  sock_outq_t* q = sock_coalesce_queue(skt);
+  if (!q)
+    return -1;
+  // what was queued before still goes out as the socket takes it
+  if (!q->corked)
+    q->released = q->len;
+  q->corked = 1;
+  return 0;
+}
+
+int sock_uncork(sock_handle_t skt) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock)
+    return -1;
+  if (!sock->outq)
+    return 0;
+  sock->outq->corked = 0;
+  return sock_flush(skt);
+}
+
+// Largest piece of a file pushed per call, so one big transfer doesn't starve other sockets
+#define SOCK_SENDFILE_CHUNK (1 << 20)
+
+// One non-looping transfer of up to SOCK_SENDFILE_CHUNK file bytes
+//
+// Returns the bytes sent, 0 if the socket isn't ready, -1 otherwise
+static int64_t sock_sendfile_chunk(sock_t* sock, int fd, int64_t offset, int64_t length) {
+  if (length > SOCK_SENDFILE_CHUNK)
+    length = SOCK_SENDFILE_CHUNK;
+#ifdef __linux__
+  off_t off = (off_t)offset;
+  uint64_t start = sock_stats_start(sock);
+  ssize_t sent = sendfile(sock->handle, fd, &off, (size_t)length);
+  if (sock->stats && (sent >= 0 || (errno != EINVAL && errno != ENOSYS)))
+    sock_stats_send(sock, start, sent);
+  if (sent > 0)
+    return sent;
+  if (sent == 0)
+    return -1; // the range runs past the end of the file
+  if (sock_would_block_error())
+    return 0;
+  if (errno != EINVAL && errno != ENOSYS)
+    return -1;
+  // the file can't be mapped (e.g. a pipe or some FUSE mounts), copy it instead
+#endif
+  char buf[16384];
+  if (length > (int64_t)sizeof(buf))
+    length = sizeof(buf);
+#ifdef _WIN32
+  if (_lseeki64(fd, offset, SEEK_SET) < 0)
+    return -1;
+  int got = _read(fd, buf, (unsigned int)length);
+#else
+  ssize_t got = pread(fd, buf, (size_t)length, (off_t)offset);
+#endif
+  if (got <= 0)
+    return -1; // a range past the end of the file is an error, not an endless wait
+  uint64_t send_start = sock_stats_start(sock);
+  int wrote = send(sock->handle, buf, (int)got, 0);
+  if (sock->stats)
+    sock_stats_send(sock, send_start, wrote);
+  if (wrote < 0)
+    return sock_would_block_error() ? 0 : -1;
+  // anything send didn't take is simply read again next time
+  return wrote;
+}
+
+int64_t sock_sendfile(sock_handle_t skt, int fd, int64_t offset, int64_t length) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock || fd < 0 || offset < 0 || length < 0)
+    return -1;
+
+  sock_outq_t* q = sock->outq;
+  if (q && q->file_left)
+    return -1;
+
+  // buffered bytes go first, the range queues behind whatever is left of them
+  if (q && q->len && sock_flush(skt) < 0)
+    return -1;
+  q = sock->outq; // a drained sock_send_frames buffer is gone
+
+  int64_t sent = 0;
+  if (!q || !q->len) {
+    while (sent < length) {
+      int64_t n = sock_sendfile_chunk(sock, fd, offset + sent, length - sent);
+      if (n < 0)
+        return -1;
+      if (!n)
+        break;
+      sent += n;
+    }
+  }
+
+  if (q && sent < length) {
+    q->file_fd = fd;
+    q->file_offset = offset + sent;
+    q->file_left = length - sent;
+    q->file_prefix = q->len;
+    q->released = q->len; // flushed above, a cork doesn't hold it back
+    sock_poller_sync(sock, skt);
+  }
+  return sent;
+}
+
+// Buffers handed to the kernel per sendmsg/recvmsg call
+#define SOCK_IOV_MAX 64
+
+int sock_iovec_advance(sock_iovec_t** iov, int count, size_t bytes) {
+  sock_iovec_t* v = *iov;
+  while (count > 0 && bytes >= v->size) {
+    bytes -= v->size;
+    ++v;
+    --count;
+  }
+  if (count > 0 && bytes) {
+    v->data = (char*)v->data + bytes;
+    v->size -= bytes;
+  }
+  *iov = v;
+  return count;
+}
+
+int sock_sendv(sock_handle_t skt, const sock_iovec_t* iov, int count) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock || (!iov && count)) return -1;
+
+  int retval = would_block(sock);
+  if (retval == 1)
+    return 0;
+  else if (retval) {
+    sock_close(skt);
+    return -1;
+  }
+
+  int total = 0;
+  int first = 0;    // first buffer not fully sent
+  size_t skip = 0;  // bytes of 'first' already sent
+  while (first < count) {
+#ifdef _WIN32
+    WSABUF vec[SOCK_IOV_MAX];
+#else
+    struct iovec vec[SOCK_IOV_MAX];
+#endif
+    int n = 0;
+    size_t batch = 0;
+    for (int i = first; i < count && n < SOCK_IOV_MAX; ++i) {
+      size_t offset = i == first ? skip : 0;
+      if (iov[i].size == offset)
+        continue;
+#ifdef _WIN32
+      vec[n].buf = (char*)iov[i].data + offset;
+      vec[n].len = (ULONG)(iov[i].size - offset);
+#else
+      vec[n].iov_base = (char*)iov[i].data + offset;
+      vec[n].iov_len = iov[i].size - offset;
+#endif
+      batch += iov[i].size - offset;
+      ++n;
+    }
+    if (!n)
+      break;
+
+#ifdef _WIN32
+    DWORD sent_bytes = 0;
+    uint64_t start = sock_stats_start(sock);
+    int failed = WSASend(sock->handle, vec, n, &sent_bytes, 0, NULL, NULL) != 0;
+    if (sock->stats)
+      sock_stats_send(sock, start, failed ? -1 : (int64_t)sent_bytes);
+    if (failed) {
+      if (sock_would_block_error())
+        return total;
+      //return zed_net__error("Failed to send data");
+      return total ? total : -1;
+    }
+    size_t sent = sent_bytes;
+#else
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = n;
+    uint64_t start = sock_stats_start(sock);
+    ssize_t sent_bytes = sendmsg(sock->handle, &msg, 0);
+    if (sock->stats)
+      sock_stats_send(sock, start, sent_bytes);
+    if (sent_bytes < 0) {
+      if (errno == EINTR)
+        continue;
+      if (sock_would_block_error())
+        return total;
+      //return zed_net__error("Failed to send data");
+      return total ? total : -1;
+    }
+    size_t sent = (size_t)sent_bytes;
+#endif
+    total += (int)sent;
+
+    // step past what went out, possibly stopping inside a buffer
+    size_t left = sent + skip;
+    while (first < count && left >= iov[first].size) {
+      left -= iov[first].size;
+      ++first;
+    }
+    skip = left;
+
+    if (!sock->blocking && sent < batch)
+      break; // the send buffer is full
+  }
+
+  return total;
+}
+
+int sock_receivev(sock_handle_t skt, sock_iovec_t* iov, int count) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock || !iov || count <= 0) return -1;
+
+  int retval = would_block(sock);
+  if (retval == 1)
+    return 0;
+  else if (retval) {
+    sock_close(skt);
+    return -1;
+  }
+
+  if (count > SOCK_IOV_MAX)
+    count = SOCK_IOV_MAX;
+#ifdef _WIN32
+  WSABUF vec[SOCK_IOV_MAX];
+  for (int i = 0; i < count; ++i) {
+    vec[i].buf = (char*)iov[i].data;
+    vec[i].len = (ULONG)iov[i].size;
+  }
+  DWORD received_bytes = 0;
+  DWORD flags = 0;
+  int failed = WSARecv(sock->handle, vec, count, &received_bytes, &flags, NULL, NULL) != 0;
+  if (sock->stats)
+    sock_stats_receive(sock, failed ? -1 : (int64_t)received_bytes);
+  if (failed)
+    return sock_would_block_error() ? 0 : -1;
+  return received_bytes ? (int)received_bytes : -1;
+#else
+  struct iovec vec[SOCK_IOV_MAX];
+  for (int i = 0; i < count; ++i) {
+    vec[i].iov_base = iov[i].data;
+    vec[i].iov_len = iov[i].size;
+  }
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = vec;
+  msg.msg_iovlen = count;
+  ssize_t received_bytes;
+  do {
+    received_bytes = recvmsg(sock->handle, &msg, 0);
+  } while (received_bytes < 0 && errno == EINTR);
+  if (sock->stats)
+    sock_stats_receive(sock, received_bytes);
+  if (received_bytes < 0)
+    return sock_would_block_error() ? 0 : -1;
+  return received_bytes ? (int)received_bytes : -1;
+#endif
+}
+
+struct sock_framer_t {
+  int prefix;
+  size_t max_message;
+  char* data;
+  size_t capacity;
+  size_t start; // first unconsumed byte
+  size_t end;   // end of received bytes
+};
+
+// Initial receive buffer, grown up to the largest frame when needed
+#define SOCK_FRAMER_BUFFER 16384
+
+int sock_framer_create(sock_framer_t** framer, int prefix, size_t max_message) {
+  if (!framer || (prefix != SOCK_FRAME_VARINT && prefix != SOCK_FRAME_U32BE) ||
+      !max_message || max_message > 0xffffffffu)
+    return -1;
+  sock_framer_t* f = (sock_framer_t*)calloc(1, sizeof(sock_framer_t));
+  if (!f)
+    return -1;
+  f->prefix = prefix;
+  f->max_message = max_message;
+  f->capacity = SOCK_FRAMER_BUFFER;
+  if (f->capacity > max_message + SOCK_FRAME_PREFIX_MAX)
+    f->capacity = max_message + SOCK_FRAME_PREFIX_MAX;
+  f->data = (char*)malloc(f->capacity);
+  if (!f->data) {
+    free(f);
+    return -1;
+  }
+  *framer = f;
+  return 0;
+}
+
+void sock_framer_destroy(sock_framer_t* framer) {
+  if (!framer)
+    return;
+  free(framer->data);
+  free(framer);
+}
+
+// Decodes a prefix from 'data'
+//
+// Returns the prefix length, 0 if more bytes are needed, -1 if malformed
+static int sock_frame_parse(int prefix, const unsigned char* data, size_t available, size_t* size) {
+  if (prefix == SOCK_FRAME_U32BE) {
+    if (available < 4)
+      return 0;
+    *size = ((size_t)data[0] << 24) | ((size_t)data[1] << 16) | ((size_t)data[2] << 8) | data[3];
+    return 4;
+  }
+  uint32_t value = 0;
+  for (int i = 0; i < SOCK_FRAME_PREFIX_MAX; ++i) {
+    if ((size_t)i == available)
+      return 0;
+    if (i == 4 && data[i] > 0x0f)
+      return -1; // more than 32 bits
+    value |= (uint32_t)(data[i] & 0x7f) << (7*i);
+    if (!(data[i] & 0x80)) {
+      *size = value;
+      return i + 1;
+    }
+  }
+  return -1;
+}
+
+int sock_frame_prefix(int prefix, size_t size, unsigned char* out) {
+  if (size > 0xffffffffu)
+    return -1;
+  if (prefix == SOCK_FRAME_U32BE) {
+    out[0] = (unsigned char)(size >> 24);
+    out[1] = (unsigned char)(size >> 16);
+    out[2] = (unsigned char)(size >> 8);
+    out[3] = (unsigned char)size;
+    return 4;
+  }
+  if (prefix != SOCK_FRAME_VARINT)
+    return -1;
+  int n = 0;
+  do {
+    unsigned char byte = size & 0x7f;
+    size >>= 7;
+    out[n++] = size ? byte | 0x80 : byte;
+  } while (size);
+  return n;
+}
+
+int sock_framer_receive(sock_framer_t* framer, sock_handle_t skt) {
+  if (!framer)
+    return -1;
+
+  // move the partial frame to the front, or grow the buffer when even that is full
+  if (framer->start && (framer->end == framer->capacity || framer->start > framer->capacity/2)) {
+    memmove(framer->data, framer->data + framer->start, framer->end - framer->start);
+    framer->end -= framer->start;
+    framer->start = 0;
+  }
+  if (framer->end == framer->capacity) {
+    size_t size;
+    int n = sock_frame_parse(framer->prefix, (const unsigned char*)framer->data, framer->end, &size);
+    if (n <= 0 || size > framer->max_message)
+      return -1;
+    if ((size_t)n + size <= framer->end)
+      return -2; // full of complete messages, sock_framer_next has to make room first
+    size_t capacity = framer->capacity*2;
+    if (capacity > (size_t)n + size)
+      capacity = (size_t)n + size;
+    char* data = (char*)realloc(framer->data, capacity);
+    if (!data)
+      return -1;
+    framer->data = data;
+    framer->capacity = capacity;
+  }
+
+  sock_iovec_t iov;
+  iov.data = framer->data + framer->end;
+  iov.size = framer->capacity - framer->end;
+  int received = sock_receivev(skt, &iov, 1);
+  if (received > 0)
+    framer->end += (size_t)received;
+  return received;
+}
+
+int sock_framer_next(sock_framer_t* framer, sock_message_t* message) {
+  if (!framer || !message)
+    return -1;
+  size_t size;
+  size_t available = framer->end - framer->start;
+  int n = sock_frame_parse(framer->prefix, (const unsigned char*)framer->data + framer->start, available, &size);
+  if (n < 0 || (n > 0 && size > framer->max_message))
+    return -1;
+  if (n == 0 || available - (size_t)n < size)
+    return 0;
+
+  message->data = framer->data + framer->start + n;
+  message->size = size;
+  framer->start += (size_t)n + size;
+  if (framer->start == framer->end)
+    framer->start = framer->end = 0;
+  return 1;
+}
+
+// Frames encoded per vectored write
+#define SOCK_FRAME_BATCH (SOCK_IOV_MAX/2)
+
+// Gives a non-blocking socket that stopped taking bytes mid-frame a send buffer for the
+// rest of that frame, dropped again once it drains
+static sock_outq_t* sock_frames_queue(sock_t* sock, sock_handle_t skt, size_t needed) {
+  // only a single frame bigger than the usual buffer gets more, it can't be cut short
+  size_t capacity = needed > SOCK_COALESCE_BUFFER ? needed : SOCK_COALESCE_BUFFER;
+  if (sock_set_send_buffer(skt, capacity, capacity, 0, NULL, NULL) != 0)
+    return NULL;
+  sock->outq->temporary = 1;
+  return sock->outq;
+}
+
+int sock_send_frames(sock_handle_t skt, int prefix, const sock_message_t* messages, int count) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock || (!messages && count) || count < 0)
+    return -1;
+
+  sock_outq_t* q = sock->outq;
+  if (q && q->temporary) {
+    // still finishing a frame from an earlier call, wait for writability
+    return 0;
+  }
+  if (q) {
+    // all or nothing, so check the ring has room for every frame up front
+    size_t total = 0;
+    for (int i = 0; i < count; ++i) {
+      total += messages[i].size + SOCK_FRAME_PREFIX_MAX;
+    }
+    if (total > q->capacity - q->len)
+      return total > q->capacity ? -1 : 0;
+  }
+
+  for (int first = 0; first < count; first += SOCK_FRAME_BATCH) {
+    unsigned char prefixes[SOCK_FRAME_BATCH][SOCK_FRAME_PREFIX_MAX];
+    sock_iovec_t iov[SOCK_FRAME_BATCH*2];
+    int n = 0;
+    for (int i = first; i < count && i < first + SOCK_FRAME_BATCH; ++i) {
+      int len = sock_frame_prefix(prefix, messages[i].size, prefixes[i - first]);
+      if (len < 0)
+        return -1;
+      iov[n].data = prefixes[i - first];
+      iov[n].size = (size_t)len;
+      iov[n + 1].data = (void*)messages[i].data;
+      iov[n + 1].size = messages[i].size;
+      n += 2;
+    }
+
+    if (q && (q->corked || q->coalesce)) {
+      sock_outq_hold(sock, skt, iov, n);
+      continue;
+    }
+    if (q && (q->len || q->file_left)) {
+      // keep the byte order, everything goes behind what is already queued
+      sock_outq_queue(sock, skt, iov, n);
+      continue;
+    }
+
+    int sent = sock_sendv(skt, iov, n);
+    if (sent < 0)
+      return -1;
+    if (q) {
+      // room was checked up front, whatever the kernel didn't take queues
+      sock_iovec_t* rest = iov;
+      int left = sock_iovec_advance(&rest, n, (size_t)sent);
+      if (left)
+        sock_outq_queue(sock, skt, rest, left);
+      continue;
+    }
+    // find the frame the socket stopped in
+    size_t done = (size_t)sent;
+    int k = 0;
+    while (k < n && done >= iov[k].size + iov[k + 1].size) {
+      done -= iov[k].size + iov[k + 1].size;
+      k += 2;
+    }
+    if (k == n)
+      continue;
+    if (done) {
+      // a non-blocking socket can't wait here, the rest of this frame queues and the
+      // frames after it are left to the caller
+      sock_iovec_t* rest = iov + k;
+      int left = sock_iovec_advance(&rest, 2, done);
+      size_t needed = 0;
+      for (int i = 0; i < left; ++i) {
+        needed += rest[i].size;
+      }
+      if (!(q = sock_frames_queue(sock, skt, needed)))
+        return -1;
+      sock_outq_queue(sock, skt, rest, left);
+      k += 2;
+    }
+    return first + k/2;
+  }
+  return count;
+}
+
+// Datagrams handed to the kernel per recvmmsg/sendmmsg call
+#define SOCK_MMSG_MAX 64
+
+#ifdef SOCK_HAS_MMSG
+int sock_recv_batch(sock_handle_t skt, sock_datagram_t* datagrams, int count) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock || !datagrams || count <= 0) return -1;
+  if (count > SOCK_MMSG_MAX)
+    count = SOCK_MMSG_MAX;
+
+  struct mmsghdr msgs[SOCK_MMSG_MAX];
+  struct iovec vec[SOCK_MMSG_MAX];
+  struct sockaddr_storage addrs[SOCK_MMSG_MAX];
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control[SOCK_MMSG_MAX];
+
+  memset(msgs, 0, sizeof(struct mmsghdr)*count);
+  for (int i = 0; i < count; ++i) {
+    vec[i].iov_base = datagrams[i].data;
+    vec[i].iov_len = (size_t)datagrams[i].size;
+    msgs[i].msg_hdr.msg_iov = vec + i;
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = addrs + i;
+    msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    msgs[i].msg_hdr.msg_control = control[i].buf;
+    msgs[i].msg_hdr.msg_controllen = sizeof(control[i].buf);
+  }
+
+  int received;
+  do {
+    received = recvmmsg(sock->handle, msgs, (unsigned int)count, sock->blocking ? MSG_WAITFORONE : MSG_DONTWAIT, NULL);
+  } while (received < 0 && errno == EINTR);
+  if (received < 0)
+    return sock_would_block_error() ? 0 : -1;
+
+  for (int i = 0; i < received; ++i) {
+    sock_datagram_t* d = datagrams + i;
+    d->length = (int)msgs[i].msg_len;
+    d->segment_size = 0;
+    sock_address_from_native(&d->address, (const struct sockaddr*)(addrs + i));
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&msgs[i].msg_hdr); c; c = CMSG_NXTHDR(&msgs[i].msg_hdr, c)) {
+      if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO) {
+        int gso_size;
+        memcpy(&gso_size, CMSG_DATA(c), sizeof(gso_size));
+        d->segment_size = gso_size;
+      }
+    }
+  }
+  return received;
+}
+
+int sock_send_batch(sock_handle_t skt, const sock_datagram_t* datagrams, int count) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock || !datagrams || count <= 0) return -1;
+  if (count > SOCK_MMSG_MAX)
+    count = SOCK_MMSG_MAX;
+
+  struct mmsghdr msgs[SOCK_MMSG_MAX];
+  struct iovec vec[SOCK_MMSG_MAX];
+  struct sockaddr_storage addrs[SOCK_MMSG_MAX];
+  union {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+  } control[SOCK_MMSG_MAX];
+
+  memset(msgs, 0, sizeof(struct mmsghdr)*count);
+  for (int i = 0; i < count; ++i) {
+    const sock_datagram_t* d = datagrams + i;
+    socklen_t addrlen = sock_address_to_native(&d->address, sock->family, addrs + i);
+    if (!addrlen) {
+      // send what comes before the unreachable address
+      if (!i) return -1;
+      count = i;
+      break;
+    }
+    vec[i].iov_base = d->data;
+    vec[i].iov_len = (size_t)d->size;
+    msgs[i].msg_hdr.msg_iov = vec + i;
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = addrs + i;
+    msgs[i].msg_hdr.msg_namelen = addrlen;
+    if (d->segment_size > 0 && d->size > d->segment_size) {
+      // let the kernel (or the NIC) cut this buffer into segment_size datagrams
+      msgs[i].msg_hdr.msg_control = control[i].buf;
+      msgs[i].msg_hdr.msg_controllen = sizeof(control[i].buf);
+      struct cmsghdr* c = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+      c->cmsg_level = SOL_UDP;
+      c->cmsg_type = UDP_SEGMENT;
+      c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      uint16_t gso_size = (uint16_t)d->segment_size;
+      memcpy(CMSG_DATA(c), &gso_size, sizeof(gso_size));
+    }
+  }
+
+  int sent;
+  do {
+    sent = sendmmsg(sock->handle, msgs, (unsigned int)count, sock->blocking ? 0 : MSG_DONTWAIT);
+  } while (sent < 0 && errno == EINTR);
+  if (sent < 0)
+    return sock_would_block_error() ? 0 : -1;
+  return sent;
+}
+
+int sock_set_udp_gro(sock_handle_t skt, int enable) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock) return -1;
+  return setsockopt(sock->handle, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == 0 ? 0 : -1;
+}
+#else
+int sock_recv_batch(sock_handle_t skt, sock_datagram_t* datagrams, int count) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock || !datagrams || count <= 0) return -1;
+#ifdef _WIN32
+  typedef int socklen_t;
+#endif
+
+  int received = 0;
+  for (; received < count; ++received) {
+    sock_datagram_t* d = datagrams + received;
+    struct sockaddr_storage address;
+    socklen_t addrlen = sizeof(address);
+    // only the first datagram may block, like MSG_WAITFORONE
+    if (received) {
+      struct pollfd pfd;
+      pfd.fd = sock->handle;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      if (poll(&pfd, 1, 0) <= 0)
+        break;
+    }
+    int n = recvfrom(sock->handle, (char*)d->data, d->size, 0, (struct sockaddr*)&address, &addrlen);
+    if (n < 0) {
+      if (received || sock_would_block_error())
+        break;
+      return -1;
+    }
+    d->length = n;
+    d->segment_size = 0;
+    sock_address_from_native(&d->address, (const struct sockaddr*)&address);
+  }
+  return received;
+}
+
+int sock_send_batch(sock_handle_t skt, const sock_datagram_t* datagrams, int count) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock || !datagrams || count <= 0) return -1;
+
+  int sent = 0;
+  for (; sent < count; ++sent) {
+    const sock_datagram_t* d = datagrams + sent;
+    struct sockaddr_storage address;
+    socklen_t addrlen = sock_address_to_native(&d->address, sock->family, &address);
+    if (!addrlen)
+      return sent ? sent : -1;
+    // no segmentation offload here, cut the buffer up ourselves
+    int segment = d->segment_size > 0 ? d->segment_size : d->size;
+    int offset = 0;
+    do {
+      int len = d->size - offset < segment ? d->size - offset : segment;
+      if (sendto(sock->handle, (const char*)d->data + offset, len, 0, (const struct sockaddr*)&address, addrlen) < 0) {
+        if (sent || sock_would_block_error())
+          return sent;
+        return -1;
+      }
+      offset += len;
+    } while (offset < d->size);
+  }
+  return sent;
+}
+
+int sock_set_udp_gro(sock_handle_t skt, int enable) {
+  (void)skt;
+  (void)enable;
+  return -1;
+}
+#endif
+
+static uint32_t sock_resolve_hash(const char* host, int flags) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (; *host; ++host) {
+    hash ^= (unsigned char)*host;
+    hash *= 16777619u;
+  }
+  return hash ^ (uint32_t)flags;
+}
+
+// Parses a literal IPv4/IPv6 address, returns 1 on success
+static int sock_parse_numeric(const char* host, sock_address_t* address) {
+  memset(address, 0, sizeof(*address));
+  if (inet_pton(AF_INET, host, &address->host) == 1) {
+    address->family = SOCK_FAMILY_IPV4;
+    return 1;
+  }
+  if (inet_pton(AF_INET6, host, address->host6) == 1) {
+    address->family = SOCK_FAMILY_IPV6;
+    return 1;
+  }
+  return 0;
+}
+
+// Runs getaddrinfo, returns the number of distinct addresses or -1
+static int sock_resolve_uncached(const char* host, int flags, sock_address_t* addresses, int max) {
+  struct addrinfo hints;
+  struct addrinfo* result = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = flags == SOCK_RESOLVE_IPV4 ? AF_INET : flags == SOCK_RESOLVE_IPV6 ? AF_INET6 : AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM; // one entry per address rather than per socket type
+  hints.ai_flags = AI_ADDRCONFIG;
+  if (getaddrinfo(host, NULL, &hints, &result) != 0 || !result)
+    return -1;
+
+  int count = 0;
+  for (struct addrinfo* ai = result; ai && count < max; ai = ai->ai_next) {
+    if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+      continue;
+    sock_address_t address;
+    sock_address_from_native(&address, ai->ai_addr);
+    int duplicate = 0;
+    for (int i = 0; i < count && !duplicate; ++i) {
+      duplicate = memcmp(addresses + i, &address, sizeof(address)) == 0;
+    }
+    if (!duplicate)
+      addresses[count++] = address;
+  }
+  freeaddrinfo(result);
+  return count ? count : -1;
+}
+
+// Looks 'host' up in the cache, filling 'found'
+//
+// Returns the cached address count, -1 for a cached failure, -2 on a miss
+static int sock_resolve_cached(const char* host, int flags, sock_address_t* found) {
+  if (!resolveCache || resolveTtl <= 0 || strlen(host) >= SOCK_RESOLVE_HOST_MAX)
+    return -2;
+  sock_resolve_entry_t* entry = resolveCache + sock_resolve_hash(host, flags) % SOCK_RESOLVE_CACHE_SIZE;
+  int count = -2;
+  thread_mutex_lock(&resolveLock);
+  if (entry->expires > sock_now_ms() && entry->flags == flags && strcmp(entry->host, host) == 0) {
+    count = entry->count ? entry->count : -1;
+    memcpy(found, entry->addresses, sizeof(sock_address_t)*entry->count);
+  }
+  thread_mutex_unlock(&resolveLock);
+  return count;
+}
+
+static void sock_resolve_store(const char* host, int flags, const sock_address_t* found, int count) {
+  int ttl = count > 0 ? resolveTtl : resolveNegativeTtl;
+  if (!resolveCache || resolveTtl <= 0 || ttl <= 0 || strlen(host) >= SOCK_RESOLVE_HOST_MAX)
+    return;
+  if (count < 0)
+    count = 0;
+  sock_resolve_entry_t* entry = resolveCache + sock_resolve_hash(host, flags) % SOCK_RESOLVE_CACHE_SIZE;
+  thread_mutex_lock(&resolveLock);
+  strcpy(entry->host, host);
+  entry->flags = flags;
+  entry->count = count;
+  memcpy(entry->addresses, found, sizeof(sock_address_t)*count);
+  entry->expires = sock_now_ms() + (uint64_t)ttl;
+  thread_mutex_unlock(&resolveLock);
+}
+
+// Copies 'count' results out with 'port' applied, returns the number copied or -1
+static int sock_resolve_copy(const sock_address_t* found, int count, unsigned short port, sock_address_t* addresses, int max) {
+  if (count <= 0)
+    return -1;
+  if (count > max)
+    count = max;
+  for (int i = 0; i < count; ++i) {
+    addresses[i] = found[i];
+    addresses[i].port = port;
+  }
+  return count;
+}
+
+// Answers numeric hosts and cache hits without blocking
+//
+// Returns the number of addresses, -1 for a known failure, -2 if a lookup is needed
+static int sock_resolve_fast(const char* host, unsigned short port, int flags, sock_address_t* addresses, int max) {
+  // literals never touch DNS or the cache
+  sock_address_t numeric;
+  if (sock_parse_numeric(host, &numeric)) {
+    if ((flags == SOCK_RESOLVE_IPV4 && numeric.family != SOCK_FAMILY_IPV4) ||
+        (flags == SOCK_RESOLVE_IPV6 && numeric.family != SOCK_FAMILY_IPV6))
+      return -1;
+    return sock_resolve_copy(&numeric, 1, port, addresses, max);
+  }
+
+  sock_address_t found[SOCK_RESOLVE_MAX_ADDRESSES];
+  int count = sock_resolve_cached(host, flags, found);
+  if (count == -2)
+    return -2;
+  return sock_resolve_copy(found, count, port, addresses, max);
+}
+
+int sock_resolve(const char* host, unsigned short port, int flags, sock_address_t* addresses, int max) {
+  if (!host || !addresses || max <= 0)
+    return -1;
+
+  int count = sock_resolve_fast(host, port, flags, addresses, max);
+  if (count != -2)
+    return count;
+
+  sock_address_t found[SOCK_RESOLVE_MAX_ADDRESSES];
+  count = sock_resolve_uncached(host, flags, found, SOCK_RESOLVE_MAX_ADDRESSES);
+  sock_resolve_store(host, flags, found, count);
+  return sock_resolve_copy(found, count, port, addresses, max);
+}
+
+void sock_set_resolve_ttl(int ttl_ms) {
+  resolveTtl = ttl_ms;
+  if (ttl_ms <= 0)
+    sock_clear_resolve_cache();
+}
+
+void sock_set_resolve_negative_ttl(int ttl_ms) {
+  resolveNegativeTtl = ttl_ms;
+}
+
+void sock_clear_resolve_cache() {
+  if (!resolveCache)
+    return;
+  thread_mutex_lock(&resolveLock);
+  memset(resolveCache, 0, sizeof(sock_resolve_entry_t)*SOCK_RESOLVE_CACHE_SIZE);
+  thread_mutex_unlock(&resolveLock);
+}
+
+int sock_get_address(sock_address_t *address, const char *host, unsigned short port) {
+  if (host == NULL) {
+    memset(address, 0, sizeof(*address));
+    address->host = INADDR_ANY;
+    address->port = port;
+    return 0;
+  }
+
+  return sock_resolve(host, port, SOCK_RESOLVE_ANY, address, 1) > 0 ? 0 : -1;
+}
+
+const char* sock_address_to_str(const sock_address_t* address, char* buf, int buf_len) {
+  char host[INET6_ADDRSTRLEN];
+  int len;
+  if (!address || !buf || buf_len <= 0)
+    return NULL;
+
+  switch (address->family) {
+  case SOCK_FAMILY_IPV4:
+    if (!inet_ntop(AF_INET, (void*)&address->host, host, sizeof(host)))
+      return NULL;
+    len = snprintf(buf, buf_len, "%s:%u", host, address->port);
+    break;
+  case SOCK_FAMILY_IPV6:
+    if (!inet_ntop(AF_INET6, (void*)address->host6, host, sizeof(host)))
+      return NULL;
+    len = snprintf(buf, buf_len, "[%s]:%u", host, address->port);
+    break;
+  case SOCK_FAMILY_UNIX:
+    len = snprintf(buf, buf_len, "%s", address->path);
+    break;
+  default:
+    return NULL;
+  }
+  return len >= 0 && len < buf_len ? buf : NULL;
+}
+
+typedef struct sock_resolve_request_t {
+  char* host;
+  unsigned short port;
+  int flags;
+  int count;
+  sock_resolve_fn callback;
+  void* user_data;
+  sock_address_t addresses[SOCK_RESOLVE_MAX_ADDRESSES];
+} sock_resolve_request_t;
+
+typedef struct sock_resolver_worker_t {
+  struct sock_resolver_t* resolver;
+  thread_ptr_t thread;
+  thread_queue_t requests; // owner thread -> worker
+  thread_queue_t results; // worker -> owner thread
+  void** request_slots;
+  void** result_slots;
+  int outstanding; // submitted but not yet dispatched, owner thread only
+} sock_resolver_worker_t;
+
+struct sock_resolver_t {
+  sock_resolver_worker_t* workers;
+  int worker_count;
+  int queue_size;
+  int next_worker;
+  sock_handle_t wake;
+  thread_atomic_int_t wake_pending;
+};
+
+// Queued to a worker to make it exit
+static sock_resolve_request_t sock_resolver_stop;
+
+// Opens a loopback UDP socket connected to itself, so only the resolver can wake it
+static int sock_open_wake(sock_handle_t* skt) {
+  *skt = alloc_socket();
+  sock_t* sock = sock_lookup(*skt);
+  if (!sock)
+    return -1;
+
+  struct sockaddr_in address;
+  socklen_t addrlen = sizeof(address);
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sock->handle = sock_native_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  sock->family = AF_INET;
+  if (sock->handle == INVALID_SOCKET ||
+      bind(sock->handle, (const struct sockaddr*)&address, sizeof(address)) != 0 ||
+      getsockname(sock->handle, (struct sockaddr*)&address, &addrlen) != 0 ||
+      connect(sock->handle, (const struct sockaddr*)&address, addrlen) != 0) {
+    sock_close(*skt);
+    return -1;
+  }
+
+#ifdef _WIN32
+  u_long nblock = 1;
+  ioctlsocket(sock->handle, FIONBIO, &nblock);
+#else
+  fcntl(sock->handle, F_SETFL, O_NONBLOCK);
+#endif
+  sock->blocking = 0;
+  return 0;
+}
+
+static int sock_resolver_thread(void* user_data) {
+  sock_resolver_worker_t* worker = (sock_resolver_worker_t*)user_data;
+  sock_resolver_t* resolver = worker->resolver;
+  sock_t* wake = sock_lookup(resolver->wake);
+
+  for (;;) {
+    sock_resolve_request_t* request = (sock_resolve_request_t*)thread_queue_consume(&worker->requests, THREAD_QUEUE_WAIT_INFINITE);
+    if (request == &sock_resolver_stop)
+      break;
+
+    request->count = sock_resolve(request->host, request->port, request->flags, request->addresses, SOCK_RESOLVE_MAX_ADDRESSES);
+    // never blocks, the owner keeps at most queue_size requests outstanding per worker
+    thread_queue_produce(&worker->results, request, THREAD_QUEUE_WAIT_INFINITE);
+
+    // one wake datagram per dispatch round is enough
+    if (thread_atomic_int_swap(&resolver->wake_pending, 1) == 0)
+      send(wake->handle, "", 1, 0);
+  }
+  return 0;
+}
+
+int sock_resolver_create(sock_resolver_t** resolver, int workers, int queue_size) {
+  if (!resolver || workers <= 0 || queue_size <= 0)
+    return -1;
+
+  sock_resolver_t* r = (sock_resolver_t*)calloc(1, sizeof(sock_resolver_t));
+  if (!r)
+    return -1;
+  r->workers = (sock_resolver_worker_t*)calloc(workers, sizeof(sock_resolver_worker_t));
+  r->queue_size = queue_size;
+  if (!r->workers || sock_open_wake(&r->wake) != 0) {
+    free(r->workers);
+    free(r);
+    return -1;
+  }
+  thread_atomic_int_store(&r->wake_pending, 0);
+
+  for (int i = 0; i < workers; ++i) {
+    sock_resolver_worker_t* worker = r->workers + i;
+    worker->resolver = r;
+    worker->request_slots = (void**)calloc(queue_size + 1, sizeof(void*)); // +1 for the stop request
+    worker->result_slots = (void**)calloc(queue_size, sizeof(void*));
+    if (worker->request_slots && worker->result_slots) {
+      thread_queue_init(&worker->requests, queue_size + 1, worker->request_slots, 0);
+      thread_queue_init(&worker->results, queue_size, worker->result_slots, 0);
+      worker->thread = smd_thread_create(sock_resolver_thread, worker, "sock_resolver", THREAD_STACK_SIZE_DEFAULT);
+    }
+    if (!worker->thread) {
+      if (worker->request_slots && worker->result_slots) {
+        thread_queue_term(&worker->requests);
+        thread_queue_term(&worker->results);
+      }
+      free(worker->request_slots);
+      free(worker->result_slots);
+      break;
+    }
+    r->worker_count = i + 1;
+  }
+
+  if (!r->worker_count) {
+    sock_resolver_destroy(r);
+    return -1;
+  }
+  *resolver = r;
+  return 0;
+}
+
+void sock_resolver_destroy(sock_resolver_t* resolver) {
+  if (!resolver)
+    return;
+
+  for (int i = 0; i < resolver->worker_count; ++i) {
+    thread_queue_produce(&resolver->workers[i].requests, &sock_resolver_stop, THREAD_QUEUE_WAIT_INFINITE);
+  }
+  for (int i = 0; i < resolver->worker_count; ++i) {
+    sock_resolver_worker_t* worker = resolver->workers + i;
+    thread_join(worker->thread);
+    thread_destroy(worker->thread);
+    // the worker is gone, so whatever it left in 'results' is ours
+    while (thread_queue_count(&worker->results) > 0) {
+      sock_resolve_request_t* request = (sock_resolve_request_t*)thread_queue_consume(&worker->results, 0);
+      free(request->host);
+      free(request);
+    }
+    thread_queue_term(&worker->requests);
+    thread_queue_term(&worker->results);
+    free(worker->request_slots);
+    free(worker->result_slots);
+  }
+  sock_close(resolver->wake);
+  free(resolver->workers);
+  free(resolver);
+}
+
+int sock_resolve_async(sock_resolver_t* resolver, const char* host, unsigned short port, int flags,
+  sock_resolve_fn callback, void* user_data) {
+  if (!resolver || !host || !callback)
+    return -1;
+
+  sock_address_t addresses[SOCK_RESOLVE_MAX_ADDRESSES];
+  int count = sock_resolve_fast(host, port, flags, addresses, SOCK_RESOLVE_MAX_ADDRESSES);
+  if (count != -2) {
+    callback(user_data, count, count > 0 ? addresses : NULL);
+    return 1;
+  }
+
+  // round robin, skipping workers that are busy with a full queue
+  for (int tries = 0; tries < resolver->worker_count; ++tries) {
+    sock_resolver_worker_t* worker = resolver->workers + resolver->next_worker;
+    resolver->next_worker = (resolver->next_worker + 1) % resolver->worker_count;
+    if (worker->outstanding >= resolver->queue_size)
+      continue;
+
+    sock_resolve_request_t* request = (sock_resolve_request_t*)malloc(sizeof(sock_resolve_request_t));
+    size_t host_len = strlen(host) + 1;
+    char* host_copy = (char*)malloc(host_len);
+    if (!request || !host_copy) {
+      free(request);
+      free(host_copy);
+      return -1;
+    }
+    memcpy(host_copy, host, host_len);
+    request->host = host_copy;
+    request->port = port;
+    request->flags = flags;
+    request->count = -1;
+    request->callback = callback;
+    request->user_data = user_data;
+    ++worker->outstanding;
+    thread_queue_produce(&worker->requests, request, THREAD_QUEUE_WAIT_INFINITE);
+    return 0;
+  }
+  return -1;
+}
+
+int sock_resolver_dispatch(sock_resolver_t* resolver) {
+  if (!resolver)
+    return 0;
+
+  // clear the wake before draining so a result landing after the drain wakes us again.
+  // Drain even when nothing was pending, a worker may have sent after the last swap.
+  sock_t* wake = sock_lookup(resolver->wake);
+  char drain[16];
+  thread_atomic_int_swap(&resolver->wake_pending, 0);
+  while (recv(wake->handle, drain, sizeof(drain), 0) > 0) {
+  }
+
+  int dispatched = 0;
+  for (int i = 0; i < resolver->worker_count; ++i) {
+    sock_resolver_worker_t* worker = resolver->workers + i;
+    while (thread_queue_count(&worker->results) > 0) {
+      sock_resolve_request_t* request = (sock_resolve_request_t*)thread_queue_consume(&worker->results, 0);
+      --worker->outstanding;
+      request->callback(request->user_data, request->count, request->count > 0 ? request->addresses : NULL);
+      free(request->host);
+      free(request);
+      ++dispatched;
+    }
+  }
+  return dispatched;
+}
+
+sock_handle_t sock_resolver_handle(sock_resolver_t* resolver) {
+  return resolver ? resolver->wake : 0;
+}
+
+const char *sock_host_to_str(unsigned int host) {
+  // inet_ntoa shares one buffer between threads on some platforms
+  static SOCK_THREAD_LOCAL char buf[INET_ADDRSTRLEN];
+  struct in_addr in;
+  in.s_addr = host;
+
+  return inet_ntop(AF_INET, &in, buf, sizeof(buf));
+}
+
+int sock_get_host_name(char* name, int name_len) {
+  return gethostname(name, name_len) == 0 ? 0 : -1;
+}
+
+int sock_poller_create(sock_poller_t** poller, int max_events) {
+  if (!poller || max_events <= 0)
+    return -1;
+
+  sock_poller_t* p = calloc(1, sizeof(sock_poller_t));
+  if (!p)
+    return -1;
+  p->max_events = max_events;
+#ifdef __linux__
+  p->epfd = epoll_create1(EPOLL_CLOEXEC);
+  p->events = malloc(sizeof(struct epoll_event)*max_events);
+  if (p->epfd < 0 || !p->events) {
+    if (p->epfd >= 0) close(p->epfd);
+    free(p->events);
+    free(p);
+    return -1;
+  }
+#endif
+  *poller = p;
+  return 0;
+}
+
+void sock_poller_destroy(sock_poller_t* poller) {
+  if (!poller)
+    return;
+
+  for (uint32_t i = 1; i < totalSockets; ++i) {
+    if (sockets[i].poller == poller) {
+      sockets[i].poller = NULL;
+      sockets[i].poll_events = 0;
+    }
+  }
+#ifdef __linux__
+  close(poller->epfd);
+  free(poller->events);
+#else
+  free(poller->fds);
+  free(poller->handles);
+#endif
+  free(poller->dirty);
+  free(poller);
+}
+
+#ifdef __linux__
+static uint32_t sock_poll_to_epoll(unsigned int events) {
+  uint32_t ev = 0;
+  if (events & SOCK_POLL_READ) ev |= EPOLLIN | EPOLLRDHUP;
+  if (events & SOCK_POLL_WRITE) ev |= EPOLLOUT;
+  if (events & SOCK_POLL_EDGE) ev |= EPOLLET;
+  return ev;
+}
+#else
+static short sock_poll_to_pollfd(unsigned int events) {
+  short ev = 0;
+  if (events & SOCK_POLL_READ) ev |= POLLIN;
+  if (events & SOCK_POLL_WRITE) ev |= POLLOUT;
+  return ev;
+}
+#endif
+
+// What the backend should watch: the user's interest, plus writability while output is queued
+static unsigned int sock_poll_wanted(sock_t* sock) {
+  unsigned int events = sock->poll_events;
+  sock_outq_t* q = sock->outq;
+  if (q && (((q->corked ? q->released : q->len) && !q->held) || q->file_left))
+    events |= SOCK_POLL_WRITE;
+  return events;
+}
+
+// Brings the backend registration in line with sock_poll_wanted
+static int sock_poller_sync(sock_t* sock, sock_handle_t skt) {
+  sock_poller_t* poller = sock->poller;
+  if (!poller)
+    return 0;
+  unsigned int events = sock_poll_wanted(sock);
+  if (events == sock->poll_active)
+    return 0;
+
+#ifdef __linux__
+  struct epoll_event ev;
+  ev.events = sock_poll_to_epoll(events);
+  ev.data.u64 = skt;
+  if (epoll_ctl(poller->epfd, EPOLL_CTL_MOD, sock->handle, &ev) != 0)
+    return -1;
+#else
+  (void)skt;
+  poller->fds[sock->poll_index].events = sock_poll_to_pollfd(events);
+#endif
+  sock->poll_active = events;
+  return 0;
+}
+
+int sock_poller_add(sock_poller_t* poller, sock_handle_t skt, unsigned int events, void* user_data) {
+  sock_t* sock = sock_lookup(skt);
+  if (!poller || !sock)
+    return -1;
+  if (sock->poller)
+    return -1;
+
+  sock->poll_events = events;
+  events = sock_poll_wanted(sock);
+#ifdef __linux__
+  struct epoll_event ev;
+  ev.events = sock_poll_to_epoll(events);
+  ev.data.u64 = skt;
+  if (epoll_ctl(poller->epfd, EPOLL_CTL_ADD, sock->handle, &ev) != 0)
+    return -1;
+#else
+  if (poller->count == poller->capacity) {
+    int capacity = poller->capacity ? poller->capacity*2 : 64;
+    struct pollfd* fds = realloc(poller->fds, sizeof(struct pollfd)*capacity);
+    if (!fds)
+      return -1;
+    poller->fds = fds;
+    sock_handle_t* handles = realloc(poller->handles, sizeof(sock_handle_t)*capacity);
+    if (!handles)
+      return -1;
+    poller->handles = handles;
+    poller->capacity = capacity;
+  }
+  sock->poll_index = poller->count++;
+  poller->fds[sock->poll_index].fd = sock->handle;
+  poller->fds[sock->poll_index].events = sock_poll_to_pollfd(events);
+  poller->fds[sock->poll_index].revents = 0;
+  poller->handles[sock->poll_index] = skt;
+#endif
+  sock->poller = poller;
+  sock->poll_active = events;
+  sock->user_data = user_data;
+  return 0;
+}
+
+int sock_poller_modify(sock_poller_t* poller, sock_handle_t skt, unsigned int events, void* user_data) {
+  sock_t* sock = sock_lookup(skt);
+  if (!poller || !sock)
+    return -1;
+  if (sock->poller != poller)
+    return -1;
+
+  unsigned int previous = sock->poll_events;
+  sock->poll_events = events;
+  if (sock_poller_sync(sock, skt) != 0) {
+    sock->poll_events = previous;
+    return -1;
+  }
+  sock->user_data = user_data;
+  return 0;
+}
+
+int sock_poller_remove(sock_poller_t* poller, sock_handle_t skt) {
+  sock_t* sock = sock_lookup(skt);
+  if (!poller || !sock)
+    return -1;
+  if (sock->poller != poller)
+    return -1;
+
+#ifdef __linux__
+  struct epoll_event ev; // non-NULL for pre 2.6.9 kernels
+  epoll_ctl(poller->epfd, EPOLL_CTL_DEL, sock->handle, &ev);
+#else
+  // swap the last registration into the freed slot
+  int last = --poller->count;
+  if (sock->poll_index != last) {
+    poller->fds[sock->poll_index] = poller->fds[last];
+    poller->handles[sock->poll_index] = poller->handles[last];
+    sockets[poller->handles[last] & SOCK_INDEX_MASK].poll_index = sock->poll_index;
+  }
+#endif
+  sock->poller = NULL;
+  sock->poll_events = 0;
+  sock->poll_active = 0;
+  sock->user_data = NULL;
+  return 0;
+}
+
+// Drains queued output on writability, short of what a cork holds back. WRITE is only
+// reported if the user asked for it.
+static unsigned int sock_poller_flush(sock_t* sock, sock_handle_t skt, unsigned int out) {
+  if (sock->outq && (sock->outq->len || sock->outq->file_left)) {
+    if (sock_outq_flush(skt, 0) < 0)
+      out |= SOCK_POLL_ERROR;
+  }
+  if (!(sock->poll_events & SOCK_POLL_WRITE))
+    out &= ~SOCK_POLL_WRITE;
+  return out;
+}
+
+// Sends the writes sockets coalesced since the last wait, the end of an event loop tick
+static void sock_poller_flush_dirty(sock_poller_t* poller) {
+  for (int i = 0; i < poller->dirty_count; ++i) {
+    sock_handle_t skt = poller->dirty[i];
+    sock_t* sock = sock_lookup(skt);
+    if (!sock || !sock->outq)
+      continue; // closed since
+    sock->outq->dirty = 0;
+    // a failure shows up as an error event on the socket
+    if (!sock->outq->corked && sock->outq->held)
+      sock_flush(skt);
+  }
+  poller->dirty_count = 0;
+}
+
+int sock_poller_wait(sock_poller_t* poller, sock_event_t* events, int max_events, int timeout_ms) {
+  if (!poller || !events)
+    return -1;
+  if (max_events > poller->max_events)
+    max_events = poller->max_events;
+  sock_poller_flush_dirty(poller);
+
+  int count = 0;
+#ifdef __linux__
+  int n = epoll_wait(poller->epfd, poller->events, max_events, timeout_ms);
+  if (n < 0)
+    return errno == EINTR ? 0 : -1;
+
+  for (int i = 0; i < n; ++i) {
+    sock_handle_t skt = (sock_handle_t)poller->events[i].data.u64;
+    uint32_t ev = poller->events[i].events;
+    sock_t* sock = sock_lookup(skt);
+    if (!sock)
+      continue; // closed by an earlier event handler
+    unsigned int out = 0;
+    if (ev & EPOLLIN) out |= SOCK_POLL_READ;
+    if (ev & EPOLLOUT) out |= SOCK_POLL_WRITE;
+    if (ev & EPOLLERR) out |= SOCK_POLL_ERROR;
+    if (ev & (EPOLLHUP | EPOLLRDHUP)) out |= SOCK_POLL_HUP;
+    if ((out & SOCK_POLL_ERROR) && sock->stats && sock->stats->timestamps) {
+      // queued timestamps raise EPOLLERR too, only report a real socket error
+      sock_stats_drain(sock);
+      struct pollfd pfd;
+      pfd.fd = sock->handle;
+      pfd.events = 0;
+      pfd.revents = 0;
+      if (poll(&pfd, 1, 0) == 0)
+        out &= ~SOCK_POLL_ERROR;
+      if (!out)
+        continue;
+    }
+    if (out & SOCK_POLL_WRITE) {
+      sock->ready = 1;
+      out = sock_poller_flush(sock, skt, out);
+      if (!out)
+        continue;
+    }
+    events[count].socket = skt;
+    events[count].events = out;
+    events[count].user_data = sock->user_data;
+    ++count;
+  }
+#else
+  int n = poll(poller->fds, poller->count, timeout_ms);
+  if (n < 0)
+    return errno == EINTR ? 0 : -1;
+
+  for (int i = 0; i < poller->count && count < max_events && n > 0; ++i) {
+    short ev = poller->fds[i].revents;
+    if (!ev)
+      continue;
+    --n;
+    sock_handle_t skt = poller->handles[i];
+    sock_t* sock = sockets + (skt & SOCK_INDEX_MASK);
+    unsigned int out = 0;
+    if (ev & POLLIN) out |= SOCK_POLL_READ;
+    if (ev & POLLOUT) out |= SOCK_POLL_WRITE;
+    if (ev & POLLERR) out |= SOCK_POLL_ERROR;
+    if (ev & POLLHUP) out |= SOCK_POLL_HUP;
+    if (out & SOCK_POLL_WRITE) {
+      sock->ready = 1;
+      out = sock_poller_flush(sock, skt, out);
+      if (!out)
+        continue;
+    }
+    events[count].socket = skt;
+    events[count].events = out;
+    events[count].user_data = sock->user_data;
+    ++count;
+  }
+#endif
+  return count;
+}
+
+#ifdef SOCK_HAS_IO_URING
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+#endif
+
+typedef struct sock_ring_op_t {
+  int op;
+  int next; // free list / fallback queue link
+  int result;
+  int error;
+  void* user_data;
+  sock_handle_t socket;
+  void* data;
+  int size;
+  int flags;
+  int fd;
+  uint64_t offset;
+  const char* path;
+  sock_address_t* remote_addr;
+  sock_file_stat_t* stat;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+#ifdef SOCK_HAS_IO_URING
+  struct statx stx;
+#endif
+} sock_ring_op_t;
+
+struct sock_ring_t {
+  sock_ring_op_t* ops;
+  int op_count;
+  int free_op;
+  // operations waiting for the blocking path, run in order by sock_ring_submit
+  int pending_head;
+  int pending_tail;
+  // finished fallback operations, drained by sock_ring_reap
+  int done_head;
+  int done_tail;
+#ifdef SOCK_HAS_IO_URING
+  int fd; // -1 when not native
+  unsigned int sq_entries;
+  unsigned int to_submit;
+  unsigned char supported[IORING_OP_LAST];
+  void* sq_ptr;
+  size_t sq_size;
+  void* cq_ptr;
+  size_t cq_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned int* sq_head;
+  unsigned int* sq_tail;
+  unsigned int* sq_mask;
+  unsigned int* sq_array;
+  unsigned int* cq_head;
+  unsigned int* cq_tail;
+  unsigned int* cq_mask;
+  struct io_uring_cqe* cqes;
+#endif
+};
+
+#ifdef SOCK_HAS_IO_URING
+static int sock_ring_enter(sock_ring_t* ring, unsigned int to_submit, unsigned int min_complete) {
+  unsigned int flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+  int ret;
+  do {
+    ret = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+static void sock_ring_unmap(sock_ring_t* ring) {
+  if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+  if (ring->sq_ptr) munmap(ring->sq_ptr, ring->sq_size);
+  if (ring->fd >= 0) close(ring->fd);
+  ring->fd = -1;
+}
+
+static int sock_ring_setup(sock_ring_t* ring, unsigned int entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0)
+    return -1;
+
+  ring->sq_entries = params.sq_entries;
+  ring->sq_size = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+  ring->cq_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_size > ring->sq_size)
+      ring->sq_size = ring->cq_size;
+    ring->cq_size = ring->sq_size;
+  }
+  ring->sq_ptr = mmap(0, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) {
+    ring->sq_ptr = NULL;
+    sock_ring_unmap(ring);
+    return -1;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ptr = ring->sq_ptr;
+  } else {
+    ring->cq_ptr = mmap(0, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) {
+      ring->cq_ptr = NULL;
+      sock_ring_unmap(ring);
+      return -1;
+    }
+  }
+  ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    sock_ring_unmap(ring);
+    return -1;
+  }
+
+  char* sq = (char*)ring->sq_ptr;
+  char* cq = (char*)ring->cq_ptr;
+  ring->sq_head = (unsigned int*)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned int*)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned int*)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  // Ask which opcodes this kernel knows; anything it doesn't runs on the blocking path
+  size_t probe_size = sizeof(struct io_uring_probe) + IORING_OP_LAST*sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = calloc(1, probe_size);
+  if (probe && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0) {
+    for (int i = 0; i < probe->ops_len && i < IORING_OP_LAST; ++i) {
+      ring->supported[i] = (probe->ops[i].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+  }
+  free(probe);
+  return 0;
+}
+
+static int sock_ring_native_op(sock_ring_t* ring, int op) {
+  if (ring->fd < 0)
+    return 0;
+  switch (op) {
+  case SOCK_RING_SEND: return ring->supported[IORING_OP_SEND];
+  case SOCK_RING_RECV: return ring->supported[IORING_OP_RECV];
+  case SOCK_RING_ACCEPT: return ring->supported[IORING_OP_ACCEPT];
+  case SOCK_RING_CONNECT: return ring->supported[IORING_OP_CONNECT];
+  case SOCK_RING_OPEN: return ring->supported[IORING_OP_OPENAT];
+  case SOCK_RING_READ: return ring->supported[IORING_OP_READ];
+  case SOCK_RING_STAT: return ring->supported[IORING_OP_STATX];
+  }
+  return 0;
+}
+
+static struct io_uring_sqe* sock_ring_get_sqe(sock_ring_t* ring) {
+  unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned int tail = *ring->sq_tail;
+  if (tail - head >= ring->sq_entries) {
+    // Submission queue is full, hand what we have to the kernel first
+    if (sock_ring_enter(ring, ring->to_submit, 0) < 0)
+      return NULL;
+    ring->to_submit = 0;
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= ring->sq_entries)
+      return NULL;
+  }
+  unsigned int index = tail & *ring->sq_mask;
+  struct io_uring_sqe* sqe = ring->sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  return sqe;
+}
+
+static void sock_ring_commit_sqe(sock_ring_t* ring) {
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+  ++ring->to_submit;
+}
+#endif
+
+int sock_ring_create(sock_ring_t** ring, unsigned int entries) {
+  if (!ring || !entries)
+    return -1;
+
+  sock_ring_t* r = calloc(1, sizeof(sock_ring_t));
+  if (!r)
+    return -1;
+  // the completion queue is twice the submission queue, never allow more in flight than that
+  r->op_count = (int)entries*2;
+  r->ops = calloc(r->op_count, sizeof(sock_ring_op_t));
+  if (!r->ops) {
+    free(r);
+    return -1;
+  }
+  for (int i = 0; i < r->op_count; ++i) {
+    r->ops[i].next = i + 1 < r->op_count ? i + 1 : -1;
+  }
+  r->free_op = 0;
+  r->pending_head = r->pending_tail = -1;
+  r->done_head = r->done_tail = -1;
+#ifdef SOCK_HAS_IO_URING
+  if (sock_ring_setup(r, entries) != 0)
+    r->fd = -1;
+#endif
+  *ring = r;
+  return 0;
+}
+
+void sock_ring_destroy(sock_ring_t* ring) {
+  if (!ring)
+    return;
+#ifdef SOCK_HAS_IO_URING
+  sock_ring_unmap(ring);
+#endif
+  free(ring->ops);
+  free(ring);
+}
 
+int sock_ring_is_native(sock_ring_t* ring) {
+#ifdef SOCK_HAS_IO_URING
+  return ring && ring->fd >= 0;
+#else
+  (void)ring;
   return 0;
+#endif
 }
 
-int sock_listen(sock_handle_t* skt, unsigned int port, int non_blocking, int listening) {
-  *skt = alloc_socket();
-  sock_t* sock = sockets+(*skt);
+static sock_ring_op_t* sock_ring_alloc_op(sock_ring_t* ring, int op, void* user_data) {
+  if (ring->free_op < 0)
+    return NULL;
+  sock_ring_op_t* o = ring->ops + ring->free_op;
+  ring->free_op = o->next;
+  memset(o, 0, sizeof(*o));
+  o->op = op;
+  o->next = -1;
+  o->user_data = user_data;
+  return o;
+}
 
-  // Create the socket
-  sock->handle = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (sock->handle <= 0) {
-    sock_close(*skt);
-    //return zed_net__error("Failed to create socket");
-    return -1;
+static void sock_ring_free_op(sock_ring_t* ring, sock_ring_op_t* o) {
+  o->next = ring->free_op;
+  ring->free_op = (int)(o - ring->ops);
+}
+
+static void sock_ring_list_push(sock_ring_t* ring, int* head, int* tail, sock_ring_op_t* o) {
+  int index = (int)(o - ring->ops);
+  o->next = -1;
+  if (*tail >= 0)
+    ring->ops[*tail].next = index;
+  else
+    *head = index;
+  *tail = index;
+}
+
+// Issues a prepared operation, either as an SQE or onto the blocking queue
+static int sock_ring_queue(sock_ring_t* ring, sock_ring_op_t* o) {
+#ifdef SOCK_HAS_IO_URING
+  if (sock_ring_native_op(ring, o->op)) {
+    struct io_uring_sqe* sqe = sock_ring_get_sqe(ring);
+    if (!sqe) {
+      sock_ring_free_op(ring, o);
+      return -1;
+    }
+    sqe->user_data = (uint64_t)(o - ring->ops);
+    switch (o->op) {
+    case SOCK_RING_SEND:
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = o->fd;
+      sqe->addr = (uint64_t)(uintptr_t)o->data;
+      sqe->len = o->size;
+      break;
+    case SOCK_RING_RECV:
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = o->fd;
+      sqe->addr = (uint64_t)(uintptr_t)o->data;
+      sqe->len = o->size;
+      break;
+    case SOCK_RING_ACCEPT:
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->fd = o->fd;
+      o->addrlen = sizeof(o->addr);
+      sqe->addr = (uint64_t)(uintptr_t)&o->addr;
+      sqe->addr2 = (uint64_t)(uintptr_t)&o->addrlen;
+      sqe->accept_flags = SOCK_CLOEXEC | (o->flags ? 0 : SOCK_NONBLOCK);
+      break;
+    case SOCK_RING_CONNECT:
+      sqe->opcode = IORING_OP_CONNECT;
+      sqe->fd = o->fd;
+      sqe->addr = (uint64_t)(uintptr_t)&o->addr;
+      sqe->off = o->addrlen;
+      break;
+    case SOCK_RING_OPEN:
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uint64_t)(uintptr_t)o->path;
+      sqe->open_flags = o->flags | O_CLOEXEC;
+      sqe->len = 0644;
+      break;
+    case SOCK_RING_READ:
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = o->fd;
+      sqe->addr = (uint64_t)(uintptr_t)o->data;
+      sqe->len = o->size;
+      sqe->off = o->offset;
+      break;
+    case SOCK_RING_STAT:
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uint64_t)(uintptr_t)o->path;
+      sqe->len = STATX_BASIC_STATS;
+      sqe->off = (uint64_t)(uintptr_t)&o->stx;
+      break;
+    }
+    sock_ring_commit_sqe(ring);
+    return 0;
   }
+#endif
+  sock_ring_list_push(ring, &ring->pending_head, &ring->pending_tail, o);
+  return 0;
+}
 
-  // Bind the socket to the port
-  struct sockaddr_in address;
-  address.sin_family = AF_INET;
-  address.sin_addr.s_addr = INADDR_ANY;
-  address.sin_port = htons(port);
+int sock_ring_send(sock_ring_t* ring, sock_handle_t skt, const void* data, int size, void* user_data) {
+  sock_t* sock = sock_lookup(skt);
+  if (!ring || !sock)
+    return -1;
+  sock_ring_op_t* o = sock_ring_alloc_op(ring, SOCK_RING_SEND, user_data);
+  if (!o)
+    return -1;
+  o->socket = skt;
+  o->fd = sock->handle;
+  o->data = (void*)data;
+  o->size = size;
+  return sock_ring_queue(ring, o);
+}
 
-  if (bind(sock->handle, (const struct sockaddr *) &address, sizeof(struct sockaddr_in)) != 0) {
-    sock_close(*skt);
-    //return zed_net__error("Failed to bind socket");
+int sock_ring_recv(sock_ring_t* ring, sock_handle_t skt, void* data, int size, void* user_data) {
+  sock_t* sock = sock_lookup(skt);
+  if (!ring || !sock)
+    return -1;
+  sock_ring_op_t* o = sock_ring_alloc_op(ring, SOCK_RING_RECV, user_data);
+  if (!o)
+    return -1;
+  o->socket = skt;
+  o->fd = sock->handle;
+  o->data = data;
+  o->size = size;
+  return sock_ring_queue(ring, o);
+}
+
+int sock_ring_accept(sock_ring_t* ring, sock_handle_t skt, sock_address_t* remote_addr, void* user_data) {
+  sock_t* sock = sock_lookup(skt);
+  if (!ring || !sock)
+    return -1;
+  sock_ring_op_t* o = sock_ring_alloc_op(ring, SOCK_RING_ACCEPT, user_data);
+  if (!o)
+    return -1;
+  o->socket = skt;
+  o->fd = sock->handle;
+  o->flags = sock->blocking;
+  o->size = sock->family;
+  o->remote_addr = remote_addr;
+  return sock_ring_queue(ring, o);
+}
+
+int sock_ring_connect(sock_ring_t* ring, sock_handle_t skt, sock_address_t remote_addr, void* user_data) {
+  sock_t* sock = sock_lookup(skt);
+  if (!ring || !sock)
+    return -1;
+  sock_ring_op_t* o = sock_ring_alloc_op(ring, SOCK_RING_CONNECT, user_data);
+  if (!o)
+    return -1;
+  o->socket = skt;
+  o->fd = sock->handle;
+  o->addrlen = sock_address_to_native(&remote_addr, sock->family, &o->addr);
+  if (!o->addrlen) {
+    sock_ring_free_op(ring, o);
     return -1;
   }
+  return sock_ring_queue(ring, o);
+}
 
-  // Set the socket to non-blocking if neccessary
-  if (non_blocking) {
-#ifdef _WIN32
-    u_long nblock = non_blocking;
-    if (ioctlsocket(sock->handle, FIONBIO, &nblock) != 0) {
-      sock_close(*skt);
-      //return zed_net__error("Failed to set socket to non-blocking");
-      return -1;
+int sock_ring_open(sock_ring_t* ring, const char* path, int flags, void* user_data) {
+  if (!ring || !path)
+    return -1;
+  sock_ring_op_t* o = sock_ring_alloc_op(ring, SOCK_RING_OPEN, user_data);
+  if (!o)
+    return -1;
+  o->path = path;
+  o->flags = flags;
+  return sock_ring_queue(ring, o);
+}
+
+int sock_ring_read(sock_ring_t* ring, int fd, void* data, int size, uint64_t offset, void* user_data) {
+  if (!ring || fd < 0)
+    return -1;
+  sock_ring_op_t* o = sock_ring_alloc_op(ring, SOCK_RING_READ, user_data);
+  if (!o)
+    return -1;
+  o->fd = fd;
+  o->data = data;
+  o->size = size;
+  o->offset = offset;
+  return sock_ring_queue(ring, o);
+}
+
+int sock_ring_stat(sock_ring_t* ring, const char* path, sock_file_stat_t* stat, void* user_data) {
+  if (!ring || !path || !stat)
+    return -1;
+  sock_ring_op_t* o = sock_ring_alloc_op(ring, SOCK_RING_STAT, user_data);
+  if (!o)
+    return -1;
+  o->path = path;
+  o->stat = stat;
+  return sock_ring_queue(ring, o);
+}
+
+// Runs an operation the kernel can't take asynchronously on the blocking path
+static void sock_ring_run_blocking(sock_ring_op_t* o) {
+  o->result = -1;
+  o->error = 0;
+  switch (o->op) {
+  case SOCK_RING_SEND:
+    o->result = send(o->fd, (const char*)o->data, o->size, 0);
+    break;
+  case SOCK_RING_RECV:
+    o->result = recv(o->fd, (char*)o->data, o->size, 0);
+    break;
+  case SOCK_RING_ACCEPT: {
+    sock_address_t remote;
+    int ret = sock_accept(o->socket, &o->socket, &remote);
+    if (ret == 0) {
+      if (o->remote_addr) *o->remote_addr = remote;
+      o->result = 0;
+      return;
     }
+    o->socket = 0;
+    break;
+  }
+  case SOCK_RING_CONNECT:
+    o->result = connect(o->fd, (const struct sockaddr*)&o->addr, o->addrlen) == 0 ? 0 : -1;
+    break;
+  case SOCK_RING_OPEN:
+#ifdef _WIN32
+    o->result = _open(o->path, o->flags | _O_BINARY);
 #else
-    if (fcntl(sock->handle, F_SETFL, O_NONBLOCK, non_blocking) != 0) {
-      sock_close(*skt);
-      //return zed_net__error("Failed to set socket to non-blocking");
-      return -1;
+    o->result = open(o->path, o->flags | O_CLOEXEC, 0644);
+#endif
+    break;
+  case SOCK_RING_READ:
+#ifdef _WIN32
+    if (_lseeki64(o->fd, (__int64)o->offset, SEEK_SET) >= 0)
+      o->result = _read(o->fd, o->data, o->size);
+#else
+    o->result = (int)pread(o->fd, o->data, o->size, (off_t)o->offset);
+#endif
+    break;
+  case SOCK_RING_STAT: {
+#ifdef _WIN32
+    struct _stat64 s;
+    if (_stat64(o->path, &s) == 0) {
+#else
+    struct stat s;
+    if (stat(o->path, &s) == 0) {
+#endif
+      o->stat->size = (uint64_t)s.st_size;
+      o->stat->mtime = (uint64_t)s.st_mtime;
+      o->stat->mode = (uint32_t)s.st_mode;
+      o->result = 0;
     }
+    break;
+  }
+  }
+  if (o->result < 0) {
+#ifdef _WIN32
+    o->error = o->op <= SOCK_RING_CONNECT ? WSAGetLastError() : errno;
+#else
+    o->error = errno;
 #endif
-    sock->ready = 0;
   }
+}
 
-  if (listening) {
-#ifndef SOMAXCONN
-#define SOMAXCONN 10
+int sock_ring_submit(sock_ring_t* ring, int wait_nr) {
+  if (!ring)
+    return -1;
+
+  int submitted = 0;
+  while (ring->pending_head >= 0) {
+    sock_ring_op_t* o = ring->ops + ring->pending_head;
+    ring->pending_head = o->next;
+    sock_ring_run_blocking(o);
+    sock_ring_list_push(ring, &ring->done_head, &ring->done_tail, o);
+    ++submitted;
+  }
+  ring->pending_tail = -1;
+
+#ifdef SOCK_HAS_IO_URING
+  if (ring->fd >= 0 && (ring->to_submit || wait_nr > submitted)) {
+    // blocking-path completions already count towards 'wait_nr'
+    unsigned int min_complete = wait_nr > submitted ? (unsigned int)(wait_nr - submitted) : 0;
+    int ret = sock_ring_enter(ring, ring->to_submit, min_complete);
+    if (ret < 0)
+      return submitted ? submitted : -1;
+    ring->to_submit -= (unsigned int)ret;
+    submitted += ret;
+  }
+#else
+  (void)wait_nr;
 #endif
-    if (listen(sock->handle, SOMAXCONN) != 0) {
-      sock_close(*skt);
-      //return zed_net__error("Failed make socket listen");
-      return -1;
+  return submitted;
+}
+
+// Turns a finished operation into a completion and returns its slot to the free list
+static void sock_ring_complete(sock_ring_t* ring, sock_ring_op_t* o, sock_completion_t* c) {
+  c->user_data = o->user_data;
+  c->op = o->op;
+  c->result = o->result;
+  c->error = o->error;
+  c->socket = o->op == SOCK_RING_ACCEPT && o->result >= 0 ? o->socket : 0;
+  sock_ring_free_op(ring, o);
+}
+
+int sock_ring_reap(sock_ring_t* ring, sock_completion_t* completions, int max) {
+  if (!ring || !completions)
+    return 0;
+
+  int count = 0;
+  while (count < max && ring->done_head >= 0) {
+    sock_ring_op_t* o = ring->ops + ring->done_head;
+    ring->done_head = o->next;
+    if (ring->done_head < 0)
+      ring->done_tail = -1;
+    sock_ring_complete(ring, o, completions + count++);
+  }
+
+#ifdef SOCK_HAS_IO_URING
+  if (ring->fd < 0)
+    return count;
+
+  unsigned int head = *ring->cq_head;
+  unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  while (count < max && head != tail) {
+    struct io_uring_cqe* cqe = ring->cqes + (head & *ring->cq_mask);
+    sock_ring_op_t* o = ring->ops + cqe->user_data;
+    int res = cqe->res;
+    ++head;
+
+    o->result = res < 0 ? -1 : res;
+    o->error = res < 0 ? -res : 0;
+    if (res >= 0) {
+      switch (o->op) {
+      case SOCK_RING_ACCEPT: {
+        sock_handle_t remote = alloc_socket();
+        if (!remote) {
+          close(res);
+          o->result = -1;
+          o->error = EMFILE;
+          break;
+        }
+        sock_t* rsock = sock_lookup(remote);
+        rsock->family = o->size;
+        rsock->blocking = o->flags;
+        rsock->ready = 0;
+        rsock->handle = res;
+        if (o->remote_addr)
+          sock_address_from_native(o->remote_addr, (const struct sockaddr*)&o->addr);
+        o->socket = remote;
+        o->result = 0;
+        break;
+      }
+      case SOCK_RING_STAT:
+        o->stat->size = o->stx.stx_size;
+        o->stat->mtime = (uint64_t)o->stx.stx_mtime.tv_sec;
+        o->stat->mode = o->stx.stx_mode;
+        break;
+      }
     }
+    sock_ring_complete(ring, o, completions + count++);
   }
-  sock->blocking = !non_blocking;
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+#endif
+  return count;
+}
 
-  return 0;
+typedef struct sock_server_worker_t {
+  struct sock_server_t* server;
+  int index;
+  thread_ptr_t thread;
+  sock_handle_t listener;
+  sock_handle_t wake; // woken by sock_server_stop
+  sock_poller_t* poller;
+} sock_server_worker_t;
+
+struct sock_server_t {
+  sock_server_config_t config;
+  sock_server_worker_t* workers;
+  int worker_count;
+  thread_atomic_int_t stopping;
+};
+
+// Accepts up to 'accept_batch' pending connections from a worker's listener
+static void sock_server_accept(sock_server_worker_t* worker, sock_handle_t* remotes, sock_address_t* addresses) {
+  sock_server_t* server = worker->server;
+  int n = sock_accept_many(worker->listener, remotes, addresses, server->config.accept_batch);
+  for (int i = 0; i < n; ++i) {
+    void* conn_user_data = NULL;
+    if ((server->config.on_accept &&
+         server->config.on_accept(server, worker->index, remotes[i], addresses + i, &conn_user_data, server->config.user_data) != 0) ||
+        sock_poller_add(worker->poller, remotes[i], SOCK_POLL_READ, conn_user_data) != 0)
+      sock_close(remotes[i]);
+  }
 }
 
-int sock_connect(sock_handle_t skt, sock_address_t remote_addr) {
-  struct sockaddr_in address;
-  int retval;
+static int sock_server_thread(void* user_data) {
+  sock_server_worker_t* worker = (sock_server_worker_t*)user_data;
+  sock_server_t* server = worker->server;
+  if (server->config.pin_workers)
+    thread_set_affinity(worker->index % thread_cpu_count());
+  sock_set_thread_hint(worker->index);
 
-  if (!skt)
-    //return zed_net__error("Socket is NULL");
+  sock_event_t* events = (sock_event_t*)malloc(sizeof(sock_event_t)*server->config.max_events);
+  sock_handle_t* remotes = (sock_handle_t*)malloc(sizeof(sock_handle_t)*server->config.accept_batch);
+  sock_address_t* addresses = (sock_address_t*)malloc(sizeof(sock_address_t)*server->config.accept_batch);
+  if (!events || !remotes || !addresses) {
+    free(events);
+    free(remotes);
+    free(addresses);
     return -1;
+  }
+  while (!thread_atomic_int_load(&server->stopping)) {
+    int n = sock_poller_wait(worker->poller, events, server->config.max_events, -1);
+    if (n < 0)
+      break;
+    for (int i = 0; i < n; ++i) {
+      if (events[i].socket == worker->listener)
+        sock_server_accept(worker, remotes, addresses);
+      else if (events[i].socket != worker->wake && server->config.on_event)
+        server->config.on_event(server, worker->index, events + i, server->config.user_data);
+    }
+  }
+  free(events);
+  free(remotes);
+  free(addresses);
+  return 0;
+}
+
+static void sock_server_close_worker(sock_server_worker_t* worker) {
+  if (worker->poller) {
+    // connections left on the poller belong to the server
+    for (uint32_t i = 1; i < totalSockets; ++i) {
+      if (sockets[i].poller == worker->poller) {
+        sock_handle_t skt = sock_make_handle(i);
+        if (skt != worker->listener && skt != worker->wake)
+          sock_close(skt);
+      }
+    }
+    sock_poller_destroy(worker->poller);
+  }
+  if (worker->listener)
+    sock_close(worker->listener);
+  if (worker->wake)
+    sock_close(worker->wake);
+}
 
-  sock_t* sock = sockets+skt;
+int sock_server_start(sock_server_t** server, const sock_server_config_t* config) {
+  if (!server || !config)
+    return -1;
 
-  retval = would_block(sock);
-  if (retval == 1)
-    return 1;
-  else if (retval) {
-    sock_close(skt);
+  sock_server_t* srv = (sock_server_t*)calloc(1, sizeof(sock_server_t));
+  if (!srv)
+    return -1;
+  srv->config = *config;
+  if (srv->config.workers <= 0)
+    srv->config.workers = thread_cpu_count();
+  if (srv->config.max_events <= 0)
+    srv->config.max_events = 256;
+  if (srv->config.accept_batch <= 0)
+    srv->config.accept_batch = 64;
+  thread_atomic_int_store(&srv->stopping, 0);
+  srv->workers = (sock_server_worker_t*)calloc(srv->config.workers, sizeof(sock_server_worker_t));
+  if (!srv->workers) {
+    free(srv);
     return -1;
   }
 
-  address.sin_family = AF_INET;
-  address.sin_addr.s_addr = remote_addr.host;
-  address.sin_port = htons(remote_addr.port);
+  // open every listener before any worker runs, so a bind failure leaves nothing behind
+  int flags = srv->config.listen_flags | SOCK_LISTEN_REUSEPORT;
+  for (int i = 0; i < srv->config.workers; ++i) {
+    sock_server_worker_t* worker = srv->workers + i;
+    worker->server = srv;
+    worker->index = i;
+    srv->worker_count = i + 1;
+    if (sock_listen_ex(&worker->listener, srv->config.port, 1, srv->config.backlog, flags) != 0 ||
+        sock_open_wake(&worker->wake) != 0 ||
+        sock_poller_create(&worker->poller, srv->config.max_events) != 0 ||
+        sock_poller_add(worker->poller, worker->listener, SOCK_POLL_READ, NULL) != 0 ||
+        sock_poller_add(worker->poller, worker->wake, SOCK_POLL_READ, NULL) != 0) {
+      sock_server_stop(srv);
+      return -1;
+    }
+  }
 
-  retval = connect(sock->handle, (const struct sockaddr *) &address, sizeof(address));
-  if (retval == SOCKET_ERROR) {
-    sock_close(skt);
-    //return zed_net__error("Failed to connect socket");
-    return -1;
+  for (int i = 0; i < srv->config.workers; ++i) {
+    sock_server_worker_t* worker = srv->workers + i;
+    worker->thread = smd_thread_create(sock_server_thread, worker, "sock_server", THREAD_STACK_SIZE_DEFAULT);
+    if (!worker->thread) {
+      sock_server_stop(srv);
+      return -1;
+    }
   }
 
+  *server = srv;
   return 0;
 }
 
-int sock_accept(sock_handle_t skt, sock_handle_t *remote_socket, sock_address_t *remote_addr) {
-  struct sockaddr_in address;
-  int retval, handle;
-  sock_t* listening_socket = sockets+skt;
+void sock_server_stop(sock_server_t* server) {
+  if (!server)
+    return;
 
-  if (!skt)
-    //return zed_net__error("Listening socket is NULL");
-    return -1;
-  if (!remote_socket)
-    //return zed_net__error("Remote socket is NULL");
-    return -1;
-  if (!remote_addr)
-    //return zed_net__error("Address pointer is NULL");
-    return -1;
+  thread_atomic_int_store(&server->stopping, 1);
+  for (int i = 0; i < server->worker_count; ++i) {
+    sock_t* wake = sock_lookup(server->workers[i].wake);
+    if (wake)
+      send(wake->handle, "", 1, 0);
+  }
+  for (int i = 0; i < server->worker_count; ++i) {
+    if (server->workers[i].thread) {
+      thread_join(server->workers[i].thread);
+      thread_destroy(server->workers[i].thread);
+    }
+  }
+  for (int i = 0; i < server->worker_count; ++i) {
+    sock_server_close_worker(server->workers + i);
+  }
+  free(server->workers);
+  free(server);
+}
 
-  retval = would_block(listening_socket);
-  if (retval == 1)
-    return 1;
-  else if (retval) {
-    sock_close(skt);
+int sock_server_worker_count(sock_server_t* server) {
+  return server ? server->worker_count : 0;
+}
+
+sock_poller_t* sock_server_poller(sock_server_t* server, int worker) {
+  if (!server || worker < 0 || worker >= server->worker_count)
+    return NULL;
+  return server->workers[worker].poller;
+}
+
+typedef struct sock_pool_idle_t {
+  sock_handle_t socket;
+  int address;    // index into 'addresses'
+  uint64_t since; // sock_now_ms when checked in
+  int checking;   // sock_pool_prune is checking it outside the lock, leave it be
+  int newer;      // pool-wide LRU list, -1 terminated
+  int older;
+  int next;       // per-address list (newest first) or free list
+} sock_pool_idle_t;
+
+typedef struct sock_pool_address_t {
+  sock_address_t address;
+  int idle;       // newest idle connection, -1 if none
+  int idle_count;
+  int failures;   // consecutive connect failures
+  uint64_t retry_at;
+} sock_pool_address_t;
+
+struct sock_pool_t {
+  sock_pool_config_t config;
+  thread_mutex_t lock;
+  sock_pool_idle_t* idle;
+  int newest;
+  int oldest;
+  int free;
+  int idle_count;
+  sock_pool_address_t* addresses;
+  int address_count;
+  int address_capacity;
+};
+
+static int sock_address_equal(const sock_address_t* a, const sock_address_t* b) {
+  if (a->family != b->family || a->port != b->port)
+    return 0;
+  if (a->family == SOCK_FAMILY_IPV6)
+    return a->scope_id == b->scope_id && memcmp(a->host6, b->host6, 16) == 0;
+  if (a->family == SOCK_FAMILY_UNIX)
+    return strcmp(a->path, b->path) == 0;
+  return a->host == b->host;
+}
+
+// Addresses a pool keeps entries for. Once there are this many, one without idle
+// connections is reused, preferring the one whose backoff ends first.
+#define SOCK_POOL_ADDRESS_MAX 1024
+
+// Finds (or with 'add', creates) the entry for an address. Called with the lock held.
+// Entries can be reused for another address whenever the lock isn't held, so indexes
+// must be looked up again after unlocking.
+static int sock_pool_find(sock_pool_t* pool, const sock_address_t* address, int add) {
+  int unused = -1;
+  for (int i = 0; i < pool->address_count; ++i) {
+    const sock_pool_address_t* a = pool->addresses + i;
+    if (sock_address_equal(&a->address, address))
+      return i;
+    if (!a->idle_count && (unused < 0 || a->retry_at < pool->addresses[unused].retry_at))
+      unused = i;
+  }
+  if (!add)
     return -1;
+  if (pool->address_count == SOCK_POOL_ADDRESS_MAX) {
+    if (unused < 0)
+      return -1;
+    sock_pool_address_t* entry = pool->addresses + unused;
+    memset(entry, 0, sizeof(*entry));
+    entry->address = *address;
+    entry->idle = -1;
+    return unused;
   }
-#ifdef _WIN32
-  typedef int socklen_t;
-#endif
-  socklen_t addrlen = sizeof(address);
-  handle = accept(listening_socket->handle, (struct sockaddr *)&address, &addrlen);
+  if (pool->address_count == pool->address_capacity) {
+    int capacity = pool->address_capacity ? pool->address_capacity*2 : 8;
+    sock_pool_address_t* addresses = (sock_pool_address_t*)realloc(pool->addresses, sizeof(sock_pool_address_t)*capacity);
+    if (!addresses)
+      return -1;
+    pool->addresses = addresses;
+    pool->address_capacity = capacity;
+  }
+  sock_pool_address_t* entry = pool->addresses + pool->address_count;
+  memset(entry, 0, sizeof(*entry));
+  entry->address = *address;
+  entry->idle = -1;
+  return pool->address_count++;
+}
 
-  if (handle == INVALID_SOCKET)
-    return 2;
+// Unlinks an idle entry from both lists and frees it. Called with the lock held.
+static sock_handle_t sock_pool_unlink(sock_pool_t* pool, int index) {
+  sock_pool_idle_t* e = pool->idle + index;
+  sock_pool_address_t* a = pool->addresses + e->address;
+  int* link = &a->idle;
+  while (*link != index)
+    link = &pool->idle[*link].next;
+  *link = e->next;
+  --a->idle_count;
 
-  remote_addr->host = address.sin_addr.s_addr;
-  remote_addr->port = ntohs(address.sin_port);
-  *remote_socket = alloc_socket();
-  sock_t* rsock = sockets+*remote_socket;
-  rsock->blocking = listening_socket->blocking;
-  rsock->ready = 0;
-  rsock->handle = handle;
+  if (e->newer >= 0) pool->idle[e->newer].older = e->older; else pool->newest = e->older;
+  if (e->older >= 0) pool->idle[e->older].newer = e->newer; else pool->oldest = e->newer;
+  --pool->idle_count;
 
-  return 0;
+  e->next = pool->free;
+  pool->free = index;
+  return e->socket;
 }
 
-int sock_send(sock_handle_t skt, const void *data, int size) {
-  if (!skt) return -1;
-  
-  int retval;
-  sock_t* sock = sockets+skt;
+// A pooled connection is only usable while the peer has neither closed it nor sent
+// anything unasked, both of which make it readable
+static int sock_pool_alive(sock_handle_t skt) {
+  sock_t* sock = sock_lookup(skt);
+  if (!sock || sock->handle == -1)
+    return 0;
+  struct pollfd pfd;
+  pfd.fd = sock->handle;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  return poll(&pfd, 1, 0) == 0;
+}
 
-  retval = would_block(sock);
-  if (retval == 1)
-    return 1;
-  else if (retval) {
-    sock_close(skt);
+int sock_pool_create(sock_pool_t** pool, const sock_pool_config_t* config) {
+  if (!pool)
     return -1;
-  }
+  sock_pool_t* p = (sock_pool_t*)calloc(1, sizeof(sock_pool_t));
+  if (!p)
+    return -1;
+  if (config)
+    p->config = *config;
+  if (p->config.max_idle_per_address <= 0) p->config.max_idle_per_address = 8;
+  if (p->config.max_idle <= 0) p->config.max_idle = 256;
+  if (p->config.idle_timeout_ms <= 0) p->config.idle_timeout_ms = 60000;
+  if (p->config.backoff_ms <= 0) p->config.backoff_ms = 100;
+  if (p->config.max_backoff_ms <= 0) p->config.max_backoff_ms = 30000;
 
-  int sent_bytes = send(sock->handle, (const char *)data, size, 0);
-  if (sent_bytes != size) {
-    //return zed_net__error("Failed to send data");
+  p->idle = (sock_pool_idle_t*)malloc(sizeof(sock_pool_idle_t)*p->config.max_idle);
+  if (!p->idle) {
+    free(p);
     return -1;
   }
-
+  for (int i = 0; i < p->config.max_idle; ++i) {
+    p->idle[i].next = i + 1 < p->config.max_idle ? i + 1 : -1;
+  }
+  p->free = 0;
+  p->newest = p->oldest = -1;
+  thread_mutex_init(&p->lock);
+  *pool = p;
   return 0;
 }
 
-int sock_receive(sock_handle_t skt, void *data, int size) {
-  if (!skt) return -1;
+void sock_pool_destroy(sock_pool_t* pool) {
+  if (!pool)
+    return;
+  while (pool->oldest >= 0) {
+    sock_close(sock_pool_unlink(pool, pool->oldest));
+  }
+  thread_mutex_term(&pool->lock);
+  free(pool->addresses);
+  free(pool->idle);
+  free(pool);
+}
 
-  int retval;
-  sock_t* sock = sockets + skt;
+int sock_pool_try_checkout(sock_pool_t* pool, sock_address_t address, sock_handle_t* socket) {
+  if (!pool || !socket)
+    return -1;
 
-  retval = would_block(sock);
-  if (retval == 1)
-    return 1;
-  else if (retval) {
+  uint64_t now = sock_now_ms();
+  for (;;) {
+    thread_mutex_lock(&pool->lock);
+    int a = sock_pool_find(pool, &address, 0);
+    int index = a >= 0 ? pool->addresses[a].idle : -1;
+    while (index >= 0 && pool->idle[index].checking)
+      index = pool->idle[index].next;
+    if (index < 0) {
+      thread_mutex_unlock(&pool->lock);
+      return 1;
+    }
+    uint64_t since = pool->idle[index].since;
+    sock_handle_t skt = sock_pool_unlink(pool, index);
+    thread_mutex_unlock(&pool->lock);
+
+    // check outside the lock, dead ones are dropped and the next newest tried
+    if (now - since < (uint64_t)pool->config.idle_timeout_ms && sock_pool_alive(skt)) {
+      *socket = skt;
+      return 0;
+    }
     sock_close(skt);
+  }
+}
+
+int sock_pool_checkout(sock_pool_t* pool, sock_address_t address, sock_handle_t* socket) {
+  int ret = sock_pool_try_checkout(pool, address, socket);
+  if (ret != 1)
+    return ret;
+
+  thread_mutex_lock(&pool->lock);
+  int a = sock_pool_find(pool, &address, 0);
+  int backing_off = a >= 0 && pool->addresses[a].retry_at > sock_now_ms();
+  thread_mutex_unlock(&pool->lock);
+  if (backing_off)
     return -1;
+
+  sock_handle_t skt;
+  int connected = sock_open(&skt, 0) == 0;
+  // sock_connect closes the socket when it fails
+  if (connected && sock_connect(skt, address) != 0)
+    connected = 0;
+
+  thread_mutex_lock(&pool->lock);
+  // only failures are worth a new entry
+  a = sock_pool_find(pool, &address, !connected);
+  sock_pool_address_t* entry = a >= 0 ? pool->addresses + a : NULL;
+  if (entry && connected) {
+    entry->failures = 0;
+    entry->retry_at = 0;
   }
+  else if (entry) {
+    int shift = entry->failures < 16 ? entry->failures : 16;
+    int64_t backoff = (int64_t)pool->config.backoff_ms << shift;
+    if (backoff > pool->config.max_backoff_ms)
+      backoff = pool->config.max_backoff_ms;
+    ++entry->failures;
+    entry->retry_at = sock_now_ms() + (uint64_t)backoff;
+  }
+  thread_mutex_unlock(&pool->lock);
 
-#ifdef _WIN32
-  typedef int socklen_t;
-#endif
+  if (!connected)
+    return -1;
+  *socket = skt;
+  return 0;
+}
 
-  int received_bytes = recv(sock->handle, (char *)data, size, 0);
-  if (received_bytes <= 0) {
-    return 0;
+void sock_pool_checkin(sock_pool_t* pool, sock_handle_t socket, int reusable) {
+  sock_t* sock = sock_lookup(socket);
+  if (!pool || !sock)
+    return;
+
+  struct sockaddr_storage native;
+  socklen_t len = sizeof(native);
+  sock_address_t address;
+  if (!reusable || sock->handle == -1 ||
+      getpeername(sock->handle, (struct sockaddr*)&native, &len) != 0) {
+    sock_close(socket);
+    return;
   }
-  return received_bytes;
+  sock_address_from_native(&address, (const struct sockaddr*)&native);
+
+  sock_handle_t evicted = 0;
+  thread_mutex_lock(&pool->lock);
+  int a = sock_pool_find(pool, &address, 1);
+  if (a < 0 || pool->addresses[a].idle_count >= pool->config.max_idle_per_address) {
+    thread_mutex_unlock(&pool->lock);
+    sock_close(socket);
+    return;
+  }
+  if (pool->free < 0) {
+    // the least recently used one that isn't being checked
+    int oldest = pool->oldest;
+    while (oldest >= 0 && pool->idle[oldest].checking)
+      oldest = pool->idle[oldest].newer;
+    if (oldest < 0) {
+      thread_mutex_unlock(&pool->lock);
+      sock_close(socket);
+      return;
+    }
+    evicted = sock_pool_unlink(pool, oldest);
+  }
+
+  int index = pool->free;
+  sock_pool_idle_t* e = pool->idle + index;
+  pool->free = e->next;
+  e->socket = socket;
+  e->address = a;
+  e->since = sock_now_ms();
+  e->checking = 0;
+  e->next = pool->addresses[a].idle;
+  pool->addresses[a].idle = index;
+  ++pool->addresses[a].idle_count;
+  e->newer = -1;
+  e->older = pool->newest;
+  if (pool->newest >= 0) pool->idle[pool->newest].newer = index; else pool->oldest = index;
+  pool->newest = index;
+  ++pool->idle_count;
+  thread_mutex_unlock(&pool->lock);
+
+  if (evicted)
+    sock_close(evicted);
 }
 
-int sock_get_address(sock_address_t *address, const char *host, unsigned short port) {
-  if (host == NULL) {
-    address->host = INADDR_ANY;
+// An idle connection sock_pool_prune is checking
+typedef struct sock_pool_check_t {
+  int index;
+  int alive;
+} sock_pool_check_t;
+
+int sock_pool_prune(sock_pool_t* pool) {
+  if (!pool)
+    return 0;
+
+  // timed out ones go now, the rest stay linked but marked while they are checked
+  uint64_t now = sock_now_ms();
+  thread_mutex_lock(&pool->lock);
+  int count = 0;
+  sock_pool_check_t* checked = pool->idle_count ? (sock_pool_check_t*)malloc(sizeof(sock_pool_check_t)*pool->idle_count) : NULL;
+  sock_handle_t* closing = pool->idle_count ? (sock_handle_t*)malloc(sizeof(sock_handle_t)*pool->idle_count) : NULL;
+  if (!checked || !closing) {
+    thread_mutex_unlock(&pool->lock);
+    free(checked);
+    free(closing);
+    return 0;
   }
-  else {
-    address->host = inet_addr(host);
-    if (address->host == INADDR_NONE) {
-      struct hostent *hostent = gethostbyname(host);
-      if (hostent) {
-        memcpy(&address->host, hostent->h_addr, hostent->h_length);
+  int closed = 0;
+  for (int index = pool->oldest; index >= 0;) {
+    sock_pool_idle_t* e = pool->idle + index;
+    int newer = e->newer;
+    // entries another prune is checking are left to it
+    if (!e->checking) {
+      if (now - e->since >= (uint64_t)pool->config.idle_timeout_ms) {
+        closing[closed++] = sock_pool_unlink(pool, index);
       }
       else {
-        return -1;///zed_net__error("Invalid host name");
+        e->checking = 1;
+        checked[count++].index = index;
       }
     }
+    index = newer;
   }
+  thread_mutex_unlock(&pool->lock);
 
-  address->port = port;
-
-  return 0;
-}
-
-const char *sock_host_to_str(unsigned int host) {
-  struct in_addr in;
-  in.s_addr = host;
+  // nothing else touches a marked entry, so its socket can be polled without the lock
+  for (int i = 0; i < count; ++i) {
+    checked[i].alive = sock_pool_alive(pool->idle[checked[i].index].socket);
+  }
 
-  return inet_ntoa(in);
-}
+  thread_mutex_lock(&pool->lock);
+  for (int i = 0; i < count; ++i) {
+    pool->idle[checked[i].index].checking = 0;
+    if (!checked[i].alive)
+      closing[closed++] = sock_pool_unlink(pool, checked[i].index);
+  }
+  thread_mutex_unlock(&pool->lock);
 
-int sock_get_host_name(char* name, int name_len) {
-  return gethostname(name, name_len) == 0 ? 0 : -1;
+  for (int i = 0; i < closed; ++i) {
+    sock_close(closing[i]);
+  }
+  free(checked);
+  free(closing);
+  return closed;
 }
 
 #endif
@@ -0,0 +1,878 @@
+/*
+ * Loopback benchmarks for sock.h: ping-pong latency, bulk throughput, accept rate and
+ * many-connection fan-in, over TCP loopback and unix domain sockets, driven through the
+ * blocking calls, the poller and the ring. Results are printed as one JSON document.
+ *
+ * Not part of the library build, compile it by hand:
+ *   cc -O2 -D_GNU_SOURCE -o sock_bench sock_bench.c getopt.c -lpthread
+ *
+ *   ./sock_bench --bench pingpong --transport tcp --backend all --size 64
+ */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "getopt.h"
+
+#define SMD_SOCK_IMPL
+#include "sock.h"
+
+#define SMD_THREAD_IMPL
+#include "thread.h"
+
+enum {
+  BENCH_TCP,
+  BENCH_UNIX,
+  BENCH_TRANSPORTS,
+};
+
+enum {
+  BENCH_BLOCKING,
+  BENCH_POLLER,
+  BENCH_RING,
+  BENCH_BACKENDS,
+};
+
+static const char* transportNames[BENCH_TRANSPORTS] = { "tcp", "unix" };
+static const char* backendNames[BENCH_BACKENDS] = { "blocking", "poller", "ring" };
+
+typedef struct bench_config_t {
+  int size;         // ping-pong message size
+  int chunk;        // throughput write size
+  int iterations;   // ping-pong round trips
+  double duration;  // throughput seconds
+  int accepts;      // connections for the accept benchmark
+  int connections;  // fan-in connections
+  int rounds;       // fan-in messages per connection
+  unsigned int port;
+} bench_config_t;
+
+static int firstResult = 1;
+
+static uint64_t bench_now_ns() {
+#ifdef _WIN32
+  LARGE_INTEGER freq, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// Each listener gets a fresh port so TIME_WAIT from an earlier run doesn't get in the way
+static unsigned int bench_port(bench_config_t* config) {
+  return config->port++;
+}
+
+static const char* bench_unix_path(char* buf, int len, unsigned int port) {
+  snprintf(buf, len, "/tmp/sock_bench_%u.sock", port);
+  return buf;
+}
+
+// Opens a result object; the caller prints the fields and calls bench_result_end
+static void bench_result_begin(const char* bench, int transport, int backend) {
+  printf("%s\n    {\"bench\": \"%s\", \"transport\": \"%s\", \"backend\": \"%s\"",
+    firstResult ? "" : ",", bench, transportNames[transport], backendNames[backend]);
+  firstResult = 0;
+}
+
+static void bench_result_end() {
+  printf("}");
+  fflush(stdout);
+}
+
+static void bench_result_error(const char* bench, int transport, int backend, const char* error) {
+  bench_result_begin(bench, transport, backend);
+  printf(", \"error\": \"%s\"", error);
+  bench_result_end();
+}
+
+// Waits until the socket's native handle is readable or writable
+static int bench_wait(sock_handle_t skt, short events) {
+  struct pollfd pfd;
+  pfd.fd = (int)sock_native_handle(skt);
+  pfd.events = events;
+  pfd.revents = 0;
+  return poll(&pfd, 1, -1) < 0 ? -1 : 0;
+}
+
+// Reads exactly 'size' bytes on a blocking or non-blocking socket
+//
+// Returns 0 on success, -1 on error or end of stream
+static int bench_read_all(sock_handle_t skt, char* data, int size) {
+  while (size > 0) {
+    sock_iovec_t iov;
+    iov.data = data;
+    iov.size = (size_t)size;
+    int got = sock_receivev(skt, &iov, 1);
+    if (got < 0)
+      return -1;
+    if (!got && bench_wait(skt, POLLIN) != 0)
+      return -1;
+    data += got;
+    size -= got;
+  }
+  return 0;
+}
+
+static int bench_write_all(sock_handle_t skt, const char* data, int size) {
+  while (size > 0) {
+    sock_iovec_t iov;
+    iov.data = (void*)data;
+    iov.size = (size_t)size;
+    int sent = sock_sendv(skt, &iov, 1);
+    if (sent < 0)
+      return -1;
+    if (!sent && bench_wait(skt, POLLOUT) != 0)
+      return -1;
+    data += sent;
+    size -= sent;
+  }
+  return 0;
+}
+
+// Connects a client to a fresh listener and accepts it. 'sockets[0]' is the client, in
+// 'non_blocking' mode, 'sockets[1]' the blocking server side.
+//
+// Returns 0 on success, -1 otherwise
+static int bench_pair(bench_config_t* config, int transport, int non_blocking, sock_handle_t sockets[2]) {
+  if (transport == BENCH_UNIX)
+    return sock_socketpair(sockets, SOCK_UNIX_STREAM, non_blocking);
+
+  sock_handle_t listener;
+  sock_address_t address, remote;
+  unsigned int port = bench_port(config);
+  if (sock_listen_ex(&listener, port, 0, 16, SOCK_LISTEN_REUSEADDR) != 0)
+    return -1;
+  if (sock_get_address(&address, "127.0.0.1", (unsigned short)port) != 0 ||
+      sock_open(&sockets[0], non_blocking) != 0) {
+    sock_close(listener);
+    return -1;
+  }
+  int ret = sock_connect(sockets[0], address);
+  if (ret < 0 || sock_accept(listener, &sockets[1], &remote) != 0) {
+    if (ret >= 0)
+      sock_close(sockets[0]);
+    sock_close(listener);
+    return -1;
+  }
+  sock_close(listener);
+  while (ret == 1 && (ret = sock_connect_result(sockets[0])) == 1)
+    bench_wait(sockets[0], POLLOUT);
+  sock_set_option(sockets[0], SOCK_OPT_NODELAY, 1);
+  sock_set_option(sockets[1], SOCK_OPT_NODELAY, 1);
+  return ret;
+}
+
+static int bench_compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+static uint64_t bench_percentile(const uint64_t* sorted, int count, double percentile) {
+  int index = (int)(percentile / 100.0 * (double)count + 0.5) - 1;
+  if (index < 0)
+    index = 0;
+  if (index >= count)
+    index = count - 1;
+  return sorted[index];
+}
+
+typedef struct bench_peer_t {
+  sock_handle_t socket;
+  int size;
+  uint64_t bytes;
+} bench_peer_t;
+
+// Sends every message straight back until the client hangs up
+static int bench_echo_thread(void* user_data) {
+  bench_peer_t* peer = (bench_peer_t*)user_data;
+  char* buf = (char*)malloc((size_t)peer->size);
+  while (bench_read_all(peer->socket, buf, peer->size) == 0 &&
+         bench_write_all(peer->socket, buf, peer->size) == 0) {
+  }
+  free(buf);
+  return 0;
+}
+
+// Counts everything received until the sender hangs up
+static int bench_drain_thread(void* user_data) {
+  bench_peer_t* peer = (bench_peer_t*)user_data;
+  char* buf = (char*)malloc((size_t)peer->size);
+  for (;;) {
+    sock_iovec_t iov;
+    iov.data = buf;
+    iov.size = (size_t)peer->size;
+    int got = sock_receivev(peer->socket, &iov, 1);
+    if (got < 0)
+      break;
+    if (!got && bench_wait(peer->socket, POLLIN) != 0)
+      break;
+    peer->bytes += (uint64_t)got;
+  }
+  free(buf);
+  return 0;
+}
+
+// One round trip of 'size' bytes through 'backend'
+static int bench_round_trip(int backend, sock_handle_t skt, sock_poller_t* poller, sock_ring_t* ring,
+  char* buf, int size) {
+  if (backend == BENCH_BLOCKING) {
+    if (sock_send(skt, buf, size) != 0)
+      return -1;
+    for (int got = 0; got < size;) {
+      int n = sock_receive(skt, buf + got, size - got);
+      if (n <= 0)
+        return -1;
+      got += n;
+    }
+    return 0;
+  }
+
+  if (backend == BENCH_POLLER) {
+    if (bench_write_all(skt, buf, size) != 0)
+      return -1;
+    for (int got = 0; got < size;) {
+      sock_event_t event;
+      if (sock_poller_wait(poller, &event, 1, -1) < 0)
+        return -1;
+      sock_iovec_t iov;
+      iov.data = buf + got;
+      iov.size = (size_t)(size - got);
+      int n = sock_receivev(skt, &iov, 1);
+      if (n < 0)
+        return -1;
+      got += n;
+    }
+    return 0;
+  }
+
+  // ring: the send and the first receive go down in one submission
+  sock_completion_t completions[2];
+  int got = 0;
+  int sent = 0;
+  if (sock_ring_send(ring, skt, buf, size, NULL) != 0 || sock_ring_recv(ring, skt, buf, size, buf) != 0)
+    return -1;
+  int pending = 2;
+  while (pending) {
+    if (sock_ring_submit(ring, 1) < 0)
+      return -1;
+    int n = sock_ring_reap(ring, completions, 2);
+    for (int i = 0; i < n; ++i) {
+      --pending;
+      if (completions[i].result <= 0)
+        return -1;
+      if (completions[i].op == SOCK_RING_SEND) {
+        sent += completions[i].result;
+        if (sent < size) {
+          sock_ring_send(ring, skt, buf + sent, size - sent, NULL);
+          ++pending;
+        }
+      }
+      else {
+        got += completions[i].result;
+        if (got < size) {
+          sock_ring_recv(ring, skt, buf + got, size - got, buf);
+          ++pending;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+static void bench_pingpong(bench_config_t* config, int transport, int backend) {
+  sock_handle_t pair[2];
+  if (bench_pair(config, transport, backend == BENCH_POLLER, pair) != 0) {
+    bench_result_error("pingpong", transport, backend, "connect failed");
+    return;
+  }
+
+  sock_poller_t* poller = NULL;
+  sock_ring_t* ring = NULL;
+  if ((backend == BENCH_POLLER && (sock_poller_create(&poller, 4) != 0 ||
+                                   sock_poller_add(poller, pair[0], SOCK_POLL_READ, NULL) != 0)) ||
+      (backend == BENCH_RING && sock_ring_create(&ring, 8) != 0)) {
+    bench_result_error("pingpong", transport, backend, "backend unavailable");
+    sock_poller_destroy(poller);
+    sock_close(pair[0]);
+    sock_close(pair[1]);
+    return;
+  }
+
+  bench_peer_t peer = { pair[1], config->size, 0 };
+  thread_ptr_t echo = smd_thread_create(bench_echo_thread, &peer, "bench echo", 0);
+  char* buf = (char*)calloc(1, (size_t)config->size);
+  uint64_t* samples = (uint64_t*)malloc(sizeof(uint64_t) * (size_t)config->iterations);
+
+  // warm up the caches and the connection before timing anything
+  int warmup = config->iterations / 10 + 1;
+  int failed = 0;
+  for (int i = 0; i < warmup && !failed; ++i) {
+    failed = bench_round_trip(backend, pair[0], poller, ring, buf, config->size) != 0;
+  }
+  uint64_t total = 0;
+  int count = 0;
+  for (; count < config->iterations && !failed; ++count) {
+    uint64_t start = bench_now_ns();
+    failed = bench_round_trip(backend, pair[0], poller, ring, buf, config->size) != 0;
+    samples[count] = bench_now_ns() - start;
+    total += samples[count];
+  }
+
+  sock_poller_destroy(poller);
+  sock_ring_destroy(ring);
+  sock_close(pair[0]);
+  thread_join(echo);
+  thread_destroy(echo);
+  sock_close(pair[1]);
+
+  if (failed) {
+    bench_result_error("pingpong", transport, backend, "transfer failed");
+  }
+  else {
+    qsort(samples, (size_t)count, sizeof(uint64_t), bench_compare_u64);
+    bench_result_begin("pingpong", transport, backend);
+    printf(", \"size\": %d, \"iterations\": %d, \"mean_ns\": %llu, \"min_ns\": %llu, \"p50_ns\": %llu"
+      ", \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu",
+      config->size, count, (unsigned long long)(total / (uint64_t)count),
+      (unsigned long long)samples[0],
+      (unsigned long long)bench_percentile(samples, count, 50),
+      (unsigned long long)bench_percentile(samples, count, 99),
+      (unsigned long long)bench_percentile(samples, count, 99.9),
+      (unsigned long long)samples[count - 1]);
+    bench_result_end();
+  }
+  free(samples);
+  free(buf);
+}
+
+static void bench_throughput(bench_config_t* config, int transport, int backend) {
+  sock_handle_t pair[2];
+  if (bench_pair(config, transport, backend == BENCH_POLLER, pair) != 0) {
+    bench_result_error("throughput", transport, backend, "connect failed");
+    return;
+  }
+
+  sock_poller_t* poller = NULL;
+  sock_ring_t* ring = NULL;
+  if ((backend == BENCH_POLLER && (sock_poller_create(&poller, 4) != 0 ||
+                                   sock_poller_add(poller, pair[0], SOCK_POLL_WRITE, NULL) != 0)) ||
+      (backend == BENCH_RING && sock_ring_create(&ring, 16) != 0)) {
+    bench_result_error("throughput", transport, backend, "backend unavailable");
+    sock_poller_destroy(poller);
+    sock_close(pair[0]);
+    sock_close(pair[1]);
+    return;
+  }
+
+  bench_peer_t peer = { pair[1], config->chunk, 0 };
+  thread_ptr_t drain = smd_thread_create(bench_drain_thread, &peer, "bench drain", 0);
+  char* buf = (char*)calloc(1, (size_t)config->chunk);
+
+  uint64_t start = bench_now_ns();
+  uint64_t end = start + (uint64_t)(config->duration * 1e9);
+  uint64_t calls = 0;
+  int failed = 0;
+  while (!failed && bench_now_ns() < end) {
+    if (backend == BENCH_BLOCKING) {
+      failed = sock_send(pair[0], buf, config->chunk) != 0;
+      ++calls;
+    }
+    else if (backend == BENCH_POLLER) {
+      sock_event_t event;
+      if (sock_poller_wait(poller, &event, 1, 100) < 0) {
+        failed = 1;
+        break;
+      }
+      // write until the kernel buffer is full, then go back to waiting
+      for (;;) {
+        sock_iovec_t iov;
+        iov.data = buf;
+        iov.size = (size_t)config->chunk;
+        int sent = sock_sendv(pair[0], &iov, 1);
+        ++calls;
+        if (sent < 0)
+          failed = 1;
+        if (sent < config->chunk)
+          break;
+      }
+    }
+    else {
+      // keep a batch of sends in flight per submission
+      const int batch = 8;
+      for (int i = 0; i < batch; ++i) {
+        sock_ring_send(ring, pair[0], buf, config->chunk, NULL);
+      }
+      if (sock_ring_submit(ring, batch) < 0) {
+        failed = 1;
+        break;
+      }
+      sock_completion_t completions[8];
+      int done = 0;
+      while (done < batch) {
+        int n = sock_ring_reap(ring, completions, batch);
+        for (int i = 0; i < n; ++i) {
+          if (completions[i].result < 0)
+            failed = 1;
+        }
+        done += n;
+        if (done < batch && sock_ring_submit(ring, batch - done) < 0) {
+          failed = 1;
+          break;
+        }
+      }
+      calls += (uint64_t)batch;
+    }
+  }
+
+  sock_poller_destroy(poller);
+  sock_ring_destroy(ring);
+  sock_close(pair[0]);
+  thread_join(drain);
+  thread_destroy(drain);
+  uint64_t elapsed = bench_now_ns() - start;
+  sock_close(pair[1]);
+  free(buf);
+
+  if (failed) {
+    bench_result_error("throughput", transport, backend, "transfer failed");
+    return;
+  }
+  bench_result_begin("throughput", transport, backend);
+  printf(", \"chunk\": %d, \"bytes\": %llu, \"calls\": %llu, \"seconds\": %.3f, \"mb_per_s\": %.1f",
+    config->chunk, (unsigned long long)peer.bytes, (unsigned long long)calls, (double)elapsed / 1e9,
+    (double)peer.bytes / ((double)elapsed / 1e9) / (1024.0 * 1024.0));
+  bench_result_end();
+}
+
+typedef struct bench_acceptor_t {
+  sock_handle_t listener;
+  int backend;
+  int expected;
+  int accepted;
+  int failed;
+} bench_acceptor_t;
+
+static int bench_accept_thread(void* user_data) {
+  bench_acceptor_t* acceptor = (bench_acceptor_t*)user_data;
+
+  if (acceptor->backend == BENCH_BLOCKING) {
+    while (acceptor->accepted < acceptor->expected) {
+      sock_handle_t remote;
+      sock_address_t address;
+      if (sock_accept(acceptor->listener, &remote, &address) != 0) {
+        acceptor->failed = 1;
+        break;
+      }
+      sock_close(remote);
+      ++acceptor->accepted;
+    }
+  }
+  else if (acceptor->backend == BENCH_POLLER) {
+    sock_poller_t* poller;
+    if (sock_poller_create(&poller, 4) != 0 || sock_poller_add(poller, acceptor->listener, SOCK_POLL_READ, NULL) != 0) {
+      acceptor->failed = 1;
+      return 0;
+    }
+    while (acceptor->accepted < acceptor->expected) {
+      sock_event_t event;
+      sock_handle_t remotes[64];
+      if (sock_poller_wait(poller, &event, 1, -1) < 0) {
+        acceptor->failed = 1;
+        break;
+      }
+      int n = sock_accept_many(acceptor->listener, remotes, NULL, 64);
+      if (n < 0) {
+        acceptor->failed = 1;
+        break;
+      }
+      for (int i = 0; i < n; ++i) {
+        sock_close(remotes[i]);
+      }
+      acceptor->accepted += n;
+    }
+    sock_poller_destroy(poller);
+  }
+  else {
+    sock_ring_t* ring;
+    if (sock_ring_create(&ring, 32) != 0) {
+      acceptor->failed = 1;
+      return 0;
+    }
+    // a blocking fallback accept waits in submit, so only keep as many queued as will come
+    int queued = 0;
+    while (acceptor->accepted < acceptor->expected && !acceptor->failed) {
+      while (queued < 16 && acceptor->accepted + queued < acceptor->expected) {
+        sock_ring_accept(ring, acceptor->listener, NULL, NULL);
+        ++queued;
+      }
+      if (sock_ring_submit(ring, 1) < 0) {
+        acceptor->failed = 1;
+        break;
+      }
+      sock_completion_t completions[16];
+      int n = sock_ring_reap(ring, completions, 16);
+      for (int i = 0; i < n; ++i) {
+        --queued;
+        if (completions[i].result < 0) {
+          acceptor->failed = 1;
+          continue;
+        }
+        sock_close(completions[i].socket);
+        ++acceptor->accepted;
+      }
+    }
+    sock_ring_destroy(ring);
+  }
+  return 0;
+}
+
+static void bench_accept(bench_config_t* config, int transport, int backend) {
+  bench_acceptor_t acceptor;
+  memset(&acceptor, 0, sizeof(acceptor));
+  acceptor.backend = backend;
+  acceptor.expected = config->accepts;
+
+  char path[64];
+  sock_address_t address;
+  unsigned int port = bench_port(config);
+  int ret;
+  if (transport == BENCH_UNIX) {
+    bench_unix_path(path, sizeof(path), port);
+    ret = sock_unix_address(&address, path) | sock_listen_unix(&acceptor.listener, path, SOCK_UNIX_STREAM,
+      backend == BENCH_POLLER, 0);
+  }
+  else {
+    ret = sock_get_address(&address, "127.0.0.1", (unsigned short)port) |
+      sock_listen_ex(&acceptor.listener, port, backend == BENCH_POLLER, 0, SOCK_LISTEN_REUSEADDR);
+  }
+  if (ret != 0) {
+    bench_result_error("accept", transport, backend, "listen failed");
+    return;
+  }
+
+  thread_ptr_t thread = smd_thread_create(bench_accept_thread, &acceptor, "bench accept", 0);
+  uint64_t start = bench_now_ns();
+  int connected = 0;
+  for (; connected < config->accepts; ++connected) {
+    sock_handle_t client;
+    if (transport == BENCH_UNIX ? sock_open_unix(&client, SOCK_UNIX_STREAM, 0) : sock_open(&client, 0))
+      break;
+    if (sock_connect(client, address) != 0)
+      break; // sock_connect closed it
+    sock_close(client);
+  }
+  if (connected < config->accepts) {
+    // unblock the acceptor, it may be waiting for a connection that won't come
+    acceptor.failed = 1;
+    sock_handle_t client;
+    for (int i = 0; i < 16; ++i) {
+      if ((transport == BENCH_UNIX ? sock_open_unix(&client, SOCK_UNIX_STREAM, 0) : sock_open(&client, 0)) == 0 &&
+          sock_connect(client, address) == 0)
+        sock_close(client);
+    }
+  }
+  thread_join(thread);
+  thread_destroy(thread);
+  uint64_t elapsed = bench_now_ns() - start;
+  sock_close(acceptor.listener);
+  if (transport == BENCH_UNIX)
+    remove(path);
+
+  if (acceptor.failed) {
+    bench_result_error("accept", transport, backend, "accept failed");
+    return;
+  }
+  bench_result_begin("accept", transport, backend);
+  printf(", \"connections\": %d, \"seconds\": %.3f, \"per_second\": %.0f",
+    acceptor.accepted, (double)elapsed / 1e9, (double)acceptor.accepted / ((double)elapsed / 1e9));
+  bench_result_end();
+}
+
+typedef struct bench_fanin_t {
+  sock_handle_t* sockets; // server side of each connection
+  int count;
+  int backend;
+  int size;
+  uint64_t expected; // bytes
+  uint64_t received;
+  int failed;
+} bench_fanin_t;
+
+// Reads every connection until all the expected bytes arrived
+static int bench_fanin_thread(void* user_data) {
+  bench_fanin_t* fanin = (bench_fanin_t*)user_data;
+  char* buf = (char*)malloc((size_t)fanin->size * (size_t)fanin->count);
+
+  if (fanin->backend == BENCH_POLLER) {
+    sock_poller_t* poller;
+    sock_event_t events[64];
+    if (sock_poller_create(&poller, 64) != 0) {
+      fanin->failed = 1;
+      free(buf);
+      return 0;
+    }
+    for (int i = 0; i < fanin->count; ++i) {
+      sock_poller_add(poller, fanin->sockets[i], SOCK_POLL_READ, NULL);
+    }
+    while (fanin->received < fanin->expected) {
+      int n = sock_poller_wait(poller, events, 64, -1);
+      if (n < 0) {
+        fanin->failed = 1;
+        break;
+      }
+      for (int i = 0; i < n; ++i) {
+        sock_iovec_t iov;
+        iov.data = buf;
+        iov.size = (size_t)fanin->size * (size_t)fanin->count;
+        int got = sock_receivev(events[i].socket, &iov, 1);
+        if (got < 0) {
+          fanin->failed = 1;
+          break;
+        }
+        fanin->received += (uint64_t)got;
+      }
+      if (fanin->failed)
+        break;
+    }
+    sock_poller_destroy(poller);
+  }
+  else {
+    // a receive in flight on every connection, each one re-armed as it completes
+    sock_ring_t* ring;
+    if (sock_ring_create(&ring, (unsigned int)fanin->count) != 0) {
+      fanin->failed = 1;
+      free(buf);
+      return 0;
+    }
+    for (int i = 0; i < fanin->count; ++i) {
+      sock_ring_recv(ring, fanin->sockets[i], buf + (size_t)i * fanin->size, fanin->size, (void*)(intptr_t)i);
+    }
+    sock_completion_t completions[64];
+    while (fanin->received < fanin->expected && !fanin->failed) {
+      if (sock_ring_submit(ring, 1) < 0) {
+        fanin->failed = 1;
+        break;
+      }
+      int n = sock_ring_reap(ring, completions, 64);
+      for (int i = 0; i < n; ++i) {
+        int index = (int)(intptr_t)completions[i].user_data;
+        if (completions[i].result <= 0) {
+          fanin->failed = 1;
+          continue;
+        }
+        fanin->received += (uint64_t)completions[i].result;
+        if (fanin->received < fanin->expected)
+          sock_ring_recv(ring, fanin->sockets[index], buf + (size_t)index * fanin->size, fanin->size,
+            completions[i].user_data);
+      }
+    }
+    sock_ring_destroy(ring);
+  }
+  free(buf);
+  return 0;
+}
+
+static void bench_fanin(bench_config_t* config, int transport, int backend) {
+  if (backend == BENCH_BLOCKING) {
+    bench_result_error("fanin", transport, backend, "one blocking thread can't serve many connections");
+    return;
+  }
+
+  int count = config->connections;
+  sock_handle_t* clients = (sock_handle_t*)calloc((size_t)count, sizeof(sock_handle_t));
+  sock_handle_t* servers = (sock_handle_t*)calloc((size_t)count, sizeof(sock_handle_t));
+  int opened = 0;
+  for (; opened < count; ++opened) {
+    sock_handle_t pair[2];
+    if (bench_pair(config, transport, 0, pair) != 0)
+      break;
+    clients[opened] = pair[0];
+    servers[opened] = pair[1];
+  }
+
+  if (opened == count) {
+    bench_fanin_t fanin;
+    memset(&fanin, 0, sizeof(fanin));
+    fanin.sockets = servers;
+    fanin.count = count;
+    fanin.backend = backend;
+    fanin.size = config->size;
+    fanin.expected = (uint64_t)count * (uint64_t)config->rounds * (uint64_t)config->size;
+
+    char* buf = (char*)calloc(1, (size_t)config->size);
+    thread_ptr_t thread = smd_thread_create(bench_fanin_thread, &fanin, "bench fanin", 0);
+    uint64_t start = bench_now_ns();
+    for (int round = 0; round < config->rounds; ++round) {
+      for (int i = 0; i < count; ++i) {
+        bench_write_all(clients[i], buf, config->size);
+      }
+    }
+    thread_join(thread);
+    thread_destroy(thread);
+    uint64_t elapsed = bench_now_ns() - start;
+    free(buf);
+
+    if (fanin.failed) {
+      bench_result_error("fanin", transport, backend, "transfer failed");
+    }
+    else {
+      uint64_t messages = (uint64_t)count * (uint64_t)config->rounds;
+      bench_result_begin("fanin", transport, backend);
+      printf(", \"connections\": %d, \"size\": %d, \"messages\": %llu, \"seconds\": %.3f, \"messages_per_s\": %.0f",
+        count, config->size, (unsigned long long)messages, (double)elapsed / 1e9,
+        (double)messages / ((double)elapsed / 1e9));
+      bench_result_end();
+    }
+  }
+  else {
+    bench_result_error("fanin", transport, backend, "connect failed");
+  }
+
+  for (int i = 0; i < opened; ++i) {
+    sock_close(clients[i]);
+    sock_close(servers[i]);
+  }
+  free(clients);
+  free(servers);
+}
+
+typedef void (*bench_fn)(bench_config_t* config, int transport, int backend);
+
+static const struct {
+  const char* name;
+  bench_fn run;
+} benches[] = {
+  { "pingpong", bench_pingpong },
+  { "throughput", bench_throughput },
+  { "accept", bench_accept },
+  { "fanin", bench_fanin },
+};
+
+// Matches 'value' against 'names', "all" selects every one
+//
+// Returns a bit mask of the selected names, 0 if nothing matched
+static unsigned int bench_select(const char* value, const char* const* names, int count) {
+  if (strcmp(value, "all") == 0)
+    return (1u << count) - 1;
+  for (int i = 0; i < count; ++i) {
+    if (strcmp(value, names[i]) == 0)
+      return 1u << i;
+  }
+  return 0;
+}
+
+static void bench_usage(const struct gop_option* options) {
+  fprintf(stderr, "usage: sock_bench [options]\n");
+  for (const struct gop_option* o = options; o->name; ++o) {
+    fprintf(stderr, "  -%c, --%-12s %s\n", o->short_name, o->name, o->usage);
+  }
+}
+
+int main(int argc, char** argv) {
+  static const struct gop_option options[] = {
+    { "bench", "pingpong, throughput, accept, fanin or all (default)", gop_required_argument, NULL, 0, 'b' },
+    { "transport", "tcp, unix or all (default)", gop_required_argument, NULL, 0, 't' },
+    { "backend", "blocking, poller, ring or all (default)", gop_required_argument, NULL, 0, 'k' },
+    { "size", "ping-pong and fan-in message size in bytes (64)", gop_required_argument, NULL, 0, 's' },
+    { "chunk", "throughput write size in bytes (65536)", gop_required_argument, NULL, 0, 'C' },
+    { "iterations", "ping-pong round trips (20000)", gop_required_argument, NULL, 0, 'n' },
+    { "duration", "throughput seconds per run (2)", gop_required_argument, NULL, 0, 'd' },
+    { "accepts", "connections for the accept benchmark (5000)", gop_required_argument, NULL, 0, 'a' },
+    { "connections", "fan-in connections (64)", gop_required_argument, NULL, 0, 'c' },
+    { "rounds", "fan-in messages per connection (2000)", gop_required_argument, NULL, 0, 'r' },
+    { "port", "first TCP port to use (41000)", gop_required_argument, NULL, 0, 'p' },
+    { "help", "show this text", gop_no_argument, NULL, 0, 'h' },
+    { NULL, NULL, 0, NULL, 0, 0 },
+  };
+
+  bench_config_t config;
+  config.size = 64;
+  config.chunk = 65536;
+  config.iterations = 20000;
+  config.duration = 2.0;
+  config.accepts = 5000;
+  config.connections = 64;
+  config.rounds = 2000;
+  config.port = 41000;
+  const char* benchNames[4];
+  for (int i = 0; i < 4; ++i) {
+    benchNames[i] = benches[i].name;
+  }
+  unsigned int selectedBenches = 0xf;
+  unsigned int selectedTransports = (1u << BENCH_TRANSPORTS) - 1;
+  unsigned int selectedBackends = (1u << BENCH_BACKENDS) - 1;
+
+  struct gop_ctx ctx;
+  gop_init(&ctx, argc, argv, options);
+  int opt;
+  while ((opt = gop_next(&ctx)) != -1) {
+    switch (opt) {
+    case 'b': selectedBenches = bench_select(ctx.optarg, benchNames, 4); break;
+    case 't': selectedTransports = bench_select(ctx.optarg, transportNames, BENCH_TRANSPORTS); break;
+    case 'k': selectedBackends = bench_select(ctx.optarg, backendNames, BENCH_BACKENDS); break;
+    case 's': config.size = atoi(ctx.optarg); break;
+    case 'C': config.chunk = atoi(ctx.optarg); break;
+    case 'n': config.iterations = atoi(ctx.optarg); break;
+    case 'd': config.duration = atof(ctx.optarg); break;
+    case 'a': config.accepts = atoi(ctx.optarg); break;
+    case 'c': config.connections = atoi(ctx.optarg); break;
+    case 'r': config.rounds = atoi(ctx.optarg); break;
+    case 'p': config.port = (unsigned int)atoi(ctx.optarg); break;
+    case 'h': bench_usage(options); return 0;
+    default: bench_usage(options); return 1;
+    }
+  }
+  if (!selectedBenches || !selectedTransports || !selectedBackends || config.size <= 0 || config.chunk <= 0 ||
+      config.iterations <= 0 || config.accepts <= 0 || config.connections <= 0 || config.rounds <= 0) {
+    bench_usage(options);
+    return 1;
+  }
+
+  // each fan-in connection holds two slots, plus the listeners and pollers' wake sockets
+  if (sock_initialize((size_t)config.connections * 2 + 256) != 0) {
+    fprintf(stderr, "sock_initialize failed\n");
+    return 1;
+  }
+
+  sock_ring_t* ring;
+  int native = 0;
+  if (sock_ring_create(&ring, 8) == 0) {
+    native = sock_ring_is_native(ring);
+    sock_ring_destroy(ring);
+  }
+  printf("{\n  \"poller\": \"%s\",\n  \"ring\": \"%s\",\n  \"cpus\": %d,\n  \"results\": [",
+#ifdef __linux__
+    "epoll",
+#else
+    "poll",
+#endif
+    native ? "io_uring" : "blocking fallback", thread_cpu_count());
+
+  for (int b = 0; b < 4; ++b) {
+    if (!(selectedBenches & (1u << b)))
+      continue;
+    for (int t = 0; t < BENCH_TRANSPORTS; ++t) {
+      if (!(selectedTransports & (1u << t)))
+        continue;
+      for (int k = 0; k < BENCH_BACKENDS; ++k) {
+        if (selectedBackends & (1u << k))
+          benches[b].run(&config, t, k);
+      }
+    }
+  }
+  printf("\n  ]\n}\n");
+
+  sock_shutdown();
+  return 0;
+}
@@ -33,6 +33,8 @@ typedef void* thread_id_t;
 SMD_API thread_id_t thread_current_thread_id( void );
 SMD_API void thread_yield( void );
 SMD_API void thread_set_high_priority( void );
+SMD_API int thread_cpu_count( void );
+SMD_API int thread_set_affinity( int cpu );
 SMD_API void thread_exit( int return_code );
 
 typedef void* thread_ptr_t;
@@ -86,8 +88,22 @@ SMD_API void thread_queue_init( thread_queue_t* queue, int size, void** values,
 SMD_API void thread_queue_term( thread_queue_t* queue );
 SMD_API int thread_queue_produce( thread_queue_t* queue, void* value, int timeout_ms );
 SMD_API void* thread_queue_consume( thread_queue_t* queue, int timeout_ms );
+SMD_API int thread_queue_produce_n( thread_queue_t* queue, void* const* values, int count, int timeout_ms );
+SMD_API int thread_queue_consume_n( thread_queue_t* queue, void** values, int max_count, int timeout_ms );
 SMD_API int thread_queue_count( thread_queue_t* queue );
 
+typedef struct thread_mpmc_queue_t thread_mpmc_queue_t;
+typedef struct thread_mpmc_queue_cell_t thread_mpmc_queue_cell_t;
+SMD_API void thread_mpmc_queue_init( thread_mpmc_queue_t* queue, int size, thread_mpmc_queue_cell_t* cells );
+SMD_API void thread_mpmc_queue_term( thread_mpmc_queue_t* queue );
+SMD_API int thread_mpmc_queue_produce( thread_mpmc_queue_t* queue, void* value, int timeout_ms );
+SMD_API void* thread_mpmc_queue_consume( thread_mpmc_queue_t* queue, int timeout_ms );
+SMD_API int thread_mpmc_queue_try_produce( thread_mpmc_queue_t* queue, void* value );
+SMD_API int thread_mpmc_queue_try_consume( thread_mpmc_queue_t* queue, void** value );
+SMD_API int thread_mpmc_queue_produce_n( thread_mpmc_queue_t* queue, void* const* values, int count, int timeout_ms );
+SMD_API int thread_mpmc_queue_consume_n( thread_mpmc_queue_t* queue, void** values, int max_count, int timeout_ms );
+SMD_API int thread_mpmc_queue_count( thread_mpmc_queue_t* queue );
+
 #endif /* thread_h */
 
 
@@ -201,6 +217,25 @@ Do not increase the priority of a thread unless you absolutely have to, as it ca
 without care.
 
 
+thread_cpu_count
+----------------
+
+    int thread_cpu_count( void )
+
+Returns the number of logical processors currently online, and never less than 1. Useful for sizing worker pools to 
+one thread per core.
+
+
+thread_set_affinity
+-------------------
+
+    int thread_set_affinity( int cpu )
+
+Pins the calling thread to the logical processor with index `cpu` (0 to `thread_cpu_count() - 1`), so the scheduler
+keeps it, and its caches, on that core. Returns a non-zero value on success, and 0 if the call failed or thread 
+affinity isn't available on the platform (e.g. Apple platforms, or Linux builds without `_GNU_SOURCE`).
+
+
 thread_exit
 -----------
 
@@ -474,12 +509,14 @@ thread_queue_init
     void thread_queue_init( thread_queue_t* queue, int size, void** values, int count )
 
 Initializes the specified queue instance, preparing it for use. The queue is a lock-free (but not wait-free)
-single-producer/single-consumer queue - it will not acquire any locks as long as there is space for adding or items to
-be consume, but will lock and wait when there is not. The `size` parameter specifies the number of elements in the 
-queue. The `values` parameter is an array of queue slots (`size` elements in length), each being of type `void*`. If
-the queue is initially empty, the `count` parameter should be 0, otherwise it indicates the number of entires, from the
-start of the `values` array, that the queue is initialized with. The `values` array is not copied, and must remain valid
-until `thread_queue_term` is called.
+single-producer/single-consumer ring - as long as there is space for adding or items to be consumed, each call is a
+plain store plus a release publish of its own index, with the producer and consumer indices kept on separate cache
+lines. Each side caches the other side's index and only re-reads it when the ring looks full or empty. Only then does
+the calling thread spin briefly and park (on a futex on Linux, on a `thread_signal_t` elsewhere). The `size` parameter
+specifies the number of elements in the queue. The `values` parameter is an array of queue slots (`size` elements in
+length), each being of type `void*`. If the queue is initially empty, the `count` parameter should be 0, otherwise it
+indicates the number of entires, from the start of the `values` array, that the queue is initialized with. The `values`
+array is not copied, and must remain valid until `thread_queue_term` is called.
 
 
 thread_queue_term
@@ -496,10 +533,10 @@ thread_queue_produce
     int thread_queue_produce( thread_queue_t* queue, void* value, int timeout_ms )
 
 Adds an element to a single-producer/single-consumer queue. If there is space in the queue to add another element, no
-lock will be taken. If the queue is full, calling thread will sleep until an element is consumed from another thread, 
-before adding the element, or until `timeout_ms` milliseconds have passed. If the wait timed out, a value of 0 is 
-returned, otherwise a non-zero value is returned. If the `timeout_ms` parameter is THREAD_QUEUE_WAIT_INFINITE,  
-`thread_queue_produce` waits indefinitely.
+lock will be taken and no system call made. If the queue is full, calling thread will sleep until an element is
+consumed from another thread, before adding the element, or until `timeout_ms` milliseconds have passed. If the wait
+timed out, a value of 0 is returned, otherwise a non-zero value is returned. If the `timeout_ms` parameter is
+THREAD_QUEUE_WAIT_INFINITE, `thread_queue_produce` waits indefinitely.
 
 
 thread_queue_consume
@@ -507,11 +544,34 @@ thread_queue_consume
 
     void* thread_queue_consume( thread_queue_t* queue, int timeout_ms )
 
-Removes an element from a single-producer/single-consumer queue. If the queue contains at least one element, no lock 
-will be taken. If the queue is empty, the calling thread will sleep until an element is added from another thread, or 
-until `timeout_ms` milliseconds have passed. If the wait timed out, a value of NULL is returned, otherwise 
-`thread_queue_consume` returns the value that was removed from the queue. If the `timeout_ms` parameter is 
-THREAD_QUEUE_WAIT_INFINITE, `thread_queue_consume` waits indefinitely.
+Removes an element from a single-producer/single-consumer queue. If the queue contains at least one element, no lock
+will be taken and no system call made. If the queue is empty, the calling thread will sleep until an element is added
+from another thread, or until `timeout_ms` milliseconds have passed. If the wait timed out, a value of NULL is
+returned, otherwise `thread_queue_consume` returns the value that was removed from the queue. If the `timeout_ms`
+parameter is THREAD_QUEUE_WAIT_INFINITE, `thread_queue_consume` waits indefinitely.
+
+
+thread_queue_produce_n
+----------------------
+
+    int thread_queue_produce_n( thread_queue_t* queue, void* const* values, int count, int timeout_ms )
+
+Adds the `count` elements of `values` to a single-producer/single-consumer queue, in order. All the elements that fit
+are written before the new tail is published, so a batch costs one index update and at most one wakeup of the 
+consumer, rather than one per element. If the queue fills up, the calling thread sleeps until there is space again, or
+until `timeout_ms` milliseconds have passed in total. Returns the number of elements added, which is less than `count`
+only if the wait timed out. Must be called from the same thread as `thread_queue_produce`.
+
+
+thread_queue_consume_n
+----------------------
+
+    int thread_queue_consume_n( thread_queue_t* queue, void** values, int max_count, int timeout_ms )
+
+Removes up to `max_count` elements from a single-producer/single-consumer queue into `values`, publishing the new head
+once for the whole batch. If the queue is empty, the calling thread sleeps until an element is added, or until 
+`timeout_ms` milliseconds have passed, and then takes whatever is available. Returns the number of elements removed, or
+0 if the wait timed out. Must be called from the same thread as `thread_queue_consume`.
 
 
 thread_queue_count
@@ -522,6 +582,96 @@ thread_queue_count
 Returns the number of elements currently held in a single-producer/single-consumer queue. Be aware that by the time you
 get the count, it might have changed by another thread calling consume or produce, so use with care.
 
+
+thread_mpmc_queue_init
+----------------------
+
+    void thread_mpmc_queue_init( thread_mpmc_queue_t* queue, int size, thread_mpmc_queue_cell_t* cells )
+
+Initializes a bounded multi-producer/multi-consumer queue, for fanning work in from (or out to) any number of threads.
+Every slot carries a sequence number saying whose turn it is, so producers and consumers each claim slots with a single
+compare-and-swap on their own position, and never contend with the other side unless the queue is empty or full. The
+`cells` parameter is an array of `size` queue cells, and `size` must be a power of two, 2 or larger. The array is not
+copied, and must remain valid until `thread_mpmc_queue_term` is called. Threads which have to wait for the queue park
+on a `thread_signal_t`.
+
+
+thread_mpmc_queue_term
+----------------------
+
+    void thread_mpmc_queue_term( thread_mpmc_queue_t* queue )
+
+Terminates the specified queue instance, releasing any system resources held by it. No thread may be waiting on the 
+queue.
+
+
+thread_mpmc_queue_produce
+-------------------------
+
+    int thread_mpmc_queue_produce( thread_mpmc_queue_t* queue, void* value, int timeout_ms )
+
+Adds an element to a multi-producer/multi-consumer queue. If the queue is full, the calling thread will sleep until an
+element is consumed by another thread, or until `timeout_ms` milliseconds have passed. Returns 0 if the wait timed out,
+and a non-zero value otherwise. A `timeout_ms` of 0 never waits, and THREAD_QUEUE_WAIT_INFINITE waits indefinitely.
+
+
+thread_mpmc_queue_consume
+-------------------------
+
+    void* thread_mpmc_queue_consume( thread_mpmc_queue_t* queue, int timeout_ms )
+
+Removes an element from a multi-producer/multi-consumer queue, sleeping for up to `timeout_ms` milliseconds while the 
+queue is empty. Returns NULL if the wait timed out, otherwise the value that was removed. Use 
+`thread_mpmc_queue_try_consume` or `thread_mpmc_queue_consume_n` if NULL is a valid element.
+
+
+thread_mpmc_queue_try_produce
+-----------------------------
+
+    int thread_mpmc_queue_try_produce( thread_mpmc_queue_t* queue, void* value )
+
+Adds an element to the queue if there is space for it, without waiting. Returns a non-zero value if the element was 
+added, and 0 if the queue was full.
+
+
+thread_mpmc_queue_try_consume
+-----------------------------
+
+    int thread_mpmc_queue_try_consume( thread_mpmc_queue_t* queue, void** value )
+
+Removes an element from the queue into `*value` if there is one, without waiting. Returns a non-zero value if an element
+was removed, and 0 if the queue was empty.
+
+
+thread_mpmc_queue_produce_n
+---------------------------
+
+    int thread_mpmc_queue_produce_n( thread_mpmc_queue_t* queue, void* const* values, int count, int timeout_ms )
+
+Adds the `count` elements of `values` to the queue, in order, claiming as many free slots as are available with each
+compare-and-swap. Elements from other producers may end up between them. Waits for space the same way as 
+`thread_mpmc_queue_produce`, with `timeout_ms` covering the whole call, and returns the number of elements added, which
+is less than `count` only if the wait timed out.
+
+
+thread_mpmc_queue_consume_n
+---------------------------
+
+    int thread_mpmc_queue_consume_n( thread_mpmc_queue_t* queue, void** values, int max_count, int timeout_ms )
+
+Removes up to `max_count` elements from the queue into `values`, claiming them with a single compare-and-swap. Waits 
+for up to `timeout_ms` milliseconds while the queue is empty, then returns whatever is available at that point. 
+Returns the number of elements removed, or 0 if the wait timed out.
+
+
+thread_mpmc_queue_count
+-----------------------
+
+    int thread_mpmc_queue_count( thread_mpmc_queue_t* queue )
+
+Returns the number of elements currently held in a multi-producer/multi-consumer queue. Other threads may change it at
+any time, so the value is only a hint.
+
 **/
 
 
@@ -563,15 +713,30 @@ union thread_timer_t
     char d[ 8 ]; 
     };
 
+#define THREAD_CACHE_LINE_SIZE ( 64 )
+
 struct thread_queue_t
     {
-    thread_signal_t data_ready;
-    thread_signal_t space_open;
-    thread_atomic_int_t count;
-    thread_atomic_int_t head;
-    thread_atomic_int_t tail;
     void** values;
     int size;
+    char pad_shared[ THREAD_CACHE_LINE_SIZE ];
+    // producer side: `tail` is published to the consumer, the rest is private to the producer
+    long volatile tail;
+    long head_cache;
+    int tail_slot;
+    char pad_producer[ THREAD_CACHE_LINE_SIZE ];
+    // consumer side: `head` is published to the producer, the rest is private to the consumer
+    long volatile head;
+    long tail_cache;
+    int head_slot;
+    char pad_consumer[ THREAD_CACHE_LINE_SIZE ];
+    // parking flags, only written when a side finds the ring empty or full
+    int volatile data_waiting;
+    int volatile space_waiting;
+    #if !defined( __linux__ )
+        thread_signal_t data_ready;
+        thread_signal_t space_open;
+    #endif
     #ifndef NDEBUG
         thread_atomic_int_t id_produce_is_set;
         thread_id_t id_produce;
@@ -580,6 +745,28 @@ struct thread_queue_t
     #endif
     };
 
+struct thread_mpmc_queue_cell_t
+    {
+    long volatile sequence;
+    void* value;
+    };
+
+struct thread_mpmc_queue_t
+    {
+    thread_mpmc_queue_cell_t* cells;
+    long mask;
+    char pad_shared[ THREAD_CACHE_LINE_SIZE ];
+    long volatile enqueue_pos;
+    char pad_producer[ THREAD_CACHE_LINE_SIZE ];
+    long volatile dequeue_pos;
+    char pad_consumer[ THREAD_CACHE_LINE_SIZE ];
+    // number of threads parked (or about to park) on each signal
+    long volatile data_waiters;
+    long volatile space_waiters;
+    thread_signal_t data_ready;
+    thread_signal_t space_open;
+    };
+
 #endif /* thread_impl */
 
 
@@ -624,8 +811,16 @@ struct thread_queue_t
 #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ )
 
     #include <pthread.h>
+    #include <sched.h>
+    #include <unistd.h>
     #include <sys/time.h>
     #include <errno.h>
+    #include <time.h>
+
+    #if defined( __linux__ )
+        #include <linux/futex.h>
+        #include <sys/syscall.h>
+    #endif
 
 #else 
     #error Unknown platform.
@@ -789,6 +984,51 @@ void thread_set_high_priority( void )
     }
 
 
+int thread_cpu_count( void )
+    {
+    #if defined( _WIN32 )
+
+        SYSTEM_INFO info;
+        GetSystemInfo( &info );
+        return info.dwNumberOfProcessors > 0 ? (int) info.dwNumberOfProcessors : 1;
+    
+    #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ )
+
+        long count = sysconf( _SC_NPROCESSORS_ONLN );
+        return count > 0 ? (int) count : 1;
+
+    #else 
+        #error Unknown platform.
+    #endif
+    }
+
+
+int thread_set_affinity( int cpu )
+    {
+    #if defined( _WIN32 )
+
+        if( cpu < 0 || cpu >= (int)( sizeof( DWORD_PTR ) * 8 ) ) return 0;
+        return SetThreadAffinityMask( GetCurrentThread(), (DWORD_PTR) 1 << cpu ) != 0;
+    
+    #elif defined( __linux__ ) && defined( CPU_SET )
+
+        if( cpu < 0 || cpu >= CPU_SETSIZE ) return 0;
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        CPU_SET( cpu, &set );
+        return pthread_setaffinity_np( pthread_self(), sizeof( set ), &set ) == 0;
+
+    #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ )
+
+        (void) cpu; // no affinity API (or not declared without _GNU_SOURCE)
+        return 0;
+
+    #else 
+        #error Unknown platform.
+    #endif
+    }
+
+
 void thread_mutex_init( thread_mutex_t* mutex )
     {
     #if defined( _WIN32 )
@@ -1051,8 +1291,9 @@ void thread_atomic_int_store( thread_atomic_int_t* atomic, int desired )
 
     #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ )
 
-        __sync_lock_test_and_set( &atomic->i, desired );
-        __sync_lock_release( &atomic->i );
+        // the exchange is only an acquire barrier, so fence earlier accesses first
+        __sync_synchronize();
+        (void) __sync_lock_test_and_set( &atomic->i, desired );
     
     #else 
         #error Unknown platform.
@@ -1188,8 +1429,9 @@ void thread_atomic_ptr_store( thread_atomic_ptr_t* atomic, void* desired )
     
     #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ )
 
-        __sync_lock_test_and_set( &atomic->ptr, desired );
-        __sync_lock_release( &atomic->ptr );
+        // the exchange is only an acquire barrier, so fence earlier accesses first
+        __sync_synchronize();
+        (void) __sync_lock_test_and_set( &atomic->ptr, desired );
     
     #else 
         #error Unknown platform.
@@ -1380,26 +1622,169 @@ void* thread_tls_get( thread_tls_t tls )
     }
 
 
+// The ring indices only ever grow (wrapping), so `tail - head` is the number of queued entries. Each side publishes 
+// its own index with release semantics and keeps a cached copy of the other side's, so the shared cache lines are only
+// touched when the cached copy says the ring is empty or full.
+#if defined( _WIN32 )
+    // volatile accesses have acquire/release semantics with MSVC's default /volatile:ms
+    #define THREAD_QUEUE_LOAD_ACQUIRE( ptr ) ( *( ptr ) )
+    #define THREAD_QUEUE_STORE_RELEASE( ptr, value ) ( *( ptr ) = ( value ) )
+    #define THREAD_QUEUE_FENCE() MemoryBarrier()
+    #define THREAD_QUEUE_CAS( ptr, expected, desired ) ( InterlockedCompareExchange( ( ptr ), ( desired ), ( expected ) ) == ( expected ) )
+    #define THREAD_QUEUE_ADD( ptr, value ) InterlockedExchangeAdd( ( ptr ), ( value ) )
+    #define THREAD_QUEUE_PAUSE() YieldProcessor()
+#else
+    #define THREAD_QUEUE_LOAD_ACQUIRE( ptr ) __atomic_load_n( ( ptr ), __ATOMIC_ACQUIRE )
+    #define THREAD_QUEUE_STORE_RELEASE( ptr, value ) __atomic_store_n( ( ptr ), ( value ), __ATOMIC_RELEASE )
+    #define THREAD_QUEUE_FENCE() __atomic_thread_fence( __ATOMIC_SEQ_CST )
+    #define THREAD_QUEUE_CAS( ptr, expected, desired ) __sync_bool_compare_and_swap( ( ptr ), ( expected ), ( desired ) )
+    #define THREAD_QUEUE_ADD( ptr, value ) __sync_fetch_and_add( ( ptr ), ( value ) )
+    #if defined( __i386__ ) || defined( __x86_64__ )
+        #define THREAD_QUEUE_PAUSE() __builtin_ia32_pause()
+    #else
+        #define THREAD_QUEUE_PAUSE() ( (void) 0 )
+    #endif
+#endif
+
+// number of times a side re-reads the other side's index before it parks
+#define THREAD_QUEUE_SPIN_COUNT ( 256 )
+
+
+static unsigned int thread_internal_queue_now_ms( void )
+    {
+    #if defined( _WIN32 )
+
+        return (unsigned int) timeGetTime();
+
+    #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ )
+
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return (unsigned int)( ts.tv_sec * 1000 + ts.tv_nsec / 1000000 );
+
+    #else 
+        #error Unknown platform.
+    #endif
+    }
+
+
+// On a single core the other side can't make progress while we spin, so go straight to sleep there.
+static int thread_internal_queue_spin_count( void )
+    {
+    static int volatile spin_count = -1;
+    if( spin_count < 0 ) spin_count = thread_cpu_count() > 1 ? THREAD_QUEUE_SPIN_COUNT : 0;
+    return spin_count;
+    }
+
+
+// Waits until `*index` moves away from `seen`, which means the other side has consumed or produced an entry. Returns 0
+// if `timeout_ms` expired first. The waiting flag and the index are re-checked on each side of a full fence, so a 
+// wakeup can't slip in between the check and the sleep.
+static int thread_internal_queue_park( thread_queue_t* queue, int volatile* waiting, long volatile* index, long seen, 
+    int timeout_ms )
+    {
+    if( timeout_ms == 0 ) return THREAD_QUEUE_LOAD_ACQUIRE( index ) != seen;
+    int spin_count = thread_internal_queue_spin_count();
+    for( int i = 0; i < spin_count; ++i )
+        {
+        if( THREAD_QUEUE_LOAD_ACQUIRE( index ) != seen ) return 1;
+        THREAD_QUEUE_PAUSE();
+        }
+
+    unsigned int start = thread_internal_queue_now_ms();
+    for( ; ; )
+        {
+        THREAD_QUEUE_STORE_RELEASE( waiting, 1 );
+        THREAD_QUEUE_FENCE();
+        if( THREAD_QUEUE_LOAD_ACQUIRE( index ) != seen )
+            {
+            THREAD_QUEUE_STORE_RELEASE( waiting, 0 );
+            return 1;
+            }
+
+        int remaining = THREAD_QUEUE_WAIT_INFINITE;
+        if( timeout_ms != THREAD_QUEUE_WAIT_INFINITE )
+            {
+            remaining = timeout_ms - (int)( thread_internal_queue_now_ms() - start );
+            if( remaining <= 0 )
+                {
+                THREAD_QUEUE_STORE_RELEASE( waiting, 0 );
+                return THREAD_QUEUE_LOAD_ACQUIRE( index ) != seen;
+                }
+            }
+
+        #if defined( __linux__ )
+
+            (void) queue;
+            struct timespec ts;
+            ts.tv_sec = remaining / 1000;
+            ts.tv_nsec = ( remaining % 1000 ) * 1000000L;
+            // returns straight away if the other side already cleared the flag
+            syscall( SYS_futex, (int*) waiting, FUTEX_WAIT_PRIVATE, 1, remaining < 0 ? NULL : &ts, NULL, 0 );
+
+        #else
+
+            thread_signal_wait( waiting == &queue->data_waiting ? &queue->data_ready : &queue->space_open, remaining );
+
+        #endif
+        }
+    }
+
+
+// Called after publishing an index, wakes the other side if it is parked (or about to park) waiting for it.
+static void thread_internal_queue_wake( thread_queue_t* queue, int volatile* waiting )
+    {
+    THREAD_QUEUE_FENCE();
+    if( THREAD_QUEUE_LOAD_ACQUIRE( waiting ) == 0 ) return;
+
+    #if defined( __linux__ )
+
+        (void) queue;
+        if( __atomic_exchange_n( waiting, 0, __ATOMIC_SEQ_CST ) )
+            syscall( SYS_futex, (int*) waiting, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+
+    #else
+
+        THREAD_QUEUE_STORE_RELEASE( waiting, 0 );
+        thread_signal_raise( waiting == &queue->data_waiting ? &queue->data_ready : &queue->space_open );
+
+    #endif
+    }
+
+
 void thread_queue_init( thread_queue_t* queue, int size, void** values, int count )
     {
+    count = count > size ? size : count;
     queue->values = values;
-    thread_signal_init( &queue->data_ready );
-    thread_signal_init( &queue->space_open );
-    thread_atomic_int_store( &queue->head, 0 );
-    thread_atomic_int_store( &queue->tail, count > size ? size : count );
-    thread_atomic_int_store( &queue->count, count > size ? size : count );
     queue->size = size;
+    queue->tail = count;
+    queue->head_cache = 0;
+    queue->tail_slot = count == size ? 0 : count;
+    queue->head = 0;
+    queue->tail_cache = count;
+    queue->head_slot = 0;
+    queue->data_waiting = 0;
+    queue->space_waiting = 0;
+    #if !defined( __linux__ )
+        thread_signal_init( &queue->data_ready );
+        thread_signal_init( &queue->space_open );
+    #endif
     #ifndef NDEBUG
         thread_atomic_int_store( &queue->id_produce_is_set, 0 );
         thread_atomic_int_store( &queue->id_consume_is_set, 0 );
     #endif
+    THREAD_QUEUE_FENCE();
     }
 
 
 void thread_queue_term( thread_queue_t* queue )
     {
-    thread_signal_term( &queue->space_open );
-    thread_signal_term( &queue->data_ready );
+    #if !defined( __linux__ )
+        thread_signal_term( &queue->space_open );
+        thread_signal_term( &queue->data_ready );
+    #else
+        (void) queue;
+    #endif
     }
 
 
@@ -1410,16 +1795,22 @@ int thread_queue_produce( thread_queue_t* queue, void* value, int timeout_ms )
             queue->id_produce = thread_current_thread_id();
         assert( thread_current_thread_id() == queue->id_produce );
     #endif
-    if( thread_atomic_int_load( &queue->count ) == queue->size )
+    long tail = queue->tail;
+    if( (unsigned long) tail - (unsigned long) queue->head_cache >= (unsigned long) queue->size )
         {
-        if( timeout_ms == 0 ) return 0;
-        thread_signal_wait( &queue->space_open, timeout_ms == THREAD_QUEUE_WAIT_INFINITE ? THREAD_SIGNAL_WAIT_INFINITE : timeout_ms );
+        queue->head_cache = THREAD_QUEUE_LOAD_ACQUIRE( &queue->head );
+        while( (unsigned long) tail - (unsigned long) queue->head_cache >= (unsigned long) queue->size )
+            {
+            if( !thread_internal_queue_park( queue, &queue->space_waiting, &queue->head, queue->head_cache, timeout_ms ) )
+                return 0;
+            queue->head_cache = THREAD_QUEUE_LOAD_ACQUIRE( &queue->head );
+            }
         }
-    int tail = thread_atomic_int_inc( &queue->tail );
-    queue->values[ tail % queue->size ] = value;
-    if( thread_atomic_int_inc( &queue->count ) == 0 )
-        thread_signal_raise( &queue->data_ready );
-    return 0;
+    queue->values[ queue->tail_slot ] = value;
+    queue->tail_slot = queue->tail_slot + 1 == queue->size ? 0 : queue->tail_slot + 1;
+    THREAD_QUEUE_STORE_RELEASE( &queue->tail, tail + 1 );
+    thread_internal_queue_wake( queue, &queue->data_waiting );
+    return 1;
     }
 
 
@@ -1430,22 +1821,347 @@ void* thread_queue_consume( thread_queue_t* queue, int timeout_ms )
             queue->id_consume = thread_current_thread_id();
         assert( thread_current_thread_id() == queue->id_consume );
     #endif
-    if( thread_atomic_int_load( &queue->count ) == 0 )
+    long head = queue->head;
+    if( head == queue->tail_cache )
         {
-        if( timeout_ms == 0 ) return NULL;
-        thread_signal_wait( &queue->data_ready, THREAD_SIGNAL_WAIT_INFINITE );
+        queue->tail_cache = THREAD_QUEUE_LOAD_ACQUIRE( &queue->tail );
+        while( head == queue->tail_cache )
+            {
+            if( !thread_internal_queue_park( queue, &queue->data_waiting, &queue->tail, head, timeout_ms ) )
+                return NULL;
+            queue->tail_cache = THREAD_QUEUE_LOAD_ACQUIRE( &queue->tail );
+            }
         }
-    int head = thread_atomic_int_inc( &queue->head );
-    void* retval = queue->values[ head % queue->size ];
-    if( thread_atomic_int_dec( &queue->count ) == queue->size )
-        thread_signal_raise( &queue->space_open );
+    void* retval = queue->values[ queue->head_slot ];
+    queue->head_slot = queue->head_slot + 1 == queue->size ? 0 : queue->head_slot + 1;
+    THREAD_QUEUE_STORE_RELEASE( &queue->head, head + 1 );
+    thread_internal_queue_wake( queue, &queue->space_waiting );
     return retval;
     }
 
+
+int thread_queue_produce_n( thread_queue_t* queue, void* const* values, int count, int timeout_ms )
+    {
+    #ifndef NDEBUG
+        if( thread_atomic_int_compare_and_swap( &queue->id_produce_is_set, 0, 1 ) == 0 )
+            queue->id_produce = thread_current_thread_id();
+        assert( thread_current_thread_id() == queue->id_produce );
+    #endif
+    int done = 0;
+    unsigned int start = timeout_ms > 0 ? thread_internal_queue_now_ms() : 0;
+    while( done < count )
+        {
+        long tail = queue->tail;
+        int space = queue->size - (int)( (unsigned long) tail - (unsigned long) queue->head_cache );
+        if( space < count - done )
+            {
+            queue->head_cache = THREAD_QUEUE_LOAD_ACQUIRE( &queue->head );
+            space = queue->size - (int)( (unsigned long) tail - (unsigned long) queue->head_cache );
+            }
+        if( space <= 0 )
+            {
+            int remaining = timeout_ms;
+            if( timeout_ms > 0 )
+                {
+                remaining = timeout_ms - (int)( thread_internal_queue_now_ms() - start );
+                if( remaining <= 0 ) remaining = 0;
+                }
+            if( !thread_internal_queue_park( queue, &queue->space_waiting, &queue->head, queue->head_cache, remaining ) )
+                break;
+            continue;
+            }
+
+        int n = space < count - done ? space : count - done;
+        for( int i = 0; i < n; ++i )
+            {
+            queue->values[ queue->tail_slot ] = values[ done + i ];
+            queue->tail_slot = queue->tail_slot + 1 == queue->size ? 0 : queue->tail_slot + 1;
+            }
+        THREAD_QUEUE_STORE_RELEASE( &queue->tail, tail + n );
+        thread_internal_queue_wake( queue, &queue->data_waiting );
+        done += n;
+        }
+    return done;
+    }
+
+
+int thread_queue_consume_n( thread_queue_t* queue, void** values, int max_count, int timeout_ms )
+    {
+    #ifndef NDEBUG
+        if( thread_atomic_int_compare_and_swap( &queue->id_consume_is_set, 0, 1 ) == 0 )
+            queue->id_consume = thread_current_thread_id();
+        assert( thread_current_thread_id() == queue->id_consume );
+    #endif
+    if( max_count <= 0 ) return 0;
+    long head = queue->head;
+    int available = (int)( (unsigned long) queue->tail_cache - (unsigned long) head );
+    if( available < max_count )
+        {
+        queue->tail_cache = THREAD_QUEUE_LOAD_ACQUIRE( &queue->tail );
+        available = (int)( (unsigned long) queue->tail_cache - (unsigned long) head );
+        }
+    if( available == 0 )
+        {
+        if( !thread_internal_queue_park( queue, &queue->data_waiting, &queue->tail, head, timeout_ms ) )
+            return 0;
+        queue->tail_cache = THREAD_QUEUE_LOAD_ACQUIRE( &queue->tail );
+        available = (int)( (unsigned long) queue->tail_cache - (unsigned long) head );
+        }
+
+    int n = available < max_count ? available : max_count;
+    for( int i = 0; i < n; ++i )
+        {
+        values[ i ] = queue->values[ queue->head_slot ];
+        queue->head_slot = queue->head_slot + 1 == queue->size ? 0 : queue->head_slot + 1;
+        }
+    THREAD_QUEUE_STORE_RELEASE( &queue->head, head + n );
+    thread_internal_queue_wake( queue, &queue->space_waiting );
+    return n;
+    }
+
     
 int thread_queue_count( thread_queue_t* queue )
     {
-    return thread_atomic_int_load( &queue->count );
+    long head = THREAD_QUEUE_LOAD_ACQUIRE( &queue->head );
+    long tail = THREAD_QUEUE_LOAD_ACQUIRE( &queue->tail );
+    return (int)( (unsigned long) tail - (unsigned long) head );
+    }
+
+
+// Bounded MPMC queue after Dmitry Vyukov's design: every cell carries a sequence number which says whose turn it is. A 
+// cell at position `pos` is free for the producer claiming `pos` when its sequence equals `pos`, and holds a value for
+// the consumer claiming `pos` when it equals `pos + 1`. Claiming is a single CAS on the shared position, and batches
+// claim a run of consecutive cells with that same CAS.
+
+static long thread_internal_mpmc_diff( long a, long b )
+    {
+    return (long)( (unsigned long) a - (unsigned long) b );
+    }
+
+
+static int thread_internal_mpmc_push( thread_mpmc_queue_t* queue, void* const* values, int count )
+    {
+    long size = queue->mask + 1;
+    long pos = THREAD_QUEUE_LOAD_ACQUIRE( &queue->enqueue_pos );
+    for( ; ; )
+        {
+        long seq = THREAD_QUEUE_LOAD_ACQUIRE( &queue->cells[ pos & queue->mask ].sequence );
+        long diff = thread_internal_mpmc_diff( seq, pos );
+        if( diff < 0 ) return 0; // full
+        if( diff > 0 ) 
+            {
+            pos = THREAD_QUEUE_LOAD_ACQUIRE( &queue->enqueue_pos ); // another producer got there first
+            continue;
+            }
+        
+        long n = 1;
+        while( n < count && n < size && 
+            THREAD_QUEUE_LOAD_ACQUIRE( &queue->cells[ ( pos + n ) & queue->mask ].sequence ) == pos + n )
+            ++n;
+        if( THREAD_QUEUE_CAS( &queue->enqueue_pos, pos, pos + n ) )
+            {
+            for( long i = 0; i < n; ++i )
+                {
+                thread_mpmc_queue_cell_t* cell = &queue->cells[ ( pos + i ) & queue->mask ];
+                cell->value = values[ i ];
+                THREAD_QUEUE_STORE_RELEASE( &cell->sequence, pos + i + 1 );
+                }
+            return (int) n;
+            }
+        pos = THREAD_QUEUE_LOAD_ACQUIRE( &queue->enqueue_pos );
+        }
+    }
+
+
+static int thread_internal_mpmc_pop( thread_mpmc_queue_t* queue, void** values, int max_count )
+    {
+    long size = queue->mask + 1;
+    long pos = THREAD_QUEUE_LOAD_ACQUIRE( &queue->dequeue_pos );
+    for( ; ; )
+        {
+        long seq = THREAD_QUEUE_LOAD_ACQUIRE( &queue->cells[ pos & queue->mask ].sequence );
+        long diff = thread_internal_mpmc_diff( seq, pos + 1 );
+        if( diff < 0 ) return 0; // empty
+        if( diff > 0 ) 
+            {
+            pos = THREAD_QUEUE_LOAD_ACQUIRE( &queue->dequeue_pos ); // another consumer got there first
+            continue;
+            }
+
+        long n = 1;
+        while( n < max_count && n < size && 
+            THREAD_QUEUE_LOAD_ACQUIRE( &queue->cells[ ( pos + n ) & queue->mask ].sequence ) == pos + n + 1 )
+            ++n;
+        if( THREAD_QUEUE_CAS( &queue->dequeue_pos, pos, pos + n ) )
+            {
+            for( long i = 0; i < n; ++i )
+                {
+                thread_mpmc_queue_cell_t* cell = &queue->cells[ ( pos + i ) & queue->mask ];
+                values[ i ] = cell->value;
+                THREAD_QUEUE_STORE_RELEASE( &cell->sequence, pos + i + size );
+                }
+            return (int) n;
+            }
+        pos = THREAD_QUEUE_LOAD_ACQUIRE( &queue->dequeue_pos );
+        }
+    }
+
+
+static int thread_internal_mpmc_can_push( thread_mpmc_queue_t* queue )
+    {
+    long pos = THREAD_QUEUE_LOAD_ACQUIRE( &queue->enqueue_pos );
+    return THREAD_QUEUE_LOAD_ACQUIRE( &queue->cells[ pos & queue->mask ].sequence ) == pos;
+    }
+
+
+static int thread_internal_mpmc_can_pop( thread_mpmc_queue_t* queue )
+    {
+    long pos = THREAD_QUEUE_LOAD_ACQUIRE( &queue->dequeue_pos );
+    return THREAD_QUEUE_LOAD_ACQUIRE( &queue->cells[ pos & queue->mask ].sequence ) == pos + 1;
+    }
+
+
+// A raised thread_signal_t releases a single waiter, so whoever makes progress passes the wakeup on while there are 
+// still waiters and the queue still has items (or space) for them.
+static void thread_internal_mpmc_wake( thread_mpmc_queue_t* queue )
+    {
+    THREAD_QUEUE_FENCE();
+    if( THREAD_QUEUE_LOAD_ACQUIRE( &queue->data_waiters ) > 0 && thread_internal_mpmc_can_pop( queue ) )
+        thread_signal_raise( &queue->data_ready );
+    if( THREAD_QUEUE_LOAD_ACQUIRE( &queue->space_waiters ) > 0 && thread_internal_mpmc_can_push( queue ) )
+        thread_signal_raise( &queue->space_open );
+    }
+
+
+void thread_mpmc_queue_init( thread_mpmc_queue_t* queue, int size, thread_mpmc_queue_cell_t* cells )
+    {
+    #ifndef NDEBUG
+        assert( size >= 2 && ( size & ( size - 1 ) ) == 0 );
+    #endif
+    queue->cells = cells;
+    queue->mask = size - 1;
+    for( int i = 0; i < size; ++i ) 
+        {
+        cells[ i ].sequence = i;
+        cells[ i ].value = NULL;
+        }
+    queue->enqueue_pos = 0;
+    queue->dequeue_pos = 0;
+    queue->data_waiters = 0;
+    queue->space_waiters = 0;
+    thread_signal_init( &queue->data_ready );
+    thread_signal_init( &queue->space_open );
+    THREAD_QUEUE_FENCE();
+    }
+
+
+void thread_mpmc_queue_term( thread_mpmc_queue_t* queue )
+    {
+    thread_signal_term( &queue->space_open );
+    thread_signal_term( &queue->data_ready );
+    }
+
+
+int thread_mpmc_queue_produce_n( thread_mpmc_queue_t* queue, void* const* values, int count, int timeout_ms )
+    {
+    int done = 0;
+    unsigned int start = timeout_ms > 0 ? thread_internal_queue_now_ms() : 0;
+    while( done < count )
+        {
+        int n = thread_internal_mpmc_push( queue, values + done, count - done );
+        if( n > 0 )
+            {
+            done += n;
+            thread_internal_mpmc_wake( queue );
+            continue;
+            }
+        if( timeout_ms == 0 ) break;
+
+        int spin_count = thread_internal_queue_spin_count();
+        for( int i = 0; i < spin_count && !thread_internal_mpmc_can_push( queue ); ++i )
+            THREAD_QUEUE_PAUSE();
+        if( thread_internal_mpmc_can_push( queue ) ) continue;
+
+        int remaining = THREAD_SIGNAL_WAIT_INFINITE;
+        if( timeout_ms != THREAD_QUEUE_WAIT_INFINITE )
+            {
+            remaining = timeout_ms - (int)( thread_internal_queue_now_ms() - start );
+            if( remaining <= 0 ) break;
+            }
+        // announce ourselves before the last look, so a consumer either sees us or we see its progress
+        THREAD_QUEUE_ADD( &queue->space_waiters, 1 );
+        int woken = thread_internal_mpmc_can_push( queue ) || thread_signal_wait( &queue->space_open, remaining );
+        THREAD_QUEUE_ADD( &queue->space_waiters, -1 );
+        if( !woken ) break;
+        }
+    return done;
+    }
+
+
+int thread_mpmc_queue_consume_n( thread_mpmc_queue_t* queue, void** values, int max_count, int timeout_ms )
+    {
+    unsigned int start = timeout_ms > 0 ? thread_internal_queue_now_ms() : 0;
+    for( ; ; )
+        {
+        int n = thread_internal_mpmc_pop( queue, values, max_count );
+        if( n > 0 )
+            {
+            thread_internal_mpmc_wake( queue );
+            return n;
+            }
+        if( timeout_ms == 0 || max_count <= 0 ) return 0;
+
+        int spin_count = thread_internal_queue_spin_count();
+        for( int i = 0; i < spin_count && !thread_internal_mpmc_can_pop( queue ); ++i )
+            THREAD_QUEUE_PAUSE();
+        if( thread_internal_mpmc_can_pop( queue ) ) continue;
+
+        int remaining = THREAD_SIGNAL_WAIT_INFINITE;
+        if( timeout_ms != THREAD_QUEUE_WAIT_INFINITE )
+            {
+            remaining = timeout_ms - (int)( thread_internal_queue_now_ms() - start );
+            if( remaining <= 0 ) return 0;
+            }
+        // announce ourselves before the last look, so a producer either sees us or we see its progress
+        THREAD_QUEUE_ADD( &queue->data_waiters, 1 );
+        int woken = thread_internal_mpmc_can_pop( queue ) || thread_signal_wait( &queue->data_ready, remaining );
+        THREAD_QUEUE_ADD( &queue->data_waiters, -1 );
+        if( !woken ) return 0;
+        }
+    }
+
+
+int thread_mpmc_queue_produce( thread_mpmc_queue_t* queue, void* value, int timeout_ms )
+    {
+    return thread_mpmc_queue_produce_n( queue, &value, 1, timeout_ms );
+    }
+
+
+void* thread_mpmc_queue_consume( thread_mpmc_queue_t* queue, int timeout_ms )
+    {
+    void* value = NULL;
+    return thread_mpmc_queue_consume_n( queue, &value, 1, timeout_ms ) ? value : NULL;
+    }
+
+
+int thread_mpmc_queue_try_produce( thread_mpmc_queue_t* queue, void* value )
+    {
+    return thread_mpmc_queue_produce_n( queue, &value, 1, 0 );
+    }
+
+
+int thread_mpmc_queue_try_consume( thread_mpmc_queue_t* queue, void** value )
+    {
+    return thread_mpmc_queue_consume_n( queue, value, 1, 0 );
+    }
+
+
+int thread_mpmc_queue_count( thread_mpmc_queue_t* queue )
+    {
+    long head = THREAD_QUEUE_LOAD_ACQUIRE( &queue->dequeue_pos );
+    long tail = THREAD_QUEUE_LOAD_ACQUIRE( &queue->enqueue_pos );
+    long count = thread_internal_mpmc_diff( tail, head );
+    return count < 0 ? 0 : count > queue->mask + 1 ? (int)( queue->mask + 1 ) : (int) count;
     }
 
 